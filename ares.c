@@ -0,0 +1,2023 @@
+/*
+ * ares.c -- resolve quick mode tracy output
+ *
+ * {{{
+ * This program makes `tracy -quick' and `tracy -binary' output human
+ * readable by translating the function addresses to their names using
+ * the symbol table libtracy appends to the trace when the program exits.
+ * It does the same as ares.pl, only much faster: the trace is mapped into
+ * memory rather than read twice, and it's cut into chunks, which are
+ * translated by as many threads as there are CPUs.
+ *
+ * Usage: ares [-F <format>] [-j <threads>] [-s <symtab>] [-d <debugdir>]
+ *             [<trace>]
+ *        ares [-F <format>] [-d <debugdir>] -f <region>
+ *
+ * -F <format>:		What to translate binary and followed traces to:
+ *			"text" (the default), "chrome" for the JSON trace
+ *			event format of chrome://tracing and ui.perfetto.dev,
+ *			or "perfetto" for the protobuf trace format of Perfetto.
+ *			The latter two need $TRACY_LOG_TIME to be useful.
+ * -j <threads>:	How many threads to translate with.
+ * -d <debugdir>:	Where to look for the separate debug files by build ID
+ *			(/usr/lib/debug by default).
+ * -s <symtab>:		Take the symbol table from this file rather than from
+ *			the end of the trace.  It can be a trace of an earlier
+ *			run of the same program or just the "SYMTAB:" part of
+ *			it.  Then the trace may be a file still being written,
+ *			and ares translates it as it comes.  The same goes if
+ *			the trace is a pipe.
+ * -f <region>:		Follow the trace of a running program, which is
+ *			writing it into this $TRACY_SHM region, until the
+ *			program exits.  The events are printed like those
+ *			of binary traces, in batches of each thread.
+ *
+ * The trace is read from the standard input if not specified, and the
+ * translation is printed on the standard output.  Text traces are printed
+ * as they are, except that the "[<address>]" of the functions is replaced
+ * by their name.  Binary traces are printed like text traces with
+ * $TRACY_LOG_TID (and $TRACY_LOG_TIME if it was on).
+ *
+ * Traces made with $TRACY_OFFLINE don't have a symbol table, but a load map
+ * of the DSOs of the program.  Then ares looks up the functions in the ELF
+ * files, or in their debug files if they can be found by the build ID.
+ * Such traces are complete even if the program was killed, and don't need
+ * -s to be translated as they come.
+ *
+ * Compile with gcc -Wall -O2 -pthread ares.c -o ares -lrt.  `tracinst' does it.
+ * }}}
+ */
+
+/* Configuration */
+/* For memrchr() */
+#define _GNU_SOURCE
+
+/* Include files */
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <elf.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "tracy.h"
+
+/* Macros */
+/* The size of the buffer of the made-up function names, see get_name(). */
+#define NAME_BUF		320
+
+/* The fields of the Perfetto trace protos we write, see trace_packet.proto,
+ * track_event.proto, track_descriptor.proto and interned_data.proto. */
+#define PB_TRACE_PACKET		1	/* Trace.packet */
+#define PB_TIMESTAMP		8	/* TracePacket.timestamp */
+#define PB_SEQUENCE_ID		10	/* .trusted_packet_sequence_id */
+#define PB_TRACK_EVENT		11	/* .track_event */
+#define PB_INTERNED_DATA	12	/* .interned_data */
+#define PB_SEQUENCE_FLAGS	13	/* .sequence_flags */
+#define PB_TRACK_DESCRIPTOR	60	/* .track_descriptor */
+#define PB_EVENT_TYPE		9	/* TrackEvent.type */
+#define PB_EVENT_NAME_IID	10	/* TrackEvent.name_iid */
+#define PB_EVENT_TRACK		11	/* TrackEvent.track_uuid */
+#define PB_EVENT_NAMES		2	/* InternedData.event_names */
+#define PB_NAME_IID		1	/* EventName.iid */
+#define PB_NAME			2	/* EventName.name */
+#define PB_TRACK_UUID		1	/* TrackDescriptor.uuid */
+#define PB_TRACK_THREAD		4	/* TrackDescriptor.thread */
+#define PB_THREAD_PID		1	/* ThreadDescriptor.pid */
+#define PB_THREAD_TID		2	/* ThreadDescriptor.tid */
+
+#define PB_SLICE_BEGIN		1	/* TrackEvent.Type */
+#define PB_SLICE_END		2
+#define PB_STATE_CLEARED	1	/* TracePacket.SequenceFlags */
+#define PB_NEEDS_STATE		2
+
+/* Type definitions {{{ */
+/* Use the appropriate ELF types for this platform. */
+#if __LP64__
+typedef Elf64_Ehdr Elf_Ehdr;
+typedef Elf64_Shdr Elf_Shdr;
+typedef Elf64_Sym  Elf_Sym;
+typedef Elf64_Nhdr Elf_Nhdr;
+# define ELF_CLASS	ELFCLASS64
+# define ELF_ST_TYPE	ELF64_ST_TYPE
+#else /* we're 32-bit */
+typedef Elf32_Ehdr Elf_Ehdr;
+typedef Elf32_Shdr Elf_Shdr;
+typedef Elf32_Sym  Elf_Sym;
+typedef Elf32_Nhdr Elf_Nhdr;
+# define ELF_CLASS	ELFCLASS32
+# define ELF_ST_TYPE	ELF32_ST_TYPE
+#endif
+
+/* An entry of the symbol table: the .name of .addr, which is not
+ * NUL-terminated.  Empty entries have NULL .name. */
+struct sym_st
+{
+	unsigned long long addr;
+	char const *name;
+	size_t len;
+};
+
+/* A function symbol of a DSO, .name formatted like libtracy does. */
+struct msym_st
+{
+	unsigned long long addr, size;
+	char const *name;
+	size_t len;
+};
+
+/* A DSO mapped in the traced program from .start to .end (not included),
+ * and its function symbols sorted by address. */
+struct module_st
+{
+	unsigned long long start, end;
+	char const *path, *fname;
+	struct msym_st *syms;
+	unsigned nsyms;
+};
+
+/* A hash table mapping .keys to consecutive IDs starting from 1.
+ * Empty entries have 0 .id.  See intern(). */
+struct intern_st
+{
+	unsigned long long key, id;
+};
+
+struct table_st
+{
+	struct intern_st *entries;
+	unsigned size, used;
+};
+
+/*
+ * A chunk of the trace from .start to .end, translated by a thread
+ * into .out of .size bytes, which has .len bytes in it.  .stop is set
+ * if the chunk contained the end of the trace.  In $FORMAT_PERFETTO
+ * each chunk is a packet sequence of its own, with the ID .sequence,
+ * the function .names interned in it and the threads whose .tracks
+ * have been described; .cleared tells whether the first packet has
+ * been written.
+ */
+struct job_st
+{
+	char const *start, *end;
+	char *out;
+	size_t len, size;
+	int stop;
+	pthread_t thread;
+
+	unsigned long long sequence;
+	struct table_st names, tracks;
+	int cleared;
+};
+/* }}} */
+
+/* Private variables {{{ */
+/* The symbol table, a hash table of $Symtab_size entries keyed by the
+ * address, $Nsyms of them used. */
+static struct sym_st *Symtab;
+static unsigned Symtab_size, Nsyms;
+
+/* The DSOs of the load map sorted by address, and where to look for
+ * their separate debug files. */
+static struct module_st *Modules;
+static unsigned Nmodules;
+static char const *Debug_dir = "/usr/lib/debug";
+
+/* Whether we're translating a binary trace, whether its timestamps
+ * are valid, and the PID of the traced program if it's known. */
+static int Binary, Has_time;
+static unsigned Pid;
+
+/* What to translate the binary traces to, and how many packet sequences
+ * have been started in $FORMAT_PERFETTO. */
+static enum { FORMAT_TEXT, FORMAT_CHROME, FORMAT_PERFETTO } Format;
+static unsigned long long Nsequences;
+
+/* How many threads work on how large chunks, and the current chunks. */
+static unsigned Nthreads;
+static size_t Chunk_size = 4 * 1024 * 1024;
+static struct job_st *Jobs;
+
+/* Set when the end of the trace has been found. */
+static int Done;
+/* }}} */
+
+/* Program code */
+/* Utilities {{{ */
+/* Prints an error message and exits. */
+static void __attribute__((noreturn, format(printf, 1, 2)))
+die(char const *fmt, ...)
+{
+	va_list args;
+
+	fputs("ares: ", stderr);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	exit(1);
+} /* die */
+
+/* Like realloc(), but doesn't return on failure. */
+static void *xrealloc(void *ptr, size_t size)
+{
+	if (!(ptr = realloc(ptr, size)))
+		die("realloc(%zu): %m", size);
+	return ptr;
+} /* xrealloc */
+
+/* Writes all of $buf to the standard output. */
+static void write_all(void const *buf, size_t len)
+{
+	ssize_t n;
+
+	for (; len > 0; buf += n, len -= n)
+		if ((n = write(STDOUT_FILENO, buf, len)) < 0)
+		{
+			if (errno != EINTR)
+				die("write: %m");
+			n = 0;
+		}
+} /* write_all */
+
+/* Makes room for $n more bytes in $job's output and returns where
+ * they should be written. */
+static char *reserve(struct job_st *job, size_t n)
+{
+	if (job->len + n > job->size)
+	{
+		job->size = 2 * (job->len + n);
+		job->out = xrealloc(job->out, job->size);
+	}
+	return &job->out[job->len];
+} /* reserve */
+
+/* Appends $n bytes of $str to $job's output. */
+static void append(struct job_st *job, char const *str, size_t n)
+{
+	memcpy(reserve(job, n), str, n);
+	job->len += n;
+} /* append */
+
+/* Reads a varint from $*pp, which mustn't go beyond $end.
+ * Returns 0 if it does. */
+static int get_varint(char const **pp, char const *end,
+	unsigned long long *np)
+{
+	unsigned shift;
+	char const *p;
+
+	*np = 0;
+	for (p = *pp, shift = 0; p < end && shift < 64; shift += 7)
+	{
+		*np |= (unsigned long long)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80))
+		{
+			*pp = p;
+			return 1;
+		}
+	}
+
+	return 0;
+} /* get_varint */
+
+/* Undoes libtracy's zigzag(). */
+static long long unzigzag(unsigned long long n)
+{
+	return (long long)(n >> 1) ^ -(long long)(n & 1);
+} /* unzigzag */
+
+/* Returns the end of the section at $p, or NULL if it's incomplete. */
+static char const *skip_section(char const *p, char const *end)
+{
+	unsigned long long tid, n, len;
+
+	if (p >= end)
+		return NULL;
+
+	switch (*p++)
+	{
+	case BIN_EVENTS:
+		if (!get_varint(&p, end, &tid) || !get_varint(&p, end, &n)
+				|| !get_varint(&p, end, &len))
+			return NULL;
+		return len <= end - p ? p + len : NULL;
+	case BIN_DROPPED:
+		if (!get_varint(&p, end, &tid) || !get_varint(&p, end, &n))
+			return NULL;
+		return p;
+	case BIN_SYMTAB:
+		if (!get_varint(&p, end, &len))
+			return NULL;
+		return len <= end - p ? p + len : NULL;
+	case BIN_END:
+		return end - p >= 8 ? p + 8 : NULL;
+	case BIN_PROCESS:
+		return get_varint(&p, end, &n) ? p : NULL;
+	case BIN_MAP:
+		if (!get_varint(&p, end, &tid) || !get_varint(&p, end, &n)
+				|| !get_varint(&p, end, &n)
+				|| !get_varint(&p, end, &len) || len > end - p)
+			return NULL;
+		p += len;
+		if (!get_varint(&p, end, &len))
+			return NULL;
+		return len <= end - p ? p + len : NULL;
+	default:
+		die("unknown section %u", (unsigned char)p[-1]);
+	}
+} /* skip_section */
+/* }}} */
+
+/* The symbol table {{{ */
+/* Returns the slot of $addr in $Symtab: its entry or an empty one. */
+static struct sym_st *find_sym(unsigned long long addr)
+{
+	unsigned long long h;
+	struct sym_st *sym;
+
+	/* Fibonacci hashing, like libtracy's address cache. */
+	h = addr * 0x9E3779B97F4A7C15ULL;
+	for (h ^= h >> 29;; h++)
+	{
+		sym = &Symtab[h & (Symtab_size - 1)];
+		if (!sym->name || sym->addr == addr)
+			return sym;
+	}
+} /* find_sym */
+
+/* Adds $addr to the symbol table unless it's already there. */
+static void add_sym(unsigned long long addr, char const *name, size_t len)
+{
+	struct sym_st *sym;
+
+	if (Nsyms >= Symtab_size / 2)
+	{	/* Rehash to a table twice as large. */
+		unsigned i, size;
+		struct sym_st *old;
+
+		old = Symtab;
+		size = Symtab_size;
+		Symtab_size = size ? 2 * size : 1024;
+		if (!(Symtab = calloc(Symtab_size, sizeof(*Symtab))))
+			die("calloc: %m");
+		for (i = 0; i < size; i++)
+			if (old[i].name)
+				*find_sym(old[i].addr) = old[i];
+		free(old);
+	}
+
+	sym = find_sym(addr);
+	if (sym->name)
+		return;
+	sym->addr = addr;
+	sym->name = name;
+	sym->len  = len;
+	Nsyms++;
+} /* add_sym */
+
+/* Returns the start of the "SYMTAB:" line in the text trace,
+ * or NULL if there's no such line. */
+static char const *find_text_symtab(char const *buf, size_t len)
+{
+	char const *eol;
+
+	/* Look for it from the end, because it's near. */
+	for (eol = &buf[len]; eol > buf; eol--)
+	{
+		char const *line;
+
+		if (!(line = memrchr(buf, '\n', eol - buf)))
+			break;
+		eol = line + 1;
+		if (!(line = memrchr(buf, '\n', eol - 1 - buf)))
+			line = buf;
+		else
+			line++;
+
+		if (eol - 1 - line >= 7 && !memcmp(eol - 8, "SYMTAB:", 7)
+			&& (eol - 8 == line || eol[-9] == ' '
+				|| eol[-9] == ':'))
+			return line;
+	} /* for */
+
+	return NULL;
+} /* find_text_symtab */
+
+/* Loads the "<address> = <name>" lines of a text symbol table. */
+static void load_text_symtab(char const *p, char const *end)
+{
+	while (p < end)
+	{
+		char const *eol, *hex;
+
+		if (!(eol = memchr(p, '\n', end - p)))
+			eol = end;
+
+		/* Find the first "0x<hex> = " in the line. */
+		for (hex = p; (hex = memmem(hex, eol - hex, "0x", 2)) != NULL;
+			hex += 2)
+		{
+			unsigned long long addr;
+			char const *q;
+
+			addr = 0;
+			for (q = hex + 2; q < eol; q++)
+				if (*q >= '0' && *q <= '9')
+					addr = addr*16 + *q - '0';
+				else if (*q >= 'a' && *q <= 'f')
+					addr = addr*16 + *q - 'a' + 10;
+				else
+					break;
+
+			if (q > hex + 2 && eol - q >= 3
+				&& !memcmp(q, " = ", 3))
+			{
+				add_sym(addr, q + 3, eol - q - 3);
+				break;
+			}
+		} /* for */
+
+		p = eol + 1;
+	} /* while */
+} /* load_text_symtab */
+
+/* Loads the BIN_SYMTAB sections starting at $p. */
+static void load_binary_symtab(char const *p, char const *end)
+{
+	while (p < end && *p == BIN_SYMTAB)
+	{
+		unsigned long long len;
+		char const *send;
+
+		p++;
+		if (!get_varint(&p, end, &len) || len > end - p)
+			die("truncated symbol table");
+
+		for (send = p + len; p < send; )
+		{
+			unsigned long long addr, flen, flen2;
+			char const *fname, *funame;
+			char *name;
+			int resolved;
+
+			if (!get_varint(&p, send, &addr) || p >= send)
+				die("truncated symbol table");
+			resolved = *p++;
+			if (!get_varint(&p, send, &flen) || flen > send - p)
+				die("truncated symbol table");
+			fname = p;
+			p += flen;
+			if (!get_varint(&p, send, &flen2) || flen2 > send - p)
+				die("truncated symbol table");
+			funame = p;
+			p += flen2;
+
+			/* Format it like resolve_backlog() does. */
+			name = xrealloc(NULL, flen + flen2 + 32);
+			if (resolved)
+				sprintf(name, "%.*s:%.*s()", (int)flen, fname,
+					(int)flen2, funame);
+			else
+				sprintf(name, "%.*s:[%#llx]", (int)flen, fname,
+					addr);
+			add_sym(addr, name, strlen(name));
+		} /* for */
+	} /* while */
+} /* load_binary_symtab */
+
+/* Dies unless the header of the binary trace $fname in $buf is of
+ * a version of the format we understand. */
+static void check_version(char const *fname, char const *buf)
+{
+	unsigned version;
+
+	version = (unsigned char)buf[6];
+	if (!version || version > TRACY_VERSION)
+		die("%s: unknown version %u", fname, version);
+} /* check_version */
+
+/* Returns where the BIN_SYMTAB sections start in the binary trace
+ * of $len bytes in $buf, or NULL if it's incomplete. */
+static char const *find_binary_symtab(char const *buf, size_t len)
+{
+	unsigned i;
+	unsigned long long offset;
+	unsigned char const *end;
+
+	if (len < 8 + 9 || buf[len - 9] != BIN_END)
+		return NULL;
+
+	end = (unsigned char const *)&buf[len - 8];
+	for (offset = 0, i = 0; i < 8; i++)
+		offset |= (unsigned long long)end[i] << (8 * i);
+	return offset >= 8 && offset <= len - 9 ? &buf[offset] : NULL;
+} /* find_binary_symtab */
+
+/* Loads the symbol table from the file at $fname. */
+static void load_symtab_file(char const *fname)
+{
+	int fd;
+	struct stat sbuf;
+	char const *buf, *symtab;
+
+	if ((fd = open(fname, O_RDONLY)) < 0)
+		die("%s: %m", fname);
+	if (fstat(fd, &sbuf) < 0)
+		die("%s: %m", fname);
+	if (!sbuf.st_size)
+		die("%s: empty", fname);
+
+	/* The names point into $buf, so it's never unmapped. */
+	if ((buf = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+			== MAP_FAILED)
+		die("%s: mmap: %m", fname);
+	close(fd);
+
+	if (sbuf.st_size >= 8 && !memcmp(buf, TRACY_MAGIC, 6))
+	{
+		check_version(fname, buf);
+		if (!(symtab = find_binary_symtab(buf, sbuf.st_size)))
+			die("%s: no symbol table", fname);
+		load_binary_symtab(symtab, &buf[sbuf.st_size]);
+	} else if ((symtab = find_text_symtab(buf, sbuf.st_size)) != NULL)
+		load_text_symtab(symtab, &buf[sbuf.st_size]);
+	else	/* Maybe it's just the "<address> = <name>" lines. */
+		load_text_symtab(buf, &buf[sbuf.st_size]);
+} /* load_symtab_file */
+/* }}} */
+
+/* Offline symbolization {{{ */
+/*
+ * Traces made with $TRACY_OFFLINE have no symbol table, only the load map
+ * of the DSOs, so we look up the functions in the ELF files ourselves.
+ * The symbols are taken from the separate debug file if there is one
+ * for the build ID, otherwise from the .symtab or the .dynsym of the DSO.
+ * The maps are loaded by scan_maps() before the chunk of the trace they're
+ * in is translated, so the threads only read $Modules.
+ */
+/* Returns the contents of $fname mapped into memory and its size in $sizep,
+ * or NULL if it's not there. */
+static void const *map_file(char const *fname, size_t *sizep)
+{
+	int fd;
+	struct stat sbuf;
+	void const *file;
+
+	if ((fd = open(fname, O_RDONLY)) < 0)
+		return NULL;
+
+	file = NULL;
+	if (fstat(fd, &sbuf) == 0 && sbuf.st_size >= sizeof(Elf_Ehdr))
+	{
+		*sizep = sbuf.st_size;
+		if ((file = mmap(NULL, *sizep, PROT_READ, MAP_PRIVATE, fd, 0))
+				== MAP_FAILED)
+			file = NULL;
+	}
+
+	close(fd);
+	return file;
+} /* map_file */
+
+/* Returns whether $file of $size is an ELF file we can read,
+ * and its section headers in $shdrsp. */
+static int is_elf(void const *file, size_t size, Elf_Shdr const **shdrsp)
+{
+	Elf_Ehdr const *elf;
+
+	elf = file;
+	if (memcmp(elf->e_ident, ELFMAG, SELFMAG)
+			|| elf->e_ident[EI_CLASS] != ELF_CLASS
+			|| elf->e_shentsize != sizeof(Elf_Shdr)
+			|| elf->e_shoff + (size_t)elf->e_shnum*sizeof(Elf_Shdr)
+				> size)
+		return 0;
+
+	*shdrsp = file + elf->e_shoff;
+	return 1;
+} /* is_elf */
+
+/* Returns whether the build ID of $file of $size is the $idlen bytes
+ * of $id. */
+static int same_buildid(void const *file, size_t size,
+	unsigned char const *id, unsigned idlen)
+{
+	unsigned i;
+	Elf_Shdr const *shdrs;
+
+	if (!is_elf(file, size, &shdrs))
+		return 0;
+
+	for (i = 0; i < ((Elf_Ehdr const *)file)->e_shnum; i++)
+	{
+		char const *p, *end;
+		unsigned align;
+
+		if (shdrs[i].sh_type != SHT_NOTE
+				|| shdrs[i].sh_offset + shdrs[i].sh_size > size)
+			continue;
+
+		/* Like get_buildid() in libtracy. */
+		align = shdrs[i].sh_addralign == 8 ? 8 : 4;
+		p = file + shdrs[i].sh_offset;
+		end = p + shdrs[i].sh_size;
+		while (p + sizeof(Elf_Nhdr) <= end)
+		{
+			Elf_Nhdr const *note;
+			char const *name, *desc;
+
+			note = (Elf_Nhdr const *)p;
+			name = p + sizeof(*note);
+			desc = name + ((note->n_namesz + align-1) & ~(align-1));
+			if (note->n_type == NT_GNU_BUILD_ID
+					&& note->n_namesz == 4
+					&& !memcmp(name, "GNU", 4))
+				return note->n_descsz == idlen
+					&& desc + idlen <= end
+					&& !memcmp(desc, id, idlen);
+			p = desc + ((note->n_descsz + align-1) & ~(align-1));
+		}
+	} /* for */
+
+	return 0;
+} /* same_buildid */
+
+/* Orders msym_st:s by address, and aliases by name for qsort(). */
+static int cmpmsyms(void const *lhs, void const *rhs)
+{
+	struct msym_st const *l = lhs, *r = rhs;
+
+	if (l->addr != r->addr)
+		return l->addr < r->addr ? -1 : 1;
+	return strcmp(l->name, r->name);
+} /* cmpmsyms */
+
+/* Loads the function symbols of $file of $size into $mod, which is
+ * loaded at $base.  Returns 0 if it doesn't have any. */
+static int load_msyms(struct module_st *mod, void const *file, size_t size,
+	unsigned long long base)
+{
+	int type;
+	unsigned i, n;
+	Elf_Shdr const *shdrs, *symsec;
+
+	if (!is_elf(file, size, &shdrs))
+		return 0;
+
+	/* Prefer the full symbol table.  Its string table is its sh_link. */
+	symsec = NULL;
+	for (type = SHT_SYMTAB; !symsec && type; type = type == SHT_SYMTAB
+			? SHT_DYNSYM : 0)
+		for (i = 0; i < ((Elf_Ehdr const *)file)->e_shnum; i++)
+			if (shdrs[i].sh_type == type
+				&& shdrs[i].sh_link
+					< ((Elf_Ehdr const *)file)->e_shnum
+				&& shdrs[i].sh_offset + shdrs[i].sh_size
+					<= size)
+			{
+				symsec = &shdrs[i];
+				break;
+			}
+	if (!symsec)
+		return 0;
+
+	n = symsec->sh_size / sizeof(Elf_Sym);
+	mod->syms = xrealloc(NULL, sizeof(*mod->syms) * (n + 1));
+	for (mod->nsyms = 0, i = 0; i < n; i++)
+	{
+		Elf_Sym const *sym;
+		Elf_Shdr const *strsec;
+		char const *funame;
+		char *name;
+		size_t len;
+
+		sym = (Elf_Sym const *)(file + symsec->sh_offset) + i;
+		if ((ELF_ST_TYPE(sym->st_info) != STT_FUNC
+				&& ELF_ST_TYPE(sym->st_info) != STT_GNU_IFUNC)
+				|| sym->st_shndx == SHN_UNDEF || !sym->st_value)
+			continue;
+
+		strsec = &shdrs[symsec->sh_link];
+		if (sym->st_name >= strsec->sh_size
+				|| strsec->sh_offset + strsec->sh_size > size)
+			continue;
+		funame = file + strsec->sh_offset + sym->st_name;
+		len = strnlen(funame, strsec->sh_size - sym->st_name);
+
+		/* Format it like libtracy does. */
+		name = xrealloc(NULL, strlen(mod->fname) + len + 4);
+		mod->syms[mod->nsyms].len = sprintf(name, "%s:%.*s()",
+			mod->fname, (int)len, funame);
+		mod->syms[mod->nsyms].name = name;
+		mod->syms[mod->nsyms].addr = base + sym->st_value;
+		mod->syms[mod->nsyms].size = sym->st_size;
+		mod->nsyms++;
+	} /* for */
+
+	/* Drop the aliases. */
+	qsort(mod->syms, mod->nsyms, sizeof(*mod->syms), cmpmsyms);
+	for (n = 0, i = 0; i < mod->nsyms; i++)
+		if (n > 0 && mod->syms[n-1].addr == mod->syms[i].addr)
+			free((char *)mod->syms[i].name);
+		else
+			mod->syms[n++] = mod->syms[i];
+	mod->nsyms = n;
+
+	return n > 0;
+} /* load_msyms */
+
+/* Adds a DSO of $path loaded at $base from $start to $end to $Modules,
+ * replacing whatever was there before. */
+static void add_module(unsigned long long base, unsigned long long start,
+	unsigned long long end, char const *path, size_t pathlen,
+	unsigned char const *id, unsigned idlen)
+{
+	unsigned i, j;
+	char const *fname;
+	struct module_st *mod;
+	char *fpath;
+
+	for (i = 0; i < Nmodules; i++)
+		if (Modules[i].start == start
+				&& !strncmp(Modules[i].path, path, pathlen)
+				&& !Modules[i].path[pathlen])
+			/* Already have it. */
+			return;
+
+	/* Remove the modules which have been unloaded (and overlap). */
+	for (i = j = 0; i < Nmodules; i++)
+		if (Modules[i].end <= start || end <= Modules[i].start)
+			Modules[j++] = Modules[i];
+	Nmodules = j;
+
+	/* Insert it to its place. */
+	Modules = xrealloc(Modules, sizeof(*Modules) * (Nmodules + 1));
+	for (i = Nmodules; i > 0 && Modules[i-1].start > start; i--)
+		Modules[i] = Modules[i-1];
+	mod = &Modules[i];
+	Nmodules++;
+
+	memset(mod, 0, sizeof(*mod));
+	mod->start = start;
+	mod->end = end;
+	fpath = xrealloc(NULL, pathlen + 1);
+	memcpy(fpath, path, pathlen);
+	fpath[pathlen] = '\0';
+	mod->path = fpath;
+	mod->fname = (fname = strrchr(fpath, '/')) ? fname + 1 : fpath;
+
+	/* The kernel's vDSO is not a file. */
+	if (!strchr(fpath, '/'))
+		return;
+
+	/* Try the separate debug file first. */
+	if (idlen > 0)
+	{
+		char *dbg, *p;
+		void const *file;
+		size_t size;
+
+		dbg = xrealloc(NULL, strlen(Debug_dir) + 2*idlen + 32);
+		p = dbg + sprintf(dbg, "%s/.build-id/%.2x/", Debug_dir, id[0]);
+		for (i = 1; i < idlen; i++)
+			p += sprintf(p, "%.2x", id[i]);
+		strcpy(p, ".debug");
+
+		if ((file = map_file(dbg, &size)) != NULL)
+		{
+			i = load_msyms(mod, file, size, base);
+			munmap((void *)file, size);
+			if (i)
+			{
+				free(dbg);
+				return;
+			}
+		}
+		free(dbg);
+	}
+
+	/* Then the DSO itself, if it hasn't been changed since. */
+	{
+		void const *file;
+		size_t size;
+
+		if (!(file = map_file(fpath, &size)))
+			fprintf(stderr, "ares: %s: %m\n", fpath);
+		else if (idlen > 0 && !same_buildid(file, size, id, idlen))
+			fprintf(stderr, "ares: %s: not the same file as in the "
+				"trace\n", fpath);
+		else if (!load_msyms(mod, file, size, base))
+			fprintf(stderr, "ares: %s: no symbols\n", fpath);
+		if (file)
+			munmap((void *)file, size);
+	}
+} /* add_module */
+
+/* Loads the "MAP: <start>-<end> <base> <build ID> <path>" lines
+ * from $p to $end. */
+static void scan_text_maps(char const *p, char const *end)
+{
+	while ((p = memmem(p, end - p, "MAP: 0x", 7)) != NULL)
+	{
+		unsigned long long start, stop, base;
+		unsigned char id[64];
+		unsigned idlen;
+		char const *eol;
+		char *q;
+
+		p += 5;
+		if (!(eol = memchr(p, '\n', end - p)))
+			eol = end;
+
+		start = strtoull(p, &q, 16);
+		if (*q != '-')
+			continue;
+		stop = strtoull(q + 1, &q, 16);
+		if (*q != ' ')
+			continue;
+		base = strtoull(q + 1, &q, 16);
+		if (*q != ' ')
+			continue;
+
+		idlen = 0;
+		for (q++; q + 1 < eol && *q != ' ' && *q != '-'; q += 2)
+		{
+			unsigned x;
+
+			if (idlen >= sizeof(id) || sscanf(q, "%2x", &x) != 1)
+				break;
+			id[idlen++] = x;
+		}
+		if (*q == '-')
+			q++;
+		if (*q != ' ')
+			continue;
+
+		add_module(base, start, stop, q + 1, eol - q - 1, id, idlen);
+		p = eol;
+	} /* while */
+} /* scan_text_maps */
+
+/* Loads the BIN_MAP sections from $p to $end, and takes the $Pid from
+ * BIN_PROCESS. */
+static void scan_binary_maps(char const *p, char const *end)
+{
+	char const *next;
+
+	for (; p < end && (next = skip_section(p, end)) != NULL; p = next)
+	{
+		unsigned long long base, start, stop, pathlen, idlen;
+		char const *path;
+
+		if (*p == BIN_PROCESS)
+		{
+			p++;
+			if (get_varint(&p, next, &base))
+				Pid = base;
+			continue;
+		} else if (*p++ != BIN_MAP)
+			continue;
+
+		if (!get_varint(&p, next, &base)
+				|| !get_varint(&p, next, &start)
+				|| !get_varint(&p, next, &stop)
+				|| !get_varint(&p, next, &pathlen))
+			continue;
+		path = p;
+		p += pathlen;
+		if (!get_varint(&p, next, &idlen) || idlen > next - p)
+			continue;
+		add_module(base, start, stop, path, pathlen,
+			(unsigned char const *)p, idlen);
+	}
+} /* scan_binary_maps */
+
+/* Returns the symbol of the function at $addr in $modp's DSO, or NULL if
+ * it's not known.  $*modp is NULL if we don't know its DSO either. */
+static struct msym_st const *find_msym(unsigned long long addr,
+	struct module_st const **modp)
+{
+	unsigned lo, hi, mid;
+	struct module_st const *mod;
+
+	/* Find the last module starting before $addr, then the last
+	 * symbol likewise. */
+	*modp = NULL;
+	for (lo = 0, hi = Nmodules; lo < hi; )
+	{
+		mid = lo + (hi - lo) / 2;
+		if (Modules[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || Modules[lo-1].end <= addr)
+		return NULL;
+	*modp = mod = &Modules[lo-1];
+
+	for (lo = 0, hi = mod->nsyms; lo < hi; )
+	{
+		mid = lo + (hi - lo) / 2;
+		if (mod->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || (mod->syms[lo-1].size
+			&& addr >= mod->syms[lo-1].addr + mod->syms[lo-1].size))
+		return NULL;
+	return &mod->syms[lo-1];
+} /* find_msym */
+
+/* Returns the name of the function at $addr and its length in $lenp,
+ * which may be formatted in $buf, or NULL if we don't know anything
+ * about it. */
+static char const *get_name(unsigned long long addr, char buf[NAME_BUF],
+	size_t *lenp)
+{
+	struct sym_st const *sym;
+	struct msym_st const *msym;
+	struct module_st const *mod;
+
+	if (Nsyms > 0 && (sym = find_sym(addr))->name != NULL)
+	{
+		*lenp = sym->len;
+		return sym->name;
+	} else if ((msym = find_msym(addr, &mod)) != NULL)
+	{
+		*lenp = msym->len;
+		return msym->name;
+	} else if (mod)
+	{
+		*lenp = snprintf(buf, NAME_BUF, "%s:[%#llx]",
+			mod->fname, addr);
+		if (*lenp >= NAME_BUF)
+			*lenp = NAME_BUF - 1;
+		return buf;
+	} else
+		return NULL;
+} /* get_name */
+
+/* Appends the name of the function at $addr to $job's output
+ * and returns 1, or returns 0 if we don't know anything about it. */
+static int put_name(struct job_st *job, unsigned long long addr)
+{
+	char buf[NAME_BUF];
+	char const *name;
+	size_t len;
+
+	if (!(name = get_name(addr, buf, &len)))
+		return 0;
+	append(job, name, len);
+	return 1;
+} /* put_name */
+/* }}} */
+
+/* Text traces {{{ */
+/*
+ * Returns the end of the complete lines in $buf..$end, but not more than
+ * about $limit if there are more (at least one line, though).  If the last
+ * line is not terminated it's only included if $eof.  Returns $buf if
+ * there's not a complete line.
+ */
+static char const *text_boundary(char const *buf, char const *limit,
+	char const *end, int eof)
+{
+	char const *nl;
+
+	if (limit < end && (nl = memrchr(buf, '\n', limit - buf)) != NULL)
+		return nl + 1;
+	if ((nl = memchr(limit, '\n', end - limit)) != NULL)
+		return nl + 1;
+	if ((nl = memrchr(buf, '\n', end - buf)) != NULL)
+		return nl + 1;
+	return eof ? end : buf;
+} /* text_boundary */
+
+/* Translates the lines of $job. */
+static void translate_text(struct job_st *job)
+{
+	char const *line, *eol;
+
+	for (line = job->start; line < job->end; line = eol)
+	{
+		char const *lbr, *rbr, *p;
+		unsigned long long addr;
+		size_t len;
+
+		if (!(eol = memchr(line, '\n', job->end - line)))
+			eol = job->end;
+		else
+			eol++;
+
+		/* The trailer starts at "SYMTAB:". */
+		rbr = eol > line && eol[-1] == '\n' ? eol - 1 : eol;
+		if (rbr - line >= 7 && !memcmp(rbr - 7, "SYMTAB:", 7))
+		{
+			job->stop = 1;
+			break;
+		}
+
+		/*
+		 * Look for "]<spaces>[0x<hex>]" at the end of the line,
+		 * which is how format_event() prints the functions in async
+		 * mode after the depth.
+		 */
+		len = job->len;
+		if (rbr > line && rbr[-1] == ']'
+			&& (lbr = memrchr(line, '[', rbr - line)) != NULL
+			&& lbr > line && lbr[-1] == ' '
+			&& rbr - lbr > 3 && lbr[1] == '0' && lbr[2] == 'x')
+		{
+			char const *depth;
+
+			for (addr = 0, p = lbr + 3; p < rbr - 1; p++)
+				if (*p >= '0' && *p <= '9')
+					addr = addr*16 + *p - '0';
+				else if (*p >= 'a' && *p <= 'f')
+					addr = addr*16 + *p - 'a' + 10;
+				else
+					break;
+			for (depth = lbr - 1; depth > line && *depth == ' ';
+				depth--)
+				;
+
+			/* Is it all hex digits and comes after the depth? */
+			if (p == rbr - 1 && *depth == ']')
+			{
+				append(job, line, lbr - line);
+				if (put_name(job, addr))
+				{
+					append(job, rbr, eol - rbr);
+					continue;
+				}
+			}
+		}
+
+		/* Leave the line as it is. */
+		job->len = len;
+		append(job, line, eol - line);
+	} /* for */
+} /* translate_text */
+/* }}} */
+
+/* Trace event formats {{{ */
+/*
+ * With -F binary and live traces can be translated to formats which trace
+ * viewers understand:
+ *
+ * -- $FORMAT_CHROME is the JSON of the Chrome trace event format, "B" and
+ *    "E" events of each call, with the timestamps in microseconds.  Every
+ *    event is on a line of its own, starting with a comma except for the
+ *    first one, see write_job().  The output is a valid JSON object only
+ *    after main() has closed it.
+ * -- $FORMAT_PERFETTO is a stream of Perfetto Trace protos: TracePackets
+ *    of TrackEvents of TYPE_SLICE_BEGIN and _END.  Each thread has a track
+ *    with its UUID being the TID + 1, and the function names are interned:
+ *    passed in InternedData once per chunk of the trace, each of which is
+ *    a packet sequence of its own, so they can be translated in parallel.
+ *
+ * The output of the jobs is written as it's translated, so a trace of any
+ * size can be converted in a stream.
+ */
+/* Returns the entry of $key in $table, which is empty if it's not there. */
+static struct intern_st *find_interned(struct table_st const *table,
+	unsigned long long key)
+{
+	unsigned i;
+	struct intern_st *entry;
+
+	for (i = (key * 0x9E3779B97F4A7C15ull) >> 32; ; i++)
+	{
+		entry = &table->entries[i & (table->size - 1)];
+		if (!entry->id || entry->key == key)
+			return entry;
+	}
+} /* find_interned */
+
+/* Adds $key to $table if it's not in it, and tells in $*isnewp whether
+ * it had to.  Returns the ID of $key. */
+static unsigned long long intern(struct table_st *table,
+	unsigned long long key, int *isnewp)
+{
+	struct intern_st *entry;
+
+	if (2 * (table->used + 1) > table->size)
+	{	/* Grow the table and rehash the entries. */
+		struct intern_st *old;
+		unsigned i, oldsize;
+
+		old = table->entries;
+		oldsize = table->size;
+		table->size = oldsize ? 2 * oldsize : 256;
+		table->entries = xrealloc(NULL,
+			sizeof(*table->entries) * table->size);
+		memset(table->entries, 0,
+			sizeof(*table->entries) * table->size);
+		for (i = 0; i < oldsize; i++)
+			if (old[i].id)
+				*find_interned(table, old[i].key) = old[i];
+		free(old);
+	}
+
+	entry = find_interned(table, key);
+	if ((*isnewp = !entry->id) != 0)
+	{
+		entry->key = key;
+		entry->id = ++table->used;
+	}
+	return entry->id;
+} /* intern */
+
+/* Empties $table. */
+static void clear_table(struct table_st *table)
+{
+	if (table->entries)
+		memset(table->entries, 0,
+			sizeof(*table->entries) * table->size);
+	table->used = 0;
+} /* clear_table */
+
+/* Appends a line of $fmt to $job's output in $FORMAT_TEXT, otherwise prints
+ * it on stderr, where it doesn't break the format. */
+static void __attribute__((format(printf, 2, 3)))
+put_note(struct job_st *job, char const *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	if (Format == FORMAT_TEXT)
+	{
+		if ((n = vsnprintf(reserve(job, 128), 128, fmt, args)) > 127)
+			n = 127;
+		job->len += n;
+		append(job, "\n", 1);
+	} else
+	{
+		fputs("ares: ", stderr);
+		vfprintf(stderr, fmt, args);
+		fputc('\n', stderr);
+	}
+	va_end(args);
+} /* put_note */
+
+/* Writes the output of $job, except for the comma before the very first
+ * event of $FORMAT_CHROME. */
+static void write_job(struct job_st const *job)
+{
+	static int started;
+	char const *out;
+	size_t len;
+
+	out = job->out;
+	len = job->len;
+	if (Format == FORMAT_CHROME && !started && len > 0)
+	{
+		out++;
+		len--;
+		started = 1;
+	}
+	write_all(out, len);
+} /* write_job */
+
+/* Returns the name of the function at $addr like get_name(), but makes
+ * one up if it's not known. */
+static char const *event_name(unsigned long long addr, char buf[NAME_BUF],
+	size_t *lenp)
+{
+	char const *name;
+
+	if (!(name = get_name(addr, buf, lenp)))
+	{
+		*lenp = sprintf(buf, "[%#llx]", addr);
+		name = buf;
+	}
+	return name;
+} /* event_name */
+
+/* Appends $len bytes of $str to $job's output as a JSON string. */
+static void put_json_string(struct job_st *job, char const *str, size_t len)
+{
+	char *out;
+	size_t i;
+
+	/* A character is escaped in at most 6. */
+	out = reserve(job, 6*len + 2);
+	*out++ = '"';
+	for (i = 0; i < len; i++)
+	{
+		unsigned char c;
+
+		c = str[i];
+		if (c == '"' || c == '\\')
+		{
+			*out++ = '\\';
+			*out++ = c;
+		} else if (c < 0x20)
+			out += sprintf(out, "\\u%.4x", c);
+		else
+			*out++ = c;
+	}
+	*out++ = '"';
+	job->len = out - job->out;
+} /* put_json_string */
+
+/* Appends a "B" or "E" event to $job's output. */
+static void put_chrome_event(struct job_st *job, unsigned long long tid,
+	int entry, unsigned long long time, unsigned long long addr)
+{
+	char buf[NAME_BUF];
+	char const *name;
+	size_t len;
+
+	job->len += sprintf(reserve(job, 128),
+		",\n{\"ph\":\"%c\",\"pid\":%u,\"tid\":%llu,\"ts\":%llu.%.3llu",
+		entry ? 'B' : 'E', Pid, tid, time / 1000, time % 1000);
+	if (entry)
+	{
+		name = event_name(addr, buf, &len);
+		append(job, ",\"name\":", 8);
+		put_json_string(job, name, len);
+	}
+	append(job, "}", 1);
+} /* put_chrome_event */
+
+/* Returns the size of $n as a protobuf varint. */
+static size_t pb_varint_size(unsigned long long n)
+{
+	size_t size;
+
+	for (size = 1; n >= 0x80; n >>= 7)
+		size++;
+	return size;
+} /* pb_varint_size */
+
+static char *pb_varint(char *p, unsigned long long n)
+{
+	for (; n >= 0x80; n >>= 7)
+		*p++ = (n & 0x7f) | 0x80;
+	*p++ = n;
+	return p;
+} /* pb_varint */
+
+/* The size of the varint $field of value $n and of the header
+ * of the length-delimited $field of $len bytes plus $len. */
+static size_t pb_field_size(unsigned field, unsigned long long n)
+{
+	return pb_varint_size(field << 3) + pb_varint_size(n);
+}
+
+static size_t pb_message_size(unsigned field, size_t len)
+{
+	return pb_varint_size(field << 3 | 2) + pb_varint_size(len) + len;
+}
+
+/* Writes the varint $field and the header of the length-delimited
+ * $field respectively. */
+static char *pb_field(char *p, unsigned field, unsigned long long n)
+{
+	return pb_varint(pb_varint(p, field << 3), n);
+}
+
+static char *pb_message(char *p, unsigned field, size_t len)
+{
+	return pb_varint(pb_varint(p, field << 3 | 2), len);
+}
+
+/* Appends a TracePacket of the TrackEvent to $job's output, preceded by
+ * the TrackDescriptor of $tid if it hasn't been seen in this chunk. */
+static void put_perfetto_event(struct job_st *job, unsigned long long tid,
+	int entry, unsigned long long time, unsigned long long addr)
+{
+	char buf[NAME_BUF], *out;
+	char const *name;
+	size_t len, thread, track, names, interned, event, packet;
+	unsigned long long uuid, iid;
+	unsigned type, flags;
+	int isnew;
+
+	/* 0 is not a valid track UUID. */
+	uuid = tid + 1;
+	intern(&job->tracks, tid, &isnew);
+	if (isnew)
+	{
+		thread = pb_field_size(PB_THREAD_PID, Pid)
+			+ pb_field_size(PB_THREAD_TID, tid);
+		track = pb_field_size(PB_TRACK_UUID, uuid)
+			+ pb_message_size(PB_TRACK_THREAD, thread);
+		packet = pb_message_size(PB_TRACK_DESCRIPTOR, track);
+
+		out = reserve(job, pb_message_size(PB_TRACE_PACKET, packet));
+		out = pb_message(out, PB_TRACE_PACKET, packet);
+		out = pb_message(out, PB_TRACK_DESCRIPTOR, track);
+		out = pb_field(out, PB_TRACK_UUID, uuid);
+		out = pb_message(out, PB_TRACK_THREAD, thread);
+		out = pb_field(out, PB_THREAD_PID, Pid);
+		out = pb_field(out, PB_THREAD_TID, tid);
+		job->len = out - job->out;
+	}
+
+	/* Intern the name of the function if it's new in the sequence. */
+	name = NULL;
+	len = names = interned = iid = 0;
+	if (entry && (iid = intern(&job->names, addr, &isnew), isnew))
+	{
+		name = event_name(addr, buf, &len);
+		names = pb_field_size(PB_NAME_IID, iid)
+			+ pb_message_size(PB_NAME, len);
+		interned = pb_message_size(PB_EVENT_NAMES, names);
+	}
+
+	type = entry ? PB_SLICE_BEGIN : PB_SLICE_END;
+	event = pb_field_size(PB_EVENT_TYPE, type)
+		+ pb_field_size(PB_EVENT_TRACK, uuid);
+	if (entry)
+		event += pb_field_size(PB_EVENT_NAME_IID, iid);
+
+	/* The first packet of the sequence starts it afresh. */
+	flags = PB_NEEDS_STATE;
+	if (!job->cleared)
+	{
+		flags |= PB_STATE_CLEARED;
+		job->cleared = 1;
+	}
+
+	packet = pb_field_size(PB_TIMESTAMP, time)
+		+ pb_field_size(PB_SEQUENCE_ID, job->sequence)
+		+ pb_field_size(PB_SEQUENCE_FLAGS, flags)
+		+ pb_message_size(PB_TRACK_EVENT, event);
+	if (name)
+		packet += pb_message_size(PB_INTERNED_DATA, interned);
+
+	out = reserve(job, pb_message_size(PB_TRACE_PACKET, packet));
+	out = pb_message(out, PB_TRACE_PACKET, packet);
+	out = pb_field(out, PB_TIMESTAMP, time);
+	out = pb_field(out, PB_SEQUENCE_ID, job->sequence);
+	out = pb_field(out, PB_SEQUENCE_FLAGS, flags);
+	if (name)
+	{
+		out = pb_message(out, PB_INTERNED_DATA, interned);
+		out = pb_message(out, PB_EVENT_NAMES, names);
+		out = pb_field(out, PB_NAME_IID, iid);
+		out = pb_message(out, PB_NAME, len);
+		memcpy(out, name, len);
+		out += len;
+	}
+	out = pb_message(out, PB_TRACK_EVENT, event);
+	out = pb_field(out, PB_EVENT_TYPE, type);
+	out = pb_field(out, PB_EVENT_TRACK, uuid);
+	if (entry)
+		out = pb_field(out, PB_EVENT_NAME_IID, iid);
+	job->len = out - job->out;
+} /* put_perfetto_event */
+/* }}} */
+
+/* Binary traces {{{ */
+/* Like text_boundary(), but returns the end of complete sections. */
+static char const *binary_boundary(char const *buf, char const *limit,
+	char const *end, int eof)
+{
+	char const *p, *next;
+
+	for (p = buf; p < end && (p == buf || p < limit); p = next)
+		if (!(next = skip_section(p, end)))
+		{
+			if (eof)
+			{	/* The traced program was killed. */
+				fprintf(stderr, "ares: trace truncated\n");
+				return end;
+			}
+			break;
+		}
+
+	return p;
+} /* binary_boundary */
+
+/* Appends an event to $job's output in the $Format, in $FORMAT_TEXT like
+ * a text trace with $TRACY_LOG_TID and $TRACY_LOG_TIME if $Has_time. */
+static void put_event(struct job_st *job, unsigned long long tid,
+	int entry, unsigned long long depth, unsigned long long time,
+	unsigned long long addr)
+{
+	char *out;
+	char const *dir;
+
+	if (Format == FORMAT_CHROME)
+	{
+		put_chrome_event(job, tid, entry, time, addr);
+		return;
+	} else if (Format == FORMAT_PERFETTO)
+	{
+		put_perfetto_event(job, tid, entry, time, addr);
+		return;
+	}
+
+	dir = entry ? "ENTER" : "LEAVE";
+	out = reserve(job, 96);
+	if (Has_time)
+		out += sprintf(out, "%llu.%09llu[%llu] ",
+			time / 1000000000, time % 1000000000, tid);
+	else
+		out += sprintf(out, "%llu ", tid);
+	out += sprintf(out, "%s[%llu] ", dir, depth);
+	job->len = out - job->out;
+
+	if (!put_name(job, addr))
+		job->len += sprintf(reserve(job, 32), "[%#llx]", addr);
+	append(job, "\n", 1);
+} /* put_event */
+
+/* Translates the sections of $job. */
+static void translate_binary(struct job_st *job)
+{
+	char const *p;
+	unsigned long long tid, n, len;
+
+	for (p = job->start; p < job->end; )
+	{
+		unsigned long long i, time, addr;
+		char const *send;
+
+		/* The last section is incomplete if the trace is truncated,
+		 * which we just ignore. */
+		switch (*p++)
+		{
+		case BIN_DROPPED:
+			if (!get_varint(&p, job->end, &tid)
+					|| !get_varint(&p, job->end, &n))
+				return;
+			put_note(job, "%llu: %llu events dropped", tid, n);
+			continue;
+		case BIN_PROCESS:
+			/* scan_maps() has taken care of it too. */
+			if (!get_varint(&p, job->end, &n))
+				return;
+			continue;
+		case BIN_SYMTAB:
+			if (!get_varint(&p, job->end, &len))
+				return;
+			p += len;
+			continue;
+		case BIN_MAP:
+			/* scan_maps() has taken care of it. */
+			if (!(p = skip_section(p - 1, job->end)))
+				return;
+			continue;
+		case BIN_END:
+			job->stop = 1;
+			return;
+		}
+
+		/* BIN_EVENTS */
+		if (!get_varint(&p, job->end, &tid)
+				|| !get_varint(&p, job->end, &n)
+				|| !get_varint(&p, job->end, &len)
+				|| len > job->end - p)
+			return;
+		send = p + len;
+
+		time = addr = 0;
+		for (i = 0; i < n && p < send; i++)
+		{
+			unsigned long long depth, delta;
+			int entry;
+
+			entry = *p++ == BIN_ENTER;
+			get_varint(&p, send, &depth);
+			get_varint(&p, send, &delta);
+			time += unzigzag(delta);
+			get_varint(&p, send, &delta);
+			addr += unzigzag(delta);
+
+			put_event(job, tid, entry, depth, time, addr);
+		} /* for */
+		p = send;
+	} /* for */
+} /* translate_binary */
+/* }}} */
+
+/* Live traces {{{ */
+/* Returns the $i:th ring of $shm. */
+static struct tracy_shm_ring_st const *shm_ring(
+	struct tracy_shm_st const *shm, unsigned i)
+{
+	return (void const *)((char const *)shm + shm->rings_offset
+		+ i * shm->ring_stride);
+} /* shm_ring */
+
+/* Maps the $TRACY_SHM region $name, waiting a second for it to be set up
+ * if the program is just starting. */
+static struct tracy_shm_st const *map_shm(char const *name)
+{
+	int fd, tries;
+	struct stat sbuf;
+	struct tracy_shm_st const *shm;
+	struct timespec nap;
+
+	nap.tv_sec = 0;
+	nap.tv_nsec = 10000000;
+	for (tries = 0;; tries++)
+	{
+		if (name[0] == '/' && !strchr(&name[1], '/'))
+			fd = shm_open(name, O_RDONLY, 0);
+		else
+			fd = open(name, O_RDONLY);
+		if (fd >= 0)
+			break;
+		if (errno != ENOENT || tries >= 100)
+			die("%s: %m", name);
+		nanosleep(&nap, NULL);
+	}
+	if (fstat(fd, &sbuf) < 0)
+		die("%s: %m", name);
+	if (sbuf.st_size < sizeof(*shm))
+		die("%s: not a tracy region", name);
+	if ((shm = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0))
+			== MAP_FAILED)
+		die("%s: mmap: %m", name);
+	close(fd);
+
+	for (tries = 0; memcmp(shm->magic, TRACY_SHM_MAGIC,
+		sizeof(shm->magic)); tries++)
+	{
+		if (tries >= 100)
+			die("%s: not a tracy region", name);
+		nanosleep(&nap, NULL);
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if (shm->version != TRACY_SHM_VERSION)
+		die("%s: unknown version %u", name, shm->version);
+	if (shm->symlog_offset + shm->symlog_size > sbuf.st_size)
+		die("%s: truncated", name);
+	return shm;
+} /* map_shm */
+
+/* Loads the complete lines of the symbol log of $shm from $*donep. */
+static void read_symlog(struct tracy_shm_st const *shm, uint64_t *donep)
+{
+	char const *log, *p, *eol;
+	uint64_t used;
+
+	log = (char const *)shm + shm->symlog_offset;
+	used = __atomic_load_n(&shm->symlog_used, __ATOMIC_RELAXED);
+	if (used > shm->symlog_size)
+		used = shm->symlog_size;
+
+	/* The names in the log stay where they are, so we can point
+	 * to them from the symbol table. */
+	for (p = &log[*donep]; p < &log[used]; p = eol + 1)
+	{
+		if (!__atomic_load_n(p, __ATOMIC_ACQUIRE))
+			break;
+		if (!(eol = memchr(p, '\n', &log[used] - p)))
+			break;
+		load_text_symtab(p, eol);
+		scan_text_maps(p, eol);
+	}
+	*donep = p - log;
+} /* read_symlog */
+
+/* Prints the events of the running program in the $TRACY_SHM region
+ * $name as they come, until it exits. */
+static void follow(char const *name)
+{
+	unsigned i;
+	uint64_t *tails, *heads, done, lost;
+	unsigned *tids;
+	struct tracy_shm_st const *shm;
+	struct tracy_shm_event_st *events;
+	struct timespec nap;
+	struct job_st *job;
+	int finished;
+
+	shm = map_shm(name);
+	Has_time = shm->flags & SHM_HAS_TIME;
+	Pid = shm->pid;
+	tails  = xrealloc(NULL, sizeof(*tails) * shm->nrings);
+	heads  = xrealloc(NULL, sizeof(*heads) * shm->nrings);
+	tids   = xrealloc(NULL, sizeof(*tids) * shm->nrings);
+	events = xrealloc(NULL, sizeof(*events) * shm->ring_size);
+	job = &Jobs[0];
+	job->sequence = ++Nsequences;
+
+	/* Start with what's still in the rings.  Their events are of
+	 * the current .tid:s unless there's an SHM_OWNER among them. */
+	for (i = 0; i < shm->nrings; i++)
+	{
+		tids[i] = __atomic_load_n(&shm_ring(shm, i)->tid,
+			__ATOMIC_ACQUIRE);
+		tails[i] = __atomic_load_n(&shm_ring(shm, i)->head,
+			__ATOMIC_ACQUIRE);
+		tails[i] = tails[i] > shm->ring_size
+			? tails[i] - shm->ring_size : 0;
+	}
+
+	done = lost = 0;
+	nap.tv_sec = 0;
+	nap.tv_nsec = 10000000;
+	do
+	{
+		int any;
+
+		/* The names of the functions are logged before their events,
+		 * so take the heads first. */
+		finished = __atomic_load_n(&shm->finished, __ATOMIC_ACQUIRE);
+		for (i = 0; i < shm->nrings; i++)
+			heads[i] = __atomic_load_n(&shm_ring(shm, i)->head,
+				__ATOMIC_ACQUIRE);
+		read_symlog(shm, &done);
+
+		any = 0;
+		job->len = 0;
+		for (i = 0; i < shm->nrings; i++)
+		{
+			struct tracy_shm_ring_st const *ring;
+			uint64_t head, tail, n, dropped;
+			unsigned tid;
+
+			ring = shm_ring(shm, i);
+			head = heads[i];
+			if (tails[i] == head)
+				continue;
+			any = 1;
+
+			/* Copy the events out of the ring, then see which
+			 * have been overwritten meanwhile. */
+			dropped = 0;
+			if (head - tails[i] > shm->ring_size)
+			{
+				dropped = head - tails[i] - shm->ring_size;
+				tails[i] = head - shm->ring_size;
+			}
+			for (tail = tails[i]; tail != head; tail++)
+				events[tail - tails[i]] = ring->events[
+					tail & (shm->ring_size - 1)];
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+			n = heads[i] - tails[i];
+			tail = 0;
+			if (head - tails[i] >= shm->ring_size)
+			{	/* The first $tail events are garbage. */
+				tail = head - tails[i] - shm->ring_size + 1;
+				if (tail > n)
+					tail = n;
+				dropped += tail;
+			}
+
+			/* If we missed some, they may have told a new owner. */
+			tid = tids[i];
+			if (dropped)
+			{
+				tid = __atomic_load_n(&ring->tid,
+					__ATOMIC_RELAXED);
+				put_note(job, "%u: %llu events dropped", tid,
+					(unsigned long long)dropped);
+			}
+
+			for (; tail < n; tail++)
+			{
+				unsigned long long time;
+
+				if (events[tail].type == SHM_OWNER)
+				{
+					tid = events[tail].addr;
+					continue;
+				}
+
+				time = events[tail].time;
+				if (Has_time)
+					time = shm->clock_base_ns
+						+ (long long)((double)(long long)
+						(time - shm->clock_base)
+						* shm->ns_per_tick);
+				put_event(job, tid,
+					events[tail].type == BIN_ENTER,
+					events[tail].depth, time,
+					events[tail].addr);
+			}
+			tails[i] = heads[i];
+			tids[i] = tid;
+		} /* for */
+
+		/* Events of threads without a ring. */
+		if (shm->lost != lost)
+		{
+			put_note(job, "%llu events lost",
+				(unsigned long long)(shm->lost - lost));
+			lost = shm->lost;
+		}
+
+		write_job(job);
+		if (!any && !finished)
+			nanosleep(&nap, NULL);
+	} while (!finished);
+	/* The last round started after the program had finished. */
+
+	free(tails);
+	free(heads);
+	free(tids);
+	free(events);
+} /* follow */
+/* }}} */
+
+/* Main loop {{{ */
+/* Writes what precedes and follows the events in the $Format. */
+static void start_format(void)
+{
+	static char const header[] =
+		"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+	if (Format == FORMAT_CHROME)
+		write_all(header, sizeof(header) - 1);
+} /* start_format */
+
+static void end_format(void)
+{
+	static char const footer[] = "\n]}\n";
+
+	if (Format == FORMAT_CHROME)
+		write_all(footer, sizeof(footer) - 1);
+	if (Format != FORMAT_TEXT && !Has_time)
+		fprintf(stderr, "ares: the trace has no timestamps, "
+			"record it with $TRACY_LOG_TIME\n");
+} /* end_format */
+
+/* Runs $job in a thread. */
+static void *translate(void *job)
+{
+	if (Binary)
+		translate_binary(job);
+	else
+		translate_text(job);
+	return NULL;
+} /* translate */
+
+/*
+ * Cuts what's at $buf into $Nthreads chunks of about $Chunk_size,
+ * translates them in parallel and prints them in order.  If not $eof
+ * the last line or section may be incomplete, which is left for the
+ * next time.  Returns how much of $buf has been processed.
+ */
+static size_t process(char const *buf, size_t len, int eof)
+{
+	unsigned i, n;
+	char const *p, *end;
+
+	if (!Binary && Format != FORMAT_TEXT)
+		die("-F needs a binary trace or -f");
+
+	end = &buf[len];
+	for (p = buf, n = 0; n < Nthreads && p < end; n++)
+	{
+		char const *limit, *next;
+
+		limit = end - p > Chunk_size ? p + Chunk_size : end;
+		next = Binary
+			? binary_boundary(p, limit, end, eof)
+			: text_boundary(p, limit, end, eof);
+		if (next == p)
+			break;
+
+		Jobs[n].start = p;
+		Jobs[n].end = p = next;
+		Jobs[n].len = 0;
+		Jobs[n].stop = 0;
+
+		/* Each chunk is a Perfetto sequence of its own. */
+		Jobs[n].sequence = ++Nsequences;
+		Jobs[n].cleared = 0;
+		clear_table(&Jobs[n].names);
+		clear_table(&Jobs[n].tracks);
+	}
+
+	/* Load the DSOs mapped in these chunks before translating them. */
+	if (Binary)
+		scan_binary_maps(buf, p);
+	else
+		scan_text_maps(buf, p);
+
+	/* Let the first chunk be translated by this thread. */
+	for (i = 1; i < n; i++)
+		if ((errno = pthread_create(&Jobs[i].thread, NULL, translate,
+				&Jobs[i])) != 0)
+			die("pthread_create: %m");
+	if (n > 0)
+		translate(&Jobs[0]);
+
+	for (i = 0; i < n; i++)
+	{
+		if (i > 0)
+			pthread_join(Jobs[i].thread, NULL);
+		if (!Done)
+			write_job(&Jobs[i]);
+		if (Jobs[i].stop)
+			Done = 1;
+	}
+
+	return Done ? len : p - buf;
+} /* process */
+
+/* Translates the trace of $fd, which is $fname, as it is being read. */
+static void process_stream(int fd, char const *fname)
+{
+	char *buf;
+	size_t size, len, done;
+	ssize_t n;
+	int eof;
+
+	size = 2 * Nthreads * Chunk_size;
+	buf = xrealloc(NULL, size);
+
+	/* Find out what kind of trace it is. */
+	len = 0;
+	eof = 0;
+	while (len < 8 && !eof)
+		if ((n = read(fd, &buf[len], 8 - len)) < 0)
+		{
+			if (errno != EINTR)
+				die("read: %m");
+		} else if (!n)
+			eof = 1;
+		else
+			len += n;
+
+	done = 0;
+	if (len == 8 && !memcmp(buf, TRACY_MAGIC, 6))
+	{
+		check_version(fname, buf);
+		Binary = 1;
+		Has_time = buf[7] & BIN_HAS_TIME;
+		done = 8;
+	}
+
+	while (!Done)
+	{
+		/* Move what's left to the beginning and fill the buffer. */
+		memmove(buf, &buf[done], len - done);
+		len -= done;
+		if (len >= size)
+		{	/* A single line or section longer than the buffer. */
+			size *= 2;
+			buf = xrealloc(buf, size);
+		}
+
+		if (!eof)
+		{
+			if ((n = read(fd, &buf[len], size - len)) < 0)
+			{
+				if (errno != EINTR)
+					die("read: %m");
+				n = 0;
+			} else if (!n)
+				eof = 1;
+			len += n;
+		}
+
+		done = process(buf, len, eof);
+		if (eof && done >= len)
+			break;
+	} /* while */
+
+	free(buf);
+} /* process_stream */
+
+/* The main function */
+int main(int argc, char *argv[])
+{
+	int optchar, fd;
+	char const *fname, *symtab_fname, *shm_name;
+	char const *buf, *body, *end;
+	struct stat sbuf;
+
+	/* Parse the command line. */
+	symtab_fname = NULL;
+	Nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	shm_name = NULL;
+	while ((optchar = getopt(argc, argv, "j:s:d:f:F:")) != EOF)
+		switch (optchar)
+		{
+		case 'f':
+			shm_name = optarg;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "text"))
+				Format = FORMAT_TEXT;
+			else if (!strcmp(optarg, "chrome"))
+				Format = FORMAT_CHROME;
+			else if (!strcmp(optarg, "perfetto"))
+				Format = FORMAT_PERFETTO;
+			else
+				die("-F %s: unknown format", optarg);
+			break;
+		case 'j':
+			Nthreads = atoi(optarg);
+			break;
+		case 'd':
+			Debug_dir = optarg;
+			break;
+		case 's':
+			symtab_fname = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-F <format>] [-j <threads>] "
+				"[-s <symtab>] [-d <debugdir>] [<trace>]\n"
+				"       %s [-F <format>] [-d <debugdir>] "
+				"-f <region>\n",
+				argv[0], argv[0]);
+			return 1;
+		}
+	if (Nthreads < 1)
+		Nthreads = 1;
+	Jobs = xrealloc(NULL, sizeof(*Jobs) * Nthreads);
+	memset(Jobs, 0, sizeof(*Jobs) * Nthreads);
+
+	if (shm_name)
+	{
+		start_format();
+		follow(shm_name);
+		end_format();
+		return 0;
+	}
+
+	if (optind < argc)
+	{
+		fname = argv[optind];
+		if ((fd = open(fname, O_RDONLY)) < 0)
+			die("%s: %m", fname);
+	} else
+	{
+		fname = "stdin";
+		fd = STDIN_FILENO;
+	}
+
+	/* We don't need to wait for the end of the trace if we have the
+	 * symbol table already, and we can't if it's not a file.  Then only
+	 * the load map can help. */
+	if (fstat(fd, &sbuf) < 0)
+		die("%s: %m", fname);
+	if (symtab_fname || !S_ISREG(sbuf.st_mode))
+	{
+		if (symtab_fname)
+			load_symtab_file(symtab_fname);
+		start_format();
+		process_stream(fd, fname);
+		end_format();
+		return 0;
+	}
+
+	/* Otherwise we need the symbol table at the end of the trace first. */
+	if (!sbuf.st_size)
+		return 0;
+	if ((buf = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+			== MAP_FAILED)
+		die("%s: mmap: %m", fname);
+	madvise((void *)buf, sbuf.st_size, MADV_SEQUENTIAL);
+	end = &buf[sbuf.st_size];
+
+	if (sbuf.st_size >= 8 && !memcmp(buf, TRACY_MAGIC, 6))
+	{
+		check_version(fname, buf);
+		Binary = 1;
+		Has_time = buf[7] & BIN_HAS_TIME;
+		body = &buf[8];
+		if ((end = find_binary_symtab(buf, sbuf.st_size)) != NULL)
+			load_binary_symtab(end, &buf[sbuf.st_size]);
+	} else
+	{
+		body = buf;
+		if ((end = find_text_symtab(buf, sbuf.st_size)) != NULL)
+			load_text_symtab(end, &buf[sbuf.st_size]);
+	}
+
+	/* It's fine as long as it has a load map. */
+	if (!end)
+	{
+		fprintf(stderr, "ares: %s: no symbol table, "
+			"the program may have been killed\n", fname);
+		end = &buf[sbuf.st_size];
+	}
+
+	start_format();
+	while (body < end && !Done)
+		body += process(body, end - body, 1);
+	end_format();
+
+	return 0;
+} /* main */
+/* }}} */
+
+/* vim: set foldmethod=marker: */
+/* End of ares.c */
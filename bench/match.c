@@ -0,0 +1,159 @@
+/*
+ * match.c -- benchmark the filters of libtracy
+ *
+ * {{{
+ * Times match_words() and match_eglob(), which decide whether to trace
+ * a DSO or a function, against the mainstream ways of doing the same,
+ * to back up the claims of libtracy.c.  The filters are built from
+ * generated lists like $TRACY_INLIBS="libmod0.so:libmod1.so:..." and
+ * $TRACY_INFUNS="module0_*_(get:set):module1_*_(get:set):...", and each
+ * is tried on a mix of matching and not matching names.
+ *
+ * Usage: match [-w <words>] [-n <iterations>]
+ *
+ * -w <words>:		How many libraries and patterns are in the lists
+ *			(10 by default).
+ * -n <iterations>:	How many names to match (1000000 by default).
+ *
+ * The output is a "<name> <ns/match>" line for each method, in the format
+ * of `run'.
+ *
+ * Compile with the flags libtracy.so is built with, like gcc -Wall -g
+ * -pthread match.c -o match -ldl -lrt, or with -DCONFIG_GLIB `pkg-config
+ * --cflags --libs glib-2.0` to compare match_words() with a GHashTable too.
+ * Don't instrument it.
+ * }}}
+ */
+
+/* Include files */
+/* We need the static functions. */
+#include "../libtracy.c"
+
+#include <stdio.h>
+#include <fnmatch.h>
+
+/* Program code */
+/* Returns the current time in nanoseconds. */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+} /* now */
+
+static void report(char const *name, double start, unsigned n)
+{
+	printf("%s %.2f\n", name, (now() - start) / n);
+} /* report */
+
+int main(int argc, char *argv[])
+{
+	int optchar;
+	unsigned i, j, nwords, n;
+	volatile unsigned matched;
+	char **libs, **names, *libstr, *globstr, *lp, *gp;
+	struct word_st *words;
+	struct glob_st *glob;
+	double start;
+
+	/* Parse the command line. */
+	nwords = 10;
+	n = 1000000;
+	while ((optchar = getopt(argc, argv, "w:n:")) != EOF)
+		switch (optchar)
+		{
+		case 'w':
+			nwords = atoi(optarg);
+			break;
+		case 'n':
+			n = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-w <words>] "
+				"[-n <iterations>]\n", argv[0]);
+			return 1;
+		}
+	if (!nwords || !n)
+	{
+		fprintf(stderr, "%s: -w and -n must be positive\n", argv[0]);
+		return 1;
+	}
+
+	/* Make up the filters and the names to match, every other
+	 * of which matches. */
+	libs = malloc(sizeof(*libs) * 2*nwords);
+	names = malloc(sizeof(*names) * 2*nwords);
+	lp = libstr = malloc(32 * nwords);
+	gp = globstr = malloc(32 * nwords);
+	for (i = 0; i < nwords; i++)
+	{
+		lp += sprintf(lp, "%slibmod%u.so", i ? ":" : "", i);
+		gp += sprintf(gp, "%smodule%u_*_(get:set)", i ? ":" : "", i);
+
+		asprintf(&libs[2*i], "/usr/lib/libmod%u.so", i);
+		asprintf(&libs[2*i+1], "/usr/lib/libother%u.so", i);
+		asprintf(&names[2*i], "module%u_object_%s", i,
+			i % 2 ? "get" : "set");
+		asprintf(&names[2*i+1], "module%u_object_new", i);
+	}
+	words = mkwords(libstr);
+	glob = mkglob(globstr);
+
+	/* Libraries */
+	matched = 0;
+	start = now();
+	for (i = 0; i < n; i++)
+		matched += !!match_words(words, libs[i % (2*nwords)]);
+	report("match_words", start, n);
+
+#ifdef CONFIG_GLIB
+	{
+		GHashTable *table;
+
+		table = g_hash_table_new(g_str_hash, g_str_equal);
+		for (i = 0; i < nwords; i++)
+			g_hash_table_insert(table, strrchr(libs[2*i], '/') + 1,
+				GINT_TO_POINTER(1));
+
+		start = now();
+		for (i = 0; i < n; i++)
+			matched += !!g_hash_table_lookup(table,
+				strrchr(libs[i % (2*nwords)], '/') + 1);
+		report("GHashTable", start, n);
+	}
+#endif
+
+	/* Functions: fnmatch() doesn't do alternatives, so it has to try
+	 * both suffixes of each pattern. */
+	start = now();
+	for (i = 0; i < n; i++)
+		matched += match_eglob(glob, names[i % (2*nwords)]);
+	report(glob->dfa ? "match_eglob(dfa)" : "match_eglob(vm)", start, n);
+
+	for (i = 0; i < nwords; i++)
+	{
+		free(libs[2*i]);
+		free(libs[2*i+1]);
+		asprintf(&libs[2*i], "module%u_*_get", i);
+		asprintf(&libs[2*i+1], "module%u_*_set", i);
+	}
+	start = now();
+	for (i = 0; i < n; i++)
+	{
+		char const *name = names[i % (2*nwords)];
+
+		for (j = 0; j < 2*nwords; j++)
+			if (!fnmatch(libs[j], name, 0))
+			{
+				matched++;
+				break;
+			}
+	}
+	report("fnmatch", start, n);
+
+	return 0;
+} /* main */
+
+/* vim: set foldmethod=marker: */
+/* End of match.c */
@@ -0,0 +1,202 @@
+/*
+ * synth.c -- a synthetic program for benchmarking libtracy
+ *
+ * {{{
+ * This program does nothing but call instrumented functions, in a shape
+ * given on the command line, so that the time libtracy adds to it can be
+ * divided by the number of events.  `run' does it for each mode of tracy.
+ *
+ * Usage: synth [-d <depth>] [-f <fanout>] [-t <threads>] [-l <dsos>]
+ *		[-n <trees>]
+ *
+ * -d <depth>:		How deep each call tree is.  synth_node() calls
+ *			itself this many levels deep, then the last level
+ *			calls synth_leaf() (3 by default).
+ * -f <fanout>:		How many children each call has (4 by default).
+ * -t <threads>:	How many threads run the trees at the same time
+ *			(1 by default).
+ * -l <dsos>:		How many libsynth<i>.so to spread the levels over:
+ *			level <n> runs in libsynth<n % dsos>.so.  If 0, the
+ *			functions are called in the program itself.  The
+ *			libraries are dlopen()ed from the directory of synth.
+ *			(2 by default)
+ * -n <trees>:		How many call trees each thread runs (10000 by
+ *			default).
+ *
+ * When the trees are done the program prints how many events (calls and
+ * returns of instrumented functions) there were in total.  It doesn't
+ * measure time itself, so that whatever libtracy does at exit is counted.
+ *
+ * Compile the program with gcc -Wall -O1 -finstrument-functions -pthread
+ * synth.c -o synth -ldl, and the libraries with -DSYNTH_LIB -shared -fPIC
+ * in addition, as libsynth0.so, libsynth1.so etc.
+ * }}}
+ */
+
+/* Include files */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
+
+/* Type definitions */
+struct synth_st;
+typedef void synth_node_t(struct synth_st const *st, unsigned level);
+
+/* The shape of the call trees, shared by all the threads. */
+struct synth_st
+{
+	unsigned depth, fanout, ntrees;
+	unsigned nnodes;
+	synth_node_t *nodes[];
+};
+
+/* Program code */
+/* The call tree {{{ */
+void synth_node(struct synth_st const *st, unsigned level);
+
+/* The leaves of the call trees.  Not static, so that they have a distinct
+ * name to filter on. */
+__attribute__((noinline))
+void synth_leaf(unsigned level)
+{
+	/* Keep the call from being optimized away. */
+	__asm__ volatile ("" : : "r" (level) : "memory");
+} /* synth_leaf */
+
+/* Calls the next level of the tree $st->fanout times. */
+__attribute__((noinline))
+void synth_node(struct synth_st const *st, unsigned level)
+{
+	unsigned i;
+
+	if (++level < st->depth)
+	{
+		for (i = 0; i < st->fanout; i++)
+			st->nodes[level % st->nnodes](st, level);
+	} else
+		for (i = 0; i < st->fanout; i++)
+			synth_leaf(level);
+} /* synth_node */
+/* }}} */
+
+#ifndef SYNTH_LIB
+/* Main loop {{{ */
+/* The thread body, runs $st->ntrees trees. */
+__attribute__((no_instrument_function))
+static void *run_trees(void *arg)
+{
+	unsigned i;
+	struct synth_st const *st = arg;
+
+	for (i = 0; i < st->ntrees; i++)
+		st->nodes[0](st, 0);
+	return NULL;
+} /* run_trees */
+
+__attribute__((no_instrument_function))
+int main(int argc, char *argv[])
+{
+	int optchar;
+	char const *me;
+	unsigned depth, fanout, nthreads, ndsos, ntrees;
+	unsigned i, level;
+	unsigned long long ncalls, width;
+	struct synth_st *st;
+	pthread_t *threads;
+
+	/* Parse the command line. */
+	depth = 3;
+	fanout = 4;
+	nthreads = 1;
+	ndsos = 2;
+	ntrees = 10000;
+	while ((optchar = getopt(argc, argv, "d:f:t:l:n:")) != EOF)
+		switch (optchar)
+		{
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'f':
+			fanout = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'l':
+			ndsos = atoi(optarg);
+			break;
+		case 'n':
+			ntrees = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d <depth>] [-f <fanout>] "
+				"[-t <threads>] [-l <dsos>] [-n <trees>]\n",
+				argv[0]);
+			return 1;
+		}
+	if (!depth || !nthreads)
+	{
+		fprintf(stderr, "%s: -d and -t must be positive\n", argv[0]);
+		return 1;
+	}
+
+	/* Load the libraries. */
+	st = malloc(sizeof(*st) + sizeof(st->nodes[0]) * (ndsos ? ndsos : 1));
+	st->depth = depth;
+	st->fanout = fanout;
+	st->ntrees = ntrees;
+	if (!ndsos)
+	{
+		st->nnodes = 1;
+		st->nodes[0] = synth_node;
+	} else
+		st->nnodes = ndsos;
+
+	me = strrchr(argv[0], '/');
+	for (i = 0; i < ndsos; i++)
+	{
+		char path[256];
+		void *lib;
+
+		snprintf(path, sizeof(path), "%.*slibsynth%u.so",
+			me ? (int)(me - argv[0] + 1) : 2,
+			me ? argv[0] : "./", i);
+		if (!(lib = dlopen(path, RTLD_NOW | RTLD_LOCAL)))
+		{
+			fprintf(stderr, "%s\n", dlerror());
+			return 1;
+		} else if (!(st->nodes[i] = dlsym(lib, "synth_node")))
+		{
+			fprintf(stderr, "%s: %s\n", path, dlerror());
+			return 1;
+		}
+	} /* for */
+
+	/* Run the trees. */
+	threads = malloc(sizeof(*threads) * nthreads);
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, run_trees, st);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	/* Each tree has $fanout^$level calls on each level up to and
+	 * including the leaves, each making two events. */
+	ncalls = 0;
+	width = 1;
+	for (level = 0; level <= depth; level++)
+	{
+		ncalls += width;
+		width *= fanout;
+	}
+	printf("%llu\n", 2 * ncalls * ntrees * nthreads);
+
+	return 0;
+} /* main */
+/* }}} */
+#endif /* ! SYNTH_LIB */
+
+/* vim: set foldmethod=marker: */
+/* End of synth.c */
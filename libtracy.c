@@ -21,6 +21,32 @@
  * -- $TRACY_SIGNAL:	If 'y' or a signal number then only start tracing
  *			when SIGPROF or that specified signal is caught.
  *			Getting the same signal toggles tracing off again.
+ * -- $TRACY_CONTROL:	Listen on a Unix domain socket of this name, through
+ *			which some of the configuration can be changed while
+ *			the program is running.  Its clients send requests of
+ *			lines like "TRACY_INFUNS=foo_*", each ending with an
+ *			empty line or when the client shuts down its end, and
+ *			everything in a request takes effect at once.
+ *			$TRACY_INLIBS, $TRACY_EXLIBS, $TRACY_INFUNS,
+ *			$TRACY_EXFUNS, $TRACY_MAXDEPTH, $TRACY_MINDEPTH,
+ *			$TRACY_SAMPLE and $TRACY_SAMPLE_DEPTH can be set,
+ *			or unset with an empty value, and in plain text mode
+ *			$TRACY_OUTPUT names a file to append the trace to
+ *			instead of stderr (or stderr again if empty).
+ *			Setting either of $TRACY_INLIBS and $TRACY_EXLIBS
+ *			replaces the filter of the other, likewise with the
+ *			functions.  "start" and "stop" turn tracing on and
+ *			off like $TRACY_SIGNAL, and "show" prints the current
+ *			settings as such a request.  Each request is answered
+ *			with "OK", or with an "ERROR:" line, in which case
+ *			nothing in it is changed.  The calls in progress when
+ *			the filters change return like they were called:
+ *			those omitted then are not reported, and those
+ *			reported then are, unless they're filtered out now.
+ *			The name of the socket is like that of $TRACY_OUTPUT.
+ *			Only the user the program runs as can connect to it.
+ *			Example:
+ *			  printf 'TRACY_MAXDEPTH=3\n' | socat - UNIX:tracy.ctl
  * -- $TRACY_INLIBS:	A colon-separated list of basenames indicating
  *			calls to which DSOs to include in the output.
  *			Calls to DSOs not in this list will be omitted.
@@ -40,18 +66,221 @@
  *			are reported (unless they're excluded otherwise;
  *			excluded functions don't increase the depth, so if
  *			bar() was excluded baz() would be reported).
+ * -- $TRACY_SAMPLE:	Only trace every Nth call tree on average, chosen
+ *			randomly.  A call tree is an instrumented call at
+ *			$TRACY_SAMPLE_DEPTH (0 by default) and everything
+ *			it calls; the calls above that depth are all traced.
+ *			Set the depth to 1 if main() is instrumented.
+ *			The trees are traced or omitted as a whole, so their
+ *			depths are consistent, as are the stacks in between.
+ * -- $TRACY_FUN_RATE:	Trace at most this many calls per second of
+ *			any function in a thread (approximately).  The calls
+ *			over the rate are omitted along with what they call.
+ * -- $TRACY_BUDGET:	Emit at most about this many events per second
+ *			in total.  Like with $TRACY_FUN_RATE, over the budget
+ *			the calls are omitted with their subtrees.
+ *			These can keep the overhead bounded if the program
+ *			is always traced.  They don't apply to
+ *			$TRACY_MODE=profile.
+ * -- $TRACY_AUTO_EXCLUDE:
+ *			Omit the functions whose calls take less than this
+ *			many nanoseconds on average and which a thread calls
+ *			at least $TRACY_AUTO_EXCLUDE_RATE times a second
+ *			(100000 by default), after that rate is reached, as
+ *			if they were in $TRACY_EXFUNS.  Only the time spent
+ *			in the functions and what they call is measured,
+ *			not the tracing of their calls, and up to 256 levels
+ *			deep.  At exit the omitted functions are printed with
+ *			the number of their calls omitted, and written to
+ *			$TRACY_AUTO_EXCLUDE_LIST if set, as an option of gcc
+ *			which excludes them from instrumentation, so that the
+ *			next build can take it with "@file".  C++ names are
+ *			written demangled, without their parameters.  gcc
+ *			excludes every function whose name contains one of
+ *			those of the list, so short names can exclude more
+ *			than what was omitted, and names with commas are
+ *			left out.  Like the other limits they don't apply to
+ *			$TRACY_MODE=profile.
+ * -- $TRACY_TRIGGER:	An extended glob pattern like $TRACY_INFUNS.  If set,
+ *			a thread is only traced while it's in a call of
+ *			a matching function; when it returns, tracing stops
+ *			until the next such call.  The trigger functions
+ *			are matched regardless of the other filters.
+ *			Doesn't apply to $TRACY_MODE=profile.
+ * -- $TRACY_TRIGGER_HISTORY:
+ *			Also print this many events which preceded the call
+ *			of the trigger in the thread.  To keep them the calls
+ *			need to be processed before the trigger as well,
+ *			so the program is slowed down more.
+ * -- $TRACY_CHAIN_WITH:
+ *			An extended glob pattern like $TRACY_INFUNS.  Only
+ *			report the call chains going through a matching
+ *			function.  A call chain is the path from the outermost
+ *			traced call to one which doesn't call any traced
+ *			functions.  So the calls of the functions are reported
+ *			with everything they call and their callers, but not
+ *			the rest of what the callers call.
+ * -- $TRACY_CHAIN_WITHOUT:
+ *			Likewise, but only report the chains which don't go
+ *			through any matching function.
+ * -- $TRACY_CHAIN_MIN, $TRACY_CHAIN_MAX:
+ *			Only report the call chains at least or at most this
+ *			many calls long.  A call is reported if any of the
+ *			chains going through it matches all the $TRACY_CHAIN_*
+ *			filters.  Until it's decided the events are held back,
+ *			which may be until the call returns, except if only
+ *			$TRACY_CHAIN_WITH and $TRACY_CHAIN_MIN are set.
+ *			The chains are made of the calls not omitted otherwise.
+ *			With $TRACY_TRIGGER they start with the trigger call,
+ *			and don't apply to the $TRACY_TRIGGER_HISTORY.
+ * -- $TRACY_MINDEPTH:	Don't report the calls above this depth, but count
+ *			them, so the depth of the rest is like without it.
+ *			With $TRACY_MAXDEPTH it leaves a range of levels.
+ * -- $TRACY_PRUNE:	An extended glob pattern like $TRACY_INFUNS.  Report
+ *			the calls of the matching functions, but not what they
+ *			call, which is not traced at all.  None of these
+ *			apply to $TRACY_MODE=profile.
+ * -- $TRACY_MODE:	If "profile", don't trace the calls, just count them
+ *			and measure how long they take.  When the program
+ *			exits a summary is printed with the number of calls,
+ *			the total (inclusive) time, the time spent in the
+ *			function's own code (exclusive time), the median,
+ *			99th and 99.9th percentile and the longest of the
+ *			(inclusive) time of a call, within 1/8, and the
+ *			deepest call level of each function, sorted by the
+ *			exclusive time.  The $TRACY_*LIBS and $TRACY_*FUNS filters
+ *			apply, and so does $TRACY_MAXDEPTH; the time of the
+ *			omitted functions is accounted to their callers.
+ *			$TRACY_ASYNC and $TRACY_BUFFERED are ignored.
+ *			If "flight", keep the last $TRACY_RING_SIZE events
+ *			of each thread in memory and only write them when
+ *			the program exits, crashes with a fatal signal or
+ *			gets $TRACY_DUMP_SIGNAL, to $TRACY_OUTPUT, in the
+ *			binary format of $TRACY_OFFLINE.  Each dump replaces
+ *			the previous one.  The events of the threads which
+ *			have exited are kept until they've been dumped, so
+ *			until then each of them takes up memory for its ring.
+ *			The filters apply like in trace
+ *			mode, except that $TRACY_ASYNC, $TRACY_BUFFERED and
+ *			$TRACY_SHM are ignored.
+ *			The default mode is "trace".
+ * -- $TRACY_FOLDED:	In profile mode also keep track of each distinct chain
+ *			of calls leading to a function (a calling-context tree),
+ *			and write them to this file along with the summary, in
+ *			the "folded" format flamegraph.pl and other flame graph
+ *			tools take: "main;foo;bar 1234", where the number is
+ *			the time spent in bar() itself when called from
+ *			main() through foo(), in nanoseconds.
+ * -- $TRACY_FOLDED_COUNTS:
+ *			If '1' count the calls of the chains in the folded
+ *			output rather than their time.
+ * -- $TRACY_PMU:	In profile mode also count these performance counters
+ *			of the threads, separated by ',', in the functions'
+ *			own code, and print them in the summary.  At most 4
+ *			of cycles, instructions, cache-references,
+ *			cache-misses, branches, branch-misses, ref-cycles,
+ *			task-clock, page-faults, context-switches and
+ *			cpu-migrations, which are counted in user space.
+ *			The hardware counters are read with rdpmc if the
+ *			kernel allows it, which makes them cheap.
+ * -- $TRACY_CALLGRAPH:	In profile mode also count the calls of each function
+ *			by the functions they're called from, and write them
+ *			to this file with the time they took, in the format
+ *			of callgrind (for kcachegrind or gprof2dot), or of
+ *			dot(1) if the name ends with ".dot".  The callers
+ *			are found by the return addresses, so they don't need
+ *			to be instrumented or traced.
+ * -- $TRACY_DUMP_SIGNAL:
+ *			If 'y' or a signal number then print the summary
+ *			of $TRACY_MODE=profile or dump the flight recorder
+ *			whenever SIGUSR1 or that specified signal is caught,
+ *			too.
  * -- $TRACY_ASYNC:	Symbol resolution can slow down your program
  *			considerably.  In async mode while it is running
  *			libtracy will emit symbols addresses then a
  *			transformation table on exit().  You can resolve
- *			the symbol names with ares.pl afterwards.
+ *			the symbol names with ares afterwards.
+ *			If "binary", write the trace to $TRACY_OUTPUT
+ *			(tracy.bin by default) in a compact binary format
+ *			instead, described in tracy.h.  The file is
+ *			written by a background thread like in buffered mode.
+ * -- $TRACY_OFFLINE:	If '1' then in async mode don't resolve the addresses
+ *			even at exit, just record where each DSO is loaded,
+ *			including those dlopen()ed later.  ares will find the
+ *			function names in the DSOs after the run, using their
+ *			separate debug files if necessary.  This way the trace
+ *			is resolvable even if the program is killed.
+ * -- $TRACY_OUTPUT:	Where to write the binary trace, or in plain text
+ *			mode the file to append the trace to instead of
+ *			stderr, like with $TRACY_CONTROL.  "%p" in the name
+ *			is replaced by the PID, "%t" by the time the process
+ *			started tracing (in seconds since the Epoch) and "%%"
+ *			by '%'.  The children the program fork()s and the
+ *			programs it executes write their own trace, to the same
+ *			name with ".<PID>" appended unless it has a "%p", and
+ *			they don't overwrite existing files, but add a number
+ *			to the name.  Each of them has the symbol table of the
+ *			functions it called.  The same goes for the names of
+ *			$TRACY_FOLDED, $TRACY_CALLGRAPH and $TRACY_SHM, except
+ *			that children share the $TRACY_SHM region of the
+ *			parent.  In text mode without $TRACY_OUTPUT they
+ *			share stderr, but they print their own symbol table
+ *			too.  libtracy sets
+ *			$TRACY_OUTPUT_OWNER to recognize the programs it
+ *			executes.
+ * -- $TRACY_BUFFERED:	If '1' the traced threads don't print anything
+ *			themselves, but queue the events for a background
+ *			thread, which writes them out in large chunks.
+ *			This makes tracing disturb the timing of the program
+ *			less.  The messages of different threads are written
+ *			in batches, so use it together with $TRACY_LOG_TID.
+ * -- $TRACY_SHM:	Write the events into a shared memory region of this
+ *			name instead of stderr or $TRACY_OUTPUT, not formatted,
+ *			but in per-thread rings, which other processes can read
+ *			while the program is running, eg. `ares -f'.  If it's
+ *			like "/name" it's a POSIX shared memory object,
+ *			otherwise a file, which is memory-mapped.  The function
+ *			names and the load map of $TRACY_OFFLINE are written
+ *			in the region too.  The program doesn't wait for the
+ *			readers, if they're too slow they miss events.  The
+ *			layout of the region is described in tracy.h.
+ *			$TRACY_BUFFERED is ignored, and so is the binary
+ *			format of $TRACY_ASYNC.
+ * -- $TRACY_SHM_THREADS:
+ *			How many threads can have a ring in the $TRACY_SHM
+ *			region at the same time (32 by default).  The rings
+ *			of exited threads are reused; the events of the
+ *			threads exceeding this number are lost.
+ * -- $TRACY_RING_SIZE:	How many events each thread can queue at most in
+ *			buffered mode, the flight recorder or the $TRACY_SHM
+ *			region (rounded down to a power of two).  The default
+ *			is 65536.
+ * -- $TRACY_OVERFLOW:	What to do in buffered mode when a thread's queue
+ *			is full.  If "block", wait until the background thread
+ *			catches up, otherwise drop the event and report how
+ *			many have been lost.
+ * -- $TRACY_BACKTRACE: If '1' find out the address of the traced function
+ *			with backtrace() rather than believing the compiler.
+ *			This is slow, only use it if your toolchain passes
+ *			wrong addresses to __cyg_profile_*().  It's unreliable
+ *			on ARM.
  * -- $TRACY_LOG_ENTRIES_ONLY:
  *			Log only function entries.  This only unclutters output,
  *			but doesn't save much processing time.
- * -- $TRACY_LOG_TIME:	Include gettimeofday() of the call/return in the output.
+ * -- $TRACY_LOG_CALLS:	If '1' log the calls which don't call any traced
+ *			function on a single "CALL" line instead of an ENTER
+ *			and a LEAVE.  It holds back the ENTERs like the chain
+ *			filters.  Only in text output.
+ * -- $TRACY_LOG_TIME:	Include the time of the call/return in the output,
+ *			in nanoseconds.
+ * -- $TRACY_CLOCK:	Where to take the time from: "realtime", "monotonic"
+ *			(the default) or "tsc", which reads the time stamp
+ *			counter of the CPU.  It's the cheapest, but only
+ *			available on x86 CPUs.  The time is always printed
+ *			as the number of seconds since the Epoch.
  * -- $TRACY_LOG_TID:	Include the TID of the traced program in the output.
  *			Useful when you're tracing multiprocess/multithread
- *			programs.  WARNING: libtracy is NOT thread-safe!
+ *			programs.  Each thread has its own call depth.
  * -- $TRACY_LOG_FNAME:	Include the DSO's basename in the output (default).
  * -- $TRACY_LOG_INDENT: How many spaces to indent with each call level.
  *			 The default is 0, ie. start function names at the same
@@ -59,14 +288,31 @@
  *
  * Compile this file as a shared library, but don't instrument it.
  * Specify -DCONFIG_GLIB to have it report with g_debug() (the log domain
- * will be "trace").  `tracinst' will take care of it all, if you don't mind.
+ * will be "trace").  With -DCONFIG_INTERP="<the dynamic linker>", like
+ * "/lib64/ld-linux-x86-64.so.2", and -Wl,-e,tracy_main the library is
+ * also a program, which takes the options of `tracy' and runs the program
+ * to trace with itself preloaded.  `tracinst' will take care of it all,
+ * if you don't mind, and install it as `tracy'.
  *
  * libtracy relies on being $LD_PRELOAD:ed to the program you want to trace.
  * (While this is problematic in scratchbox, there is a way out, and `tracy'
  * does exactly that.)  Then all instrumented functions call __cyg_profile_*()
- * automagically.  They use glibc's backtrace() to get the invocation points,
- * then go straight to the ELF headers and sections to deduce the function
- * names.  (This involves some heuristics---this is not a complete debugger.)
+ * automagically with the address of the function, then libtracy goes straight
+ * to the ELF headers and sections to deduce the function names.  (This involves
+ * some heuristics---this is not a complete debugger.)
+ *
+ * The program version of libtracy can also be loaded into a process which
+ * is already running, with `tracy [<options>] -attach <pid>'.  On x86_64
+ * it stops the process with ptrace(), sets the $TRACY_* variables of its
+ * own environment in it, then calls dlopen() in it to load the library and
+ * lets the process go on.  The library then makes the instrumented DSOs
+ * call it instead of the no-op __cyg_profile_*() of libc.  The calls which
+ * were in progress are not reported when they return.  The process must
+ * have the same libc and be able to open the library by the same name,
+ * so not across mount namespaces, and must be ours to ptrace() (see
+ * /proc/sys/kernel/yama/ptrace_scope).  If its main thread is stopped
+ * in the middle of malloc() or the dynamic linker, the calls we make
+ * can deadlock.  The programs it executes later are not traced.
  *
  * To obey the $TRACY_* environment variables the fgrep- and extended glob
  * matching routines were written in the hope they would be faster than the
@@ -75,24 +321,35 @@
  */
 
 /* Configuration */
-/* For dladdr() */
+/* For RTLD_NEXT and dl_iterate_phdr() */
 #define _GNU_SOURCE
 
 /* Include files */
+#include <stddef.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <time.h>
 #include <dlfcn.h>
+#include <link.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include <elf.h>
 #include <execinfo.h>
 
-#include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/perf_event.h>
 
 #ifdef CONFIG_GLIB
 # include <glib.h>
@@ -100,9 +357,28 @@
 # include <stdio.h>
 #endif
 
+#ifdef CONFIG_INTERP
+# include <stdio.h>
+# include <sys/wait.h>
+# include <sys/ptrace.h>
+# include <sys/user.h>
+# include <sys/sysmacros.h>
+#endif
+
+#include "tracy.h"
+
 /* Macros */
 #define gettid()		(pid_t)syscall(SYS_gettid)
 
+/* The time stamp and the performance counters are only read directly
+ * on x86.  CLOCK_TSC is our own clock ID, which clock_gettime() doesn't
+ * understand. */
+#if defined(__i386__) || defined(__x86_64__)
+# define HAVE_TSC
+# define HAVE_RDPMC
+# define CLOCK_TSC		((clockid_t)-1)
+#endif
+
 /* How to print the trace messages. */
 #ifdef CONFIG_GLIB
 # undef  G_LOG_DOMAIN
@@ -112,6 +388,48 @@
 # define LOGIT(fmt, ...)	fprintf(stderr, fmt "\n", ##__VA_ARGS__)
 #endif
 
+/* The size of the symbol log in the $TRACY_SHM region. */
+#define SHM_SYMLOG_SIZE		(16 * 1024 * 1024)
+
+/* How many levels of calls trace_enter() remembers whether they count
+ * in the depth. */
+#define COUNTED_LEVELS		4096
+
+/* The number of rate_st:s each thread has, see admit_call(). */
+#define RATE_SLOTS		1024
+
+/* The number of auto_st:s each thread has with $TRACY_AUTO_EXCLUDE,
+ * and how deep its calls are followed, see auto_enter(). */
+#define AUTO_SLOTS		1024
+#define AUTO_DEPTH		256
+
+/* The size of the file header of the binary trace, see put_header(). */
+#define BIN_HEADER_SIZE		(8 + 1 + 10)
+
+/* The size of the alternate signal stack of the threads in flight recorder
+ * mode, see dump_flight(). */
+#define ALTSTACK_SIZE		(64 * 1024)
+
+/* The shape of the latency histograms of $TRACY_MODE=profile, see
+ * hist_bucket(): each power of two is split into 1 << HIST_SUB_BITS
+ * buckets, up to 2^(HIST_MAX_SHIFT + HIST_SUB_BITS + 1) clock ticks. */
+#define HIST_SUB_BITS		3
+#define HIST_MAX_SHIFT		44
+#define HIST_BUCKETS		((HIST_MAX_SHIFT + 2) << HIST_SUB_BITS)
+
+/* How many $TRACY_PMU counters a thread can have. */
+#define PMU_MAX			4
+
+/* What fun_flags() can say about a function. */
+#define FUN_TRIGGER		(1 << 0)	/* $TRACY_TRIGGER */
+#define FUN_WITH		(1 << 1)	/* $TRACY_CHAIN_WITH */
+#define FUN_WITHOUT		(1 << 2)	/* $TRACY_CHAIN_WITHOUT */
+#define FUN_PRUNE		(1 << 3)	/* $TRACY_PRUNE */
+
+/* The .is_entry of the event of a call without children, which is
+ * reported on a single line with $TRACY_LOG_CALLS. */
+#define EVENT_CALL		2
+
 /* Type definitions {{{ */
 /* Use the appropriate ELF types for this platform. */
 #if __LP64__
@@ -119,11 +437,25 @@ typedef Elf64_Ehdr Elf_Ehdr;
 typedef Elf64_Shdr Elf_Shdr;
 typedef Elf64_Addr Elf_Addr;
 typedef Elf64_Sym  Elf_Sym;
+typedef Elf64_Phdr Elf_Phdr;
+typedef Elf64_Nhdr Elf_Nhdr;
+typedef Elf64_Dyn  Elf_Dyn;
+typedef Elf64_Rel  Elf_Rel;
+typedef Elf64_Rela Elf_Rela;
+# define ELF_ST_TYPE	ELF64_ST_TYPE
+# define ELF_R_SYM	ELF64_R_SYM
 #else /* we're 32-bit */
 typedef Elf32_Ehdr Elf_Ehdr;
 typedef Elf32_Shdr Elf_Shdr;
 typedef Elf32_Addr Elf_Addr;
 typedef Elf32_Sym  Elf_Sym;
+typedef Elf32_Phdr Elf_Phdr;
+typedef Elf32_Nhdr Elf_Nhdr;
+typedef Elf32_Dyn  Elf_Dyn;
+typedef Elf32_Rel  Elf_Rel;
+typedef Elf32_Rela Elf_Rela;
+# define ELF_ST_TYPE	ELF32_ST_TYPE
+# define ELF_R_SYM	ELF32_R_SYM
 #endif
 
 /* Describes a word you can match against a path with match_words(). */
@@ -137,41 +469,612 @@ struct word_st
 	struct word_st *next;
 };
 
+/* A function symbol of a DSO as indexed by mksyms(). */
+struct sym_st
+{
+	/* .addr and .size are copied from the Elf_Sym, .name points
+	 * to the string table of the ELF image.  .undefined is set for
+	 * the PLT entries of executables, see addr2name(). */
+	Elf_Addr addr, size;
+	char const *name;
+	int undefined;
+};
+
+/* The syntax tree and the program of an extended glob pattern.
+ * See mkglob(). */
+enum
+{
+	GLOB_CHAR, GLOB_ANY, GLOB_SPLIT, GLOB_JMP, GLOB_MATCH,
+	GLOB_STAR, GLOB_SEQ, GLOB_ALT,
+};
+
+struct glob_node_st
+{
+	/* .type is one of GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_SEQ or
+	 * GLOB_ALT.  The rest are indexes of other nodes, -1 if none. */
+	int type, c;
+	int first, last, next;
+};
+
+struct glob_insn_st
+{
+	unsigned char op, c;
+	unsigned x, y;
+};
+
+struct glob_st
+{
+	struct glob_node_st *nodes;
+	struct glob_insn_st *prog;
+	unsigned nnodes, ninsns;
+
+	/* The DFA made of .prog, or NULL if it would have been too large.
+	 * .dfa[state*.nclasses + .classes[c]] is where $state goes with
+	 * character $c, or -1 if nowhere. */
+	unsigned char classes[256];
+	unsigned nclasses, nstates;
+	int *dfa;
+	unsigned char *accepting;
+};
+
+/* Used by mkglob_dfa() to find the DFA state of a set of instructions.
+ * The set of the $n:th state is .pool[.offsets[n]..+.lengths[n]]. */
+struct dfa_builder_st
+{
+	unsigned *offsets, *lengths;
+	unsigned *hash;
+	unsigned *pool, npool, poolsize;
+};
+
 /* Holds all the information necessary to locate
  * the name of a function defined in a DSO. */
 struct dso_st
 {
 	/*
-	 * All fields point somewhere in the ELF image, thus not duplicated.
+	 * A DSO of the registry, see rescan_dsos().
+	 *
+	 * -- fname:	The absolute path of the DSO.
+	 * -- lname:	Its name in the dynamic linker's list, by which
+	 *		rescan_dsos() recognizes it.
+	 * -- start, end: The address range it's loaded at (.end is not
+	 *		included), and the .bias which is added to the
+	 *		addresses in the DSO.
+	 * -- phdrs:	Its .phnum program headers in the memory.
+	 * -- loaded:	Whether getdso() has loaded the symbol table
+	 *		(1 or -1 if it failed), which is only done when
+	 *		a function of the DSO is looked up first.
+	 *
+	 * The rest point somewhere in the ELF image, thus not duplicated.
 	 *
-	 * -- fname:	Which DSO it belongs to.  
 	 * -- strtab:	The relevant string table.  A string table is a
 	 *		sequence of NIL-terminated strings, and the strings
 	 *		are referred to by their position.  The table ends
 	 *		at .strend.  ELFs have multiple string tables; this
-	 *		is the one (the last), which is "likely" to contain
-	 *		function names.
-	 * -- symtab:	The DSO's (static) symbol table.
+	 *		is the one the symbol table links to.
+	 * -- symtab:	The DSO's static symbol table, or the dynamic one
+	 *		if it's stripped.
+	 * -- maps:	The parts of the file mapped by map_section() to
+	 *		access them, .nmaps of them.  If the symbol table is
+	 *		taken from the memory nothing is mapped, but the string
+	 *		table is copied, because the DSO may be unloaded.
+	 *		They are kept even then, because the names may still be
+	 *		referred to by the address cache or buffered events.
+	 * -- syms:	The function symbols of .symtab sorted by address,
+	 *		built by mksyms().  This is the only field not pointing
+	 *		to the ELF image.
 	 */
-	char const *fname;
+	char const *fname, *lname;
+	Elf_Addr start, end, bias;
+	Elf_Phdr const *phdrs;
+	unsigned phnum;
+	int loaded;
+
 	char const *strtab, *strend;
 	Elf_Sym const *symtab, *symend;
-	struct dso_st *next;
+	struct { void const *addr; size_t size; } maps[2];
+	unsigned nmaps;
+	struct sym_st *syms;
+	unsigned nsyms;
+};
+
+/* The DSOs loaded in the program sorted by address. */
+struct registry_st
+{	/* The .generation of the dynamic linker is that of dso_generation()
+	 * when it was scanned last. */
+	unsigned long long generation;
+	unsigned ndsos;
+	struct dso_st *dsos[];
+};
+
+/* How a function is named in the text trace, like "libfoo.so:foo()",
+ * made by mklabel().  .str is not NUL-terminated. */
+struct label_st
+{
+	char const *str;
+	unsigned len;
+};
+
+/* An entry of the address cache, remembering what addr2name()
+ * said about .addr, and its .label if the trace is text.  Empty
+ * entries have NULL .addr, and the rest of the fields are only valid
+ * when .ready is set. */
+struct addr_st
+{
+	void const *addr;
+	char const *fname, *funame;
+	struct label_st label;
+	int verdict, ready;
+};
+
+/* A function call or return to be reported.  The .label is NULL if the
+ * address is to be resolved by resolve_backlog().  .is_entry is EVENT_CALL
+ * for a call and return in one. */
+struct event_st
+{
+	void const *addr;
+	struct label_st label;
+	unsigned long long time;
+	unsigned depth;
+	int is_entry;
+};
+
+/* A per-thread queue of event_st:s in $TRACY_BUFFERED mode.  The thread
+ * which .owned it appends to .head, and the writer thread consumes them
+ * from .tail, so both of them are ever-increasing.  .reported is for the
+ * writer thread to remember how many .dropped events it has told about.
+ * A flight recorder's ring is only consumed by dump_flight(), which
+ * moves .tail up to .head if the owner has exited. */
+struct ring_st
+{
+	int owned;
+	pid_t tid;
+	unsigned long head, tail;
+	unsigned long dropped, reported;
+	struct ring_st *next;
+	struct event_st events[];
+};
+
+/* A call in progress on a thread's stack of call chains, see chain_event().
+ * .with and .without count how many of the calls up to and including this
+ * one are of $TRACY_CHAIN_WITH and $TRACY_CHAIN_WITHOUT functions.
+ * .has_children tells whether it has called a traced function. */
+struct chain_frame_st
+{
+	struct event_st enter;
+	unsigned with, without;
+	int has_children;
+};
+
+/* How many calls of .addr a thread has traced in the second starting at
+ * .window, for $TRACY_FUN_RATE. */
+struct rate_st
+{
+	void const *addr;
+	unsigned long long window;
+	unsigned count;
+};
+
+/* How many calls of .addr a thread has made in the window starting at
+ * .window and how long they took in total, for $TRACY_AUTO_EXCLUDE.
+ * If the function has been .demoted, .skipped counts its calls since.
+ * .generation is the $Auto_generation the thread last checked whether
+ * other threads have demoted it. */
+struct auto_st
+{
+	void const *addr;
+	unsigned long long window, ticks;
+	unsigned long calls, skipped;
+	unsigned generation;
+	int demoted;
+};
+
+/* A call in progress followed by auto_enter().  .slot is NULL if it's
+ * not measured. */
+struct auto_frame_st
+{
+	void const *addr;
+	struct auto_st *slot;
+	unsigned long long start;
+	int skipped;
+};
+
+/* The $TRACY_AUTO_EXCLUDE state of a thread, kept after it exits for
+ * report_auto_exclude(). */
+struct auto_table_st
+{
+	struct auto_table_st *next;
+	unsigned depth;
+	struct auto_frame_st frames[AUTO_DEPTH];
+	struct auto_st slots[AUTO_SLOTS];
+};
+
+/* A table of addr_st:s.  Its size is always a power of two. */
+struct addr_cache_st
+{
+	unsigned size, used;
+	struct addr_cache_st *prev;
+	struct addr_st entries[];
+};
+
+/*
+ * The part of the configuration $TRACY_CONTROL can change.  The current
+ * one is $Config, which is replaced as a whole by apply_control(), so
+ * a thread sees either the old or the new one.  .libs and .funs are what
+ * the filters were made of, and .output is the file $Trace_fd has been
+ * redirected to, or NULL, for show_config().  .addr_cache holds the
+ * verdicts of the filters about the functions, see resolve().  Only it
+ * changes after the snapshot has been published.
+ */
+struct config_st
+{
+	struct word_st const *dso_filter;
+	struct glob_st const *fun_filter;
+	int dso_whitelist, fun_whitelist;
+	char const *libs, *funs;
+	unsigned depth_limit, min_depth;
+	int depth_limited;
+	unsigned sample_rate, sample_depth;
+	char const *output;
+	struct addr_cache_st *addr_cache;
+};
+
+/*
+ * What $TRACY_MODE=profile knows about a function called by a thread.
+ * .total is the inclusive time spent in the function, .self is the time
+ * spent in its own code, and .maxdepth is the deepest call level it was
+ * called at.  .active counts its calls in progress, so the .total of
+ * a recursive function is only accounted for the outermost call.  .hist
+ * is the histogram of the inclusive times of the calls which returned,
+ * HIST_BUCKETS long, allocated when the first one does, and .max is the
+ * longest of them.  Likewise .pmu is what the $Pmu_count counters of
+ * $TRACY_PMU counted in the function's own code.
+ */
+struct prof_fun_st
+{
+	void const *addr;
+	unsigned long calls;
+	unsigned long long total, self, max;
+	unsigned maxdepth, active;
+	unsigned long *hist;
+	unsigned long long *pmu;
+};
+
+/* A performance counter $TRACY_PMU can name, see perf_event_open(2). */
+struct pmu_event_st
+{
+	char const *name;
+	unsigned type;
+	unsigned long long config;
+};
+
+/* A table of prof_fun_st:s.  Its size is always a power of two. */
+struct prof_table_st
+{
+	unsigned size, used;
+	struct prof_fun_st entries[];
+};
+
+/* The calls of .callee from .site, the return address in its caller,
+ * with $TRACY_CALLGRAPH.  .calls, .total and .active are like in
+ * prof_fun_st. */
+struct prof_edge_st
+{
+	void const *site, *callee;
+	unsigned long calls;
+	unsigned long long total;
+	unsigned active;
 };
+
+/* A table of prof_edge_st:s.  Its size is always a power of two. */
+struct prof_edge_table_st
+{
+	unsigned size, used;
+	struct prof_edge_st entries[];
+};
+
+/* An edge of the call graph merged from the threads by dump_callgraph(),
+ * with the names of the DSOs and the functions at its ends.  .caller is
+ * the function .edge.site is in.  The names are NULL if unknown. */
+struct graph_edge_st
+{
+	struct prof_edge_st edge;
+	char const *caller_fname, *caller;
+	char const *callee_fname, *callee;
+};
+
+/* A node of a calling-context tree, standing for the calls of .addr
+ * through the same chain of callers (the .parent:s).  .calls, .total
+ * and .self are like in prof_fun_st.  The root has NULL .addr. */
+struct cct_node_st
+{
+	void const *addr;
+	unsigned long calls;
+	unsigned long long total, self;
+	struct cct_node_st *parent, *children, *next;
+};
+
+/* A call in progress on a thread's shadow stack.  .children is the
+ * time spent in the functions it has called so far.  .node is NULL
+ * unless $TRACY_FOLDED, and .edge unless $TRACY_CALLGRAPH.  .pmu_start
+ * and .pmu_children are like .start and .children for the counters of
+ * $TRACY_PMU. */
+struct prof_frame_st
+{
+	struct prof_fun_st *fun;
+	struct cct_node_st *node;
+	struct prof_edge_st *edge;
+	unsigned long long start, children;
+	unsigned long long pmu_start[PMU_MAX], pmu_children[PMU_MAX];
+};
+
+/*
+ * The profile of a thread.  Only the thread itself changes it, but
+ * dump_profile() may read it any time.  The nodes of the calling-context
+ * tree are allocated from .pool, and looked up by their parent and address
+ * in .cct_hash, which only the owner thread uses.  .pmu_fds are the
+ * $TRACY_PMU counters of the thread, or -1, and .pmu_pages are where
+ * they can be read from without a system call, or NULL.
+ */
+struct profile_st
+{
+	pid_t tid;
+	struct prof_table_st *table;
+	struct prof_edge_table_st *edges;
+	struct prof_frame_st *stack;
+	unsigned depth, stacksize, too_deep;
+
+	int pmu_fds[PMU_MAX];
+	struct perf_event_mmap_page *pmu_pages[PMU_MAX];
+
+	struct cct_node_st root, *pool;
+	struct cct_node_st **cct_hash;
+	unsigned npool, cct_size, cct_used;
+
+	struct profile_st *next;
+};
+
+/* A function of ours which the DSOs of the program are made to call
+ * if we're loaded into it too late to interpose it, see attach_dso(). */
+struct hook_st
+{
+	char const *name;
+	void *addr;
+};
+
+#ifdef CONFIG_INTERP
+/* An option of the launcher, see tracy_main().  It sets the $TRACY_*
+ * variables in .vars, which are "NAME=value", or just "NAME" to be set
+ * to the argument, if the option takes an .arg. */
+struct launcher_opt_st
+{
+	char const *name, *arg;
+	char const *vars[4];
+};
+#endif /* CONFIG_INTERP */
 /* }}} */
 
 /* Function prototypes */
-static int match_eglob(char const *pattern, char const *str);
+static void tracy_init(void);
+static void add_flight_map(char const *map, size_t len);
+static void attach_dsos(void);
+static struct addr_st const *find_addr(struct addr_cache_st const *cache,
+	void const *addr);
+static int cache_addr(struct addr_cache_st **tablep, void const *addr,
+	char const *fname, char const *funame, struct label_st const *label,
+	int verdict);
+static void print_meta(char const *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
 
 /* Private variables */
 /* Is tracing enabled or are we waiting for a signal to start it? */
 static int Tracing = 1;
 
-/* Printed along with the trace messages. */
-static unsigned int Callstack_depth = 0;
+/* Makes sure tracy_init() is called exactly once. */
+static pthread_once_t Init_once = PTHREAD_ONCE_INIT;
+
+/* Printed along with the trace messages.  Each thread has its own. */
+static __thread unsigned int Callstack_depth = 0;
+
+/* The thread's ID once my_tid() has asked for it, reset by fork_child(). */
+static __thread pid_t My_tid;
+
+/* The number of instrumented calls in progress, including the omitted
+ * ones, and if nonzero, the $Nesting of the call whose subtree is not
+ * traced.  See admit_call(). */
+static __thread unsigned Nesting, My_skip;
+
+/* Whether each call in progress counts in $Callstack_depth, by $Nesting,
+ * so that its return does the same even if $TRACY_CONTROL has changed
+ * the filters since.  Only the first COUNTED_LEVELS are remembered. */
+static __thread unsigned long My_counted[COUNTED_LEVELS
+	/ (8 * sizeof(unsigned long))];
 
-/* Temporary storage of addresses to resolve on exit. */
-static int Async_fd = -1;
+/* $TRACY_SAMPLE's random number generator, $TRACY_FUN_RATE's table,
+ * and the part of the $TRACY_BUDGET the thread has taken for the window
+ * starting at $My_budget_start. */
+static __thread unsigned long long My_seed;
+static __thread struct rate_st *My_rates;
+static pthread_key_t Rate_key;
+static __thread unsigned long long My_budget_start;
+static __thread unsigned My_tokens;
+
+/* The $TRACY_AUTO_EXCLUDE tables of all threads, the functions any of
+ * them has demoted, and how many times it has happened. */
+static struct auto_table_st *Auto_tables;
+static __thread struct auto_table_st *My_autos;
+static struct addr_cache_st *Auto_excluded;
+static unsigned Auto_generation;
+
+/* The current window of $TRACY_BUDGET and how much of it has been used
+ * up, and the number of clock ticks in that second. */
+static unsigned long long Budget_start;
+static unsigned long Budget_used;
+static unsigned long long Second_ticks;
+
+/* Is the trace to be resolved on exit?  ($TRACY_ASYNC) */
+static int Async;
+
+/* The set of addresses to resolve on exit, see remember_addr(). */
+static struct addr_cache_st *Backlog;
+
+/* Where the binary trace goes, and the lock serializing the write_all()s. */
+static int Output_fd = -1;
+static pthread_mutex_t Output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether the process was forked or executed by a traced one, whose output
+ * files we shouldn't overwrite, and when it started tracing.  See
+ * output_fname(). */
+static int Descendant;
+static time_t Start_time;
+
+/* The names fopen_output() has chosen for $TRACY_FOLDED, $TRACY_CALLGRAPH
+ * and $TRACY_AUTO_EXCLUDE_LIST, to be reused when they're written again. */
+static char *Folded_file, *Callgraph_file, *Auto_list_file;
+
+/* The DSOs whose load map has been written in $TRACY_OFFLINE mode,
+ * by their first address, and the lock of write_maps().  rescan_dsos()
+ * takes it with $Registry_lock held, so it nests inside that, and
+ * $Output_lock nests inside it. */
+static struct addr_cache_st *Mapped;
+static pthread_mutex_t Mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The DSOs of the program as of the last rescan_dsos(), and the lock
+ * serializing the changes and getdso().  It's taken before $Mapped_lock,
+ * and after $Profile_lock by dump_profile(). */
+static struct registry_st *Registry;
+static pthread_mutex_t Registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* What the functions are to $TRACY_TRIGGER and the chain filters,
+ * by address.  See fun_flags(). */
+static struct addr_cache_st *Fun_flags;
+
+/* The calls in progress of the thread whose ENTER may still be reported,
+ * the first $My_chain_logged of which have been, and the key to free them
+ * when the thread exits.  See chain_event(). */
+static __thread struct chain_frame_st *My_chain;
+static __thread unsigned My_chain_size, My_chain_logged;
+static pthread_key_t Chain_key;
+
+/* The $Nesting of the $TRACY_PRUNE call the thread is in, or 0. */
+static __thread unsigned My_prune;
+
+/* The $Nesting of the call of the $TRACY_TRIGGER function the thread
+ * is in, or 0, and the events before it if $Trigger_history: the last
+ * $My_history_len of them ending at $My_history_head. */
+static __thread unsigned My_trigger;
+static __thread struct event_st *My_history;
+static __thread unsigned My_history_head, My_history_len;
+static pthread_key_t History_key;
+
+/* $TRACY_BUFFERED mode: all the rings there are, the calling thread's,
+ * and the key to release it when the thread exits, and the writer thread
+ * with the flag telling it whether we're still running. */
+static struct ring_st *Rings;
+static __thread struct ring_st *My_ring;
+static pthread_key_t Ring_key;
+static pthread_t Writer;
+static int Writer_running;
+
+/* $TRACY_MODE=flight: the BIN_MAP sections of the load map up to
+ * $Flight_maps_len, the file to dump the rings in, whether a dump is in
+ * progress, and the calling thread's alternate signal stack. */
+static char *Flight_maps;
+static size_t Flight_maps_len, Flight_maps_size;
+static char Flight_fname[PATH_MAX];
+static int Flight_dumping;
+static __thread void *My_altstack;
+
+/* The $TRACY_SHM region, the calling thread's ring in it, and the key
+ * to release it when the thread exits. */
+static struct tracy_shm_st *Shm;
+static __thread struct tracy_shm_ring_st *My_shm_ring;
+static pthread_key_t Shm_key;
+
+/* The relation of the clock to the real time.  See calibrate_clock(). */
+static unsigned long long Clock_base, Clock_base_ns;
+static long double Clock_ns_per_tick;
+
+/* The profiles of all threads in $TRACY_MODE=profile, whether a signal
+ * has asked for a summary, and the lock of dump_profile(). */
+static struct profile_st *Profiles;
+static __thread struct profile_st *My_profile;
+static int Dump_requested;
+static pthread_mutex_t Profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Closes the $TRACY_PMU counters of the threads when they exit. */
+static pthread_key_t Pmu_key;
+
+/* The socket of $TRACY_CONTROL and where it is, and where the text trace
+ * is written, which it can redirect. */
+static int Control_fd = -1;
+static char Control_path[PATH_MAX];
+static int Trace_fd = STDERR_FILENO;
+
+/* Were we dlopen()ed into the program, by `tracy -attach' for example,
+ * so that it doesn't call our hooks by itself?  See attach_dso(). */
+static int Attached;
+
+/* The configuration, see tracy_init().
+ * -- Config:				$TRACY_INLIBS, $TRACY_EXLIBS,
+ *					$TRACY_INFUNS, $TRACY_EXFUNS,
+ *					$TRACY_MAXDEPTH, $TRACY_MINDEPTH,
+ *					$TRACY_SAMPLE, $TRACY_SAMPLE_DEPTH,
+ *					$TRACY_OUTPUT of the text trace,
+ *					which $TRACY_CONTROL can change,
+ *					$Env_config at first
+ * -- Control_fname:			$TRACY_CONTROL
+ * -- Clock:				$TRACY_CLOCK
+ * -- Use_backtrace:			$TRACY_BACKTRACE
+ * -- Binary:				$TRACY_ASYNC=binary
+ * -- Output_fname:			$TRACY_OUTPUT of the binary trace
+ * -- Offline:				$TRACY_OFFLINE
+ * -- Buffered:				$TRACY_BUFFERED
+ * -- Shm:				$TRACY_SHM, $TRACY_SHM_THREADS
+ * -- Ring_size, Ring_block:		$TRACY_RING_SIZE, $TRACY_OVERFLOW
+ * -- Mode, Flight:			$TRACY_MODE
+ * -- Folded_fname, Folded_counts:	$TRACY_FOLDED, $TRACY_FOLDED_COUNTS
+ * -- Callgraph_fname:			$TRACY_CALLGRAPH
+ * -- Pmu_events, Pmu_count:		$TRACY_PMU
+ * -- Fun_rate, Budget, Budget_batch:	$TRACY_FUN_RATE, $TRACY_BUDGET
+ * -- Limited:				either of the above
+ * -- Auto_exclude, Auto_rate,		$TRACY_AUTO_EXCLUDE,
+ *    Auto_list_fname:			$TRACY_AUTO_EXCLUDE_RATE,
+ *					$TRACY_AUTO_EXCLUDE_LIST
+ * -- Trigger, Trigger_history:		$TRACY_TRIGGER, $TRACY_TRIGGER_HISTORY
+ * -- Chain_with, Chain_without:	$TRACY_CHAIN_WITH, $TRACY_CHAIN_WITHOUT
+ * -- Chain_min, Chain_max:		$TRACY_CHAIN_MIN, $TRACY_CHAIN_MAX
+ * -- Chains, Chain_eager:		any of the above or $TRACY_LOG_CALLS,
+ *					and whether ENTERs can be reported
+ *					before the chains end
+ * -- Prune:				$TRACY_PRUNE
+ * -- the rest:				$TRACY_LOG_* */
+static struct config_st Env_config;
+static struct config_st *Config = &Env_config;
+static char const *Control_fname;
+static int Entries_only, Indent, Log_fname, Log_time, Log_tid;
+static clockid_t Clock;
+static int Use_backtrace, Binary, Offline, Buffered, Ring_block;
+static char const *Output_fname;
+static unsigned Ring_size;
+static enum { MODE_TRACE, MODE_PROFILE } Mode;
+static int Flight;
+static char const *Folded_fname;
+static int Folded_counts;
+static char const *Callgraph_fname;
+static struct pmu_event_st const *Pmu_events[PMU_MAX];
+static unsigned Pmu_count;
+static unsigned Fun_rate, Budget, Budget_batch;
+static int Limited;
+static unsigned long long Auto_exclude;
+static unsigned long Auto_rate;
+static char const *Auto_list_fname;
+static struct glob_st const *Trigger;
+static unsigned Trigger_history;
+static struct glob_st const *Chain_with, *Chain_without;
+static unsigned Chain_min, Chain_max;
+static int Chains, Chain_eager;
+static struct glob_st const *Prune;
+static int Log_calls;
 
 /* Program code */
 /* fgrep matching {{{ */
@@ -198,7 +1101,8 @@ static void hash_path(struct word_st *word, char const *path)
 /*
  * Returns the basename of $path if it matches any of the $words,
  * otherwise returns NULL.  For low number of words this method
- * was found faster than using a GHashTable: (135450000 iterations)
+ * was found faster than using a GHashTable (bench/match.c measures it):
+ * (135450000 iterations)
  *
  * match_words():	14.780s
  * GHashTable:		23.178s
@@ -271,621 +1175,6917 @@ static struct word_st *mkwords(char const *str)
 /* }}} */
 
 /* (Extended) Glob matching {{{ */
-/* Finds the first occurrence of $c in $str in the outermost grouping scope. */
-static char const *find_end_of_glob(char const *str, char c)
+/*
+ * Extended glob patterns look like:
+ * "alpha:be(t:l)a:g*a:d???a:ep(x(xx:yy)y:z*z)silon:sig(ma:)",
+ * where parenthesis denote grouping and colons delimit alternatives.
+ * An unclosed group ends at the end of the pattern, and unmatched closing
+ * parenthesis are ignored.
+ *
+ * Interpreting the pattern string directly required a lot of backtracking
+ * with many alternatives, so mkglob() compiles it to a program for a tiny
+ * virtual machine instead, which match_eglob() runs over the string once,
+ * pursuing all alternatives at the same time (Pike's VM, without
+ * submatches).  The instructions are:
+ *
+ * -- GLOB_CHAR:	match .c, continue with the next instruction
+ * -- GLOB_ANY:		match any character (for '?')
+ * -- GLOB_SPLIT:	continue both at .x and .y
+ * -- GLOB_JMP:		continue at .x
+ * -- GLOB_MATCH:	the pattern matches if we're at the end of the string
+ *
+ * Most of the time the program is further turned into a DFA by mkglob_dfa(),
+ * and then matching is just following a table character by character.
+ */
+/* The largest DFA we're willing to build. */
+#define GLOB_MAX_STATES		1024
+
+/* Builds the syntax tree of the alternatives starting at $*strp. */
+static int parse_glob_alt(struct glob_st *glob, char const **strp,
+	unsigned depth);
+
+/* Adds a new node of $type to $glob's tree and returns its index. */
+static int new_glob_node(struct glob_st *glob, int type)
 {
-	unsigned depth;
+	struct glob_node_st *node;
 
-	depth = 0;
-	for (; *str; str++)
+	node = &glob->nodes[glob->nnodes];
+	node->type = type;
+	node->c = '\0';
+	node->first = node->last = node->next = -1;
+	return glob->nnodes++;
+} /* new_glob_node */
+
+/* Appends $child to $parent's children. */
+static void add_glob_node(struct glob_st *glob, int parent, int child)
+{
+	if (glob->nodes[parent].last < 0)
+		glob->nodes[parent].first = child;
+	else
+		glob->nodes[glob->nodes[parent].last].next = child;
+	glob->nodes[parent].last = child;
+} /* add_glob_node */
+
+/* Builds the tree of a sequence without top-level alternatives.
+ * Returns the index of the GLOB_SEQ node. */
+static int parse_glob_seq(struct glob_st *glob, char const **strp,
+	unsigned depth)
+{
+	int seq;
+	char const *str;
+
+	seq = new_glob_node(glob, GLOB_SEQ);
+	for (str = *strp; *str && *str != ':'; )
 	{
-		if (depth == 0 && *str == c)
-			return str + 1;
-		else if (*str == '(')
-			depth++;
-		else if (*str == ')')
+		int item;
+
+		if (*str == ')')
 		{
 			if (depth > 0)
-				depth--;
-			else
-				return NULL;
+				break;
+			str++;
+			continue;
+		} else if (*str == '(')
+		{
+			str++;
+			item = parse_glob_alt(glob, &str, depth + 1);
+			if (*str == ')')
+				str++;
+		} else if (*str == '*')
+		{
+			item = new_glob_node(glob, GLOB_STAR);
+			str++;
+		} else if (*str == '?')
+		{
+			item = new_glob_node(glob, GLOB_ANY);
+			str++;
+		} else
+		{
+			item = new_glob_node(glob, GLOB_CHAR);
+			glob->nodes[item].c = *str++;
 		}
+
+		add_glob_node(glob, seq, item);
 	} /* for */
-	return NULL;
-} /* find_end_of_glob */
 
-/* Like match_eglob(), but doesn't support top-level alterations. */
-static int match_glob(char const *pattern, char const *str)
+	*strp = str;
+	return seq;
+} /* parse_glob_seq */
+
+static int parse_glob_alt(struct glob_st *glob, char const **strp,
+	unsigned depth)
 {
-	 /* The very basic idea is due to BWK from the Beautiful Code. */
+	int alt;
+
+	alt = new_glob_node(glob, GLOB_ALT);
 	for (;;)
 	{
-		switch (*pattern)
-		{
-		case '(':
-			/* Let match_eglob() sort it out. */
-			pattern++;
-			return match_eglob(pattern, str);
-		case ')':
-			/* Like below. */
-			pattern++;
+		add_glob_node(glob, alt, parse_glob_seq(glob, strp, depth));
+		if (**strp != ':')
 			break;
-		case ':':
-			/* An alternative matched, continue right after
-			 * the alteration. */
-			if ((pattern = find_end_of_glob(pattern, ')')) != NULL)
+		(*strp)++;
+	}
+
+	return alt;
+} /* parse_glob_alt */
+
+/* Adds an instruction to $glob's program and returns its index. */
+static unsigned emit_glob(struct glob_st *glob, int op, int c,
+	unsigned x, unsigned y)
+{
+	struct glob_insn_st *insn;
+
+	insn = &glob->prog[glob->ninsns];
+	insn->op = op;
+	insn->c = c;
+	insn->x = x;
+	insn->y = y;
+	return glob->ninsns++;
+} /* emit_glob */
+
+/* Generates the program of the $inode:th node of $glob's tree. */
+static void compile_glob(struct glob_st *glob, int inode)
+{
+	int child, next;
+	unsigned split, jmps, link;
+	struct glob_node_st const *node;
+
+	node = &glob->nodes[inode];
+	switch (node->type)
+	{
+	case GLOB_CHAR:
+		emit_glob(glob, GLOB_CHAR, node->c, 0, 0);
+		break;
+	case GLOB_ANY:
+		emit_glob(glob, GLOB_ANY, 0, 0, 0);
+		break;
+	case GLOB_STAR:
+		/* L: SPLIT L+1, L+3; ANY; JMP L */
+		split = emit_glob(glob, GLOB_SPLIT, 0, 0, 0);
+		emit_glob(glob, GLOB_ANY, 0, 0, 0);
+		emit_glob(glob, GLOB_JMP, 0, split, 0);
+		glob->prog[split].x = split + 1;
+		glob->prog[split].y = glob->ninsns;
+		break;
+	case GLOB_SEQ:
+		for (child = node->first; child >= 0;
+				child = glob->nodes[child].next)
+			compile_glob(glob, child);
+		break;
+	case GLOB_ALT:
+		/* Try each alternative, and continue with the instruction
+		 * after the last one when either has matched.  The JMPs
+		 * to be patched are chained through their .x. */
+		jmps = 0;
+		for (child = node->first; child >= 0; child = next)
+		{
+			if ((next = glob->nodes[child].next) < 0)
+			{
+				compile_glob(glob, child);
 				break;
-		case '\0':
-			return !*str;
+			}
 
-		case '*':
-			/* Try to ignore more and more characters of $str
-			 * until we're out of them. */
-			pattern++;
-			do
-				if (match_glob(pattern, str))
-					return 1;
-			while (*str++);
-			return 0;
+			split = emit_glob(glob, GLOB_SPLIT, 0, 0, 0);
+			glob->prog[split].x = glob->ninsns;
+			compile_glob(glob, child);
+			jmps = emit_glob(glob, GLOB_JMP, 0, jmps, 0) + 1;
+			glob->prog[split].y = glob->ninsns;
+		}
 
-		case '?':
-			if (!*str++)
-				return 0;
-			pattern++;
+		while (jmps)
+		{
+			link = glob->prog[jmps - 1].x;
+			glob->prog[jmps - 1].x = glob->ninsns;
+			jmps = link;
+		}
+		break;
+	} /* switch */
+} /* compile_glob */
+
+/* Adds $pc and whatever it jumps to to $list, unless they're $marked. */
+static void add_glob_thread(struct glob_st const *glob, unsigned *list,
+	unsigned *np, unsigned *marked, unsigned gen, unsigned *stack,
+	unsigned pc)
+{
+	unsigned sp;
+
+	sp = 0;
+	stack[sp++] = pc;
+	while (sp > 0)
+	{
+		pc = stack[--sp];
+		if (marked[pc] == gen)
+			continue;
+		marked[pc] = gen;
+
+		switch (glob->prog[pc].op)
+		{
+		case GLOB_JMP:
+			stack[sp++] = glob->prog[pc].x;
+			break;
+		case GLOB_SPLIT:
+			/* Push .y first to try .x first. */
+			stack[sp++] = glob->prog[pc].y;
+			stack[sp++] = glob->prog[pc].x;
 			break;
 		default:
-			if (*str++ != *pattern++)
-				return 0;
+			list[(*np)++] = pc;
 			break;
-		} /* switch */
-	} /* for */
-} /* match_glob */
+		}
+	} /* while */
+} /* add_glob_thread */
 
-/*
- * Match $str against an extended glob $pattern, like:
- * "alpha:be(t:l)a:g*a:d???a:ep(x(xx:yy)y:z*z)silon:sig(ma:)",
- * where parenthesis denote grouping and colons delimit alternatives.
- *
- * This implementation was found at least as fast as mainstream
- * library routines while being way smarter.  The slightly less
- * flexible match_glob() "backend" beat them all, to death.
- * (These results are all for non-overcomplicated patterns
- * like "libg*2.0.*" which don't require too much backtracking.)
- *
- * match_glob():		   7.748s
- * match_eglob():		  18.083s
- * fnmatch():			  17.928s
- * g_pattern_match_string():	  16.391s
- * g_pattern_match_simple():	1:22.820s
- */
-static int match_eglob(char const *pattern, char const *str)
+/* Orders instruction indexes for qsort(). */
+static int cmppcs(void const *lhs, void const *rhs)
 {
-	do
-		if (match_glob(pattern, str))
-			return 1;
-	while ((pattern = find_end_of_glob(pattern, ':')) != NULL);
-	return 0;
-} /* match_eglob */
-/* }}} */
+	unsigned l = *(unsigned const *)lhs, r = *(unsigned const *)rhs;
+	return l < r ? -1 : l > r;
+} /* cmppcs */
 
-/* Function name resolution {{{ */
-/* If $addr is defined by $dso, returns its function name.
- * $base is the where the DSO is loaded in the memory. */
-static char const *getsym(struct dso_st const *dso,
-	void const *base, void const *addr)
+/* Returns the DFA state of the $n instructions in $set, making a new one
+ * if there hasn't been such.  Returns -1 if there are too many states. */
+static int add_dfa_state(struct glob_st *glob, struct dfa_builder_st *dfa,
+	unsigned *set, unsigned n)
 {
-	char const *name;
-	unsigned diff, now;
-	Elf_Sym const *closest, *sym;
-
-	/* $dso->symtab tells where the functions begin, but $addr
-	 * may point anywhere inside the function.  We need to find
-	 * the function defined closest to $addr. */
-	diff = 0;
-	closest = NULL;
-	for (sym = dso->symtab; sym < dso->symend; sym++)
+	unsigned h, i, state;
+
+	qsort(set, n, sizeof(*set), cmppcs);
+	for (h = n, i = 0; i < n; i++)
+		h = h * 31 + set[i];
+	for (h %= 2 * GLOB_MAX_STATES; (state = dfa->hash[h]) != 0;
+			h = (h + 1) % (2 * GLOB_MAX_STATES))
+		if (dfa->lengths[state-1] == n && !memcmp(
+				&dfa->pool[dfa->offsets[state-1]], set,
+				sizeof(*set) * n))
+			return state - 1;
+
+	/* New state. */
+	if (glob->nstates >= GLOB_MAX_STATES)
+		return -1;
+	if (dfa->npool + n > dfa->poolsize)
 	{
-		Elf_Addr eddr;
+		unsigned *pool;
 
-		/*
-		 * In the symtabs of libraries and dlopen()ed DSOs there are
-		 * offsets, relative to $base, but for the executable they
-		 * are true memory locations.  $eddr is $addr, comparable with
-		 * sym->st_value.
-		 */
-		eddr = sym->st_value > base-NULL
-			? addr-NULL : addr-base;
+		dfa->poolsize = 2 * (dfa->npool + n);
+		if (!(pool = realloc(dfa->pool,
+				sizeof(*pool) * dfa->poolsize)))
+			return -1;
+		dfa->pool = pool;
+	}
 
-		/* Only addresses *below* the function entry point may
-		 * belong to it. */
-		if (eddr < sym->st_value)
-			continue;
+	memcpy(&dfa->pool[dfa->npool], set, sizeof(*set) * n);
+	dfa->offsets[glob->nstates] = dfa->npool;
+	dfa->lengths[glob->nstates] = n;
+	dfa->npool += n;
+
+	glob->accepting[glob->nstates] = 0;
+	for (i = 0; i < n; i++)
+		if (glob->prog[set[i]].op == GLOB_MATCH)
+			glob->accepting[glob->nstates] = 1;
+
+	dfa->hash[h] = glob->nstates + 1;
+	return glob->nstates++;
+} /* add_dfa_state */
+
+/*
+ * Turns $glob's program into a DFA by subset construction, so matching takes
+ * a single table lookup per character.  Each state of the DFA is a set of
+ * GLOB_CHAR, GLOB_ANY and GLOB_MATCH instructions the VM would be running
+ * at the same time.  Characters not distinguished by the pattern share the
+ * same column of the transition table.  Some patterns would make a huge DFA;
+ * for them we give up at GLOB_MAX_STATES and leave it to the VM.
+ */
+static void mkglob_dfa(struct glob_st *glob)
+{
+	struct dfa_builder_st dfa;
+	unsigned i, c, n, gen, *set, *marked, *stack;
+	unsigned char rep[256];
+	int ok, *next;
 
-		now = eddr - sym->st_value;
-		if (!closest || diff > now)
+	/* Assign a class to each character in the pattern,
+	 * and remember a representative of each class. */
+	memset(glob->classes, 0, sizeof(glob->classes));
+	glob->nclasses = 1;
+	for (i = 0; i < glob->ninsns; i++)
+		if (glob->prog[i].op == GLOB_CHAR
+				&& !glob->classes[glob->prog[i].c])
 		{
-			if (dso->strtab + sym->st_name >= dso->strend)
-				continue;
-			if (*(dso->strtab + sym->st_name) == '$')
-				continue;
-			closest = sym;
-			diff = now;
-			if (diff == 0)
-				break;
+			rep[glob->nclasses] = glob->prog[i].c;
+			glob->classes[glob->prog[i].c] = glob->nclasses++;
 		}
-	} /* for */
 
-	if (!closest)
-		return NULL;
+	n = glob->ninsns;
+	glob->nstates = 0;
+	glob->dfa = malloc(sizeof(*glob->dfa)
+		* GLOB_MAX_STATES * glob->nclasses);
+	glob->accepting = malloc(GLOB_MAX_STATES);
+	dfa.offsets	= malloc(sizeof(*dfa.offsets) * GLOB_MAX_STATES);
+	dfa.lengths	= malloc(sizeof(*dfa.lengths) * GLOB_MAX_STATES);
+	dfa.hash	= calloc(2 * GLOB_MAX_STATES, sizeof(*dfa.hash));
+	dfa.pool	= NULL;
+	dfa.npool	= dfa.poolsize = 0;
+	marked		= calloc(n, sizeof(*marked));
+	set		= malloc(sizeof(*set) * n);
+	stack		= malloc(sizeof(*stack) * (2*n + 1));
 
-	/* Finally, look up the name of the $closest symbol. */
-	name = dso->strtab + closest->st_name;
-	return name < dso->strend ? name : NULL;
-} /* getsym */
+	ok = 0;
+	if (!glob->dfa || !glob->accepting || !dfa.offsets || !dfa.lengths
+			|| !dfa.hash || !marked || !set || !stack)
+		goto out;
 
-/* Processes $file, an ELF image, and tries to find
- * its string and symbol tables. */
-static int getelf(struct dso_st *dso, void const *file)
-{
-	unsigned i;
-	Elf_Ehdr const *elf;
-	Elf_Shdr const *sec, *strsec, *symsec;
+	/* The start state is the closure of the first instruction.
+	 * $gen starts at 1 because $marked is zeroed. */
+	gen = 1;
+	c = 0;
+	add_glob_thread(glob, set, &c, marked, gen, stack, 0);
+	if (add_dfa_state(glob, &dfa, set, c) < 0)
+		goto out;
 
-	/* Is it ELF at all? */
-	elf = file;
-	if (elf->e_ident[0] != ELFMAG0 || elf->e_ident[1] != ELFMAG1)
-		return 0;
-	if (elf->e_ident[2] != ELFMAG2 || elf->e_ident[3] != ELFMAG3)
-		return 0;
+	/* Find out where each state goes with each class of characters.
+	 * New states are added to the end, so this is a breadth-first
+	 * traversal of the DFA. */
+	for (i = 0; i < glob->nstates; i++)
+		for (c = 0; c < glob->nclasses; c++)
+		{
+			unsigned j, k;
+			unsigned const *cur;
 
-	/* Are we using the appropriate ELF types for this DSO?  According to
-	 * the magic file the number of bits is encoded in e_ident. */
-#ifdef __LP64__
-	if (elf->e_ident[4] != 2)
+			gen++;
+			k = 0;
+			cur = &dfa.pool[dfa.offsets[i]];
+			for (j = 0; j < dfa.lengths[i]; j++)
+			{
+				struct glob_insn_st const *insn;
+
+				insn = &glob->prog[cur[j]];
+				if (insn->op == GLOB_ANY || (c > 0
+						&& insn->op == GLOB_CHAR
+						&& insn->c == rep[c]))
+					add_glob_thread(glob, set, &k,
+						marked, gen, stack, cur[j]+1);
+			}
+
+			/* add_dfa_state() may move $dfa.pool,
+			 * but we're done with $cur by now. */
+			next = &glob->dfa[i * glob->nclasses + c];
+			if (!k)
+				/* Dead end. */
+				*next = -1;
+			else if ((*next = add_dfa_state(glob, &dfa,
+					set, k)) < 0)
+				goto out;
+		}
+	ok = 1;
+
+	/* Give back what we didn't use. */
+	if ((next = realloc(glob->dfa, sizeof(*glob->dfa)
+			* glob->nstates * glob->nclasses)) != NULL)
+		glob->dfa = next;
+
+out:
+	if (!ok)
+	{	/* Use the VM. */
+		free(glob->dfa);
+		free(glob->accepting);
+		glob->dfa = NULL;
+		glob->accepting = NULL;
+	}
+
+	free(dfa.offsets);
+	free(dfa.lengths);
+	free(dfa.hash);
+	free(dfa.pool);
+	free(marked);
+	free(set);
+	free(stack);
+} /* mkglob_dfa */
+
+/* Returns the compiled program of the extended glob $pattern. */
+static struct glob_st *mkglob(char const *pattern)
+{
+	size_t len;
+	struct glob_st *glob;
+
+	/* Each character of $pattern becomes at most three instructions
+	 * (a '*' or a ':') and two nodes (a '(' or a ':'). */
+	len = strlen(pattern);
+	if (!(glob = malloc(sizeof(*glob))))
+		goto out0;
+	else if (!(glob->nodes = malloc(sizeof(*glob->nodes) * (2*len + 2))))
+		goto out1;
+	else if (!(glob->prog = malloc(sizeof(*glob->prog) * (3*len + 2))))
+		goto out2;
+
+	glob->nnodes = glob->ninsns = 0;
+	compile_glob(glob, parse_glob_alt(glob, &pattern, 0));
+	emit_glob(glob, GLOB_MATCH, 0, 0, 0);
+	mkglob_dfa(glob);
+
+	/* We don't need the tree anymore. */
+	free(glob->nodes);
+	glob->nodes = NULL;
+
+	return glob;
+
+out2:	free(glob->nodes);
+out1:	free(glob);
+out0:	LOGIT("malloc: %m");
+	return NULL;
+} /* mkglob */
+
+/* Returns whether $str matches $glob, compiled by mkglob(). */
+static int match_eglob(struct glob_st const *glob, char const *str)
+{
+	unsigned i, n, nnext, gen, *buf, *cur, *next, *tmp, *marked, *stack;
+	unsigned stackbuf[5*256 + 1];
+	int matched;
+
+	if (glob->dfa)
+	{
+		int state;
+
+		state = 0;
+		for (; *str && state >= 0; str++)
+			state = glob->dfa[state * glob->nclasses
+				+ glob->classes[(unsigned char)*str]];
+		return state >= 0 && glob->accepting[state];
+	}
+
+	/* We need two thread lists and the generation marks, each of them as
+	 * long as the program, and the stack of add_glob_thread(), which has
+	 * at most two entries pushed for each instruction. */
+	if (glob->ninsns <= 256)
+		buf = stackbuf;
+	else if (!(buf = malloc(sizeof(*buf) * (5*glob->ninsns + 1))))
+		return 0;
+	cur    = buf;
+	next   = &cur[glob->ninsns];
+	marked = &next[glob->ninsns];
+	stack  = &marked[glob->ninsns];
+	memset(marked, 0, sizeof(*marked) * glob->ninsns);
+
+	n = 0;
+	gen = 1;
+	add_glob_thread(glob, cur, &n, marked, gen, stack, 0);
+	for (; *str && n > 0; str++)
+	{
+		gen++;
+		nnext = 0;
+		for (i = 0; i < n; i++)
+		{
+			struct glob_insn_st const *insn;
+
+			insn = &glob->prog[cur[i]];
+			if (insn->op == GLOB_ANY
+				|| (insn->op == GLOB_CHAR && insn->c == *str))
+				add_glob_thread(glob, next, &nnext, marked,
+					gen, stack, cur[i] + 1);
+		}
+
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		n = nnext;
+	} /* for */
+
+	matched = 0;
+	if (!*str)
+		for (i = 0; i < n && !matched; i++)
+			matched = glob->prog[cur[i]].op == GLOB_MATCH;
+
+	if (buf != stackbuf)
+		free(buf);
+	return matched;
+} /* match_eglob */
+/* }}} */
+
+/* Function name resolution {{{ */
+/* Orders sym_st:s by address for qsort().  Aliases are ordered by their
+ * position in the string table to make the outcome deterministic. */
+static int cmpsyms(void const *lhs, void const *rhs)
+{
+	struct sym_st const *l = lhs, *r = rhs;
+
+	if (l->addr != r->addr)
+		return l->addr < r->addr ? -1 : 1;
+	else if (l->name != r->name)
+		return l->name < r->name ? -1 : 1;
+	else
+		return 0;
+} /* cmpsyms */
+
+/* Returns whether $sym is to be included in the index of mksyms():
+ * if it's a function defined by the DSO, or the PLT entry of one
+ * in an executable, which is undefined, but has a value. */
+static int is_function(Elf_Sym const *sym)
+{
+	return ELF_ST_TYPE(sym->st_info) == STT_FUNC
+		&& (sym->st_shndx != SHN_UNDEF || sym->st_value);
+} /* is_function */
+
+/*
+ * Builds $dso->syms, the index getsym() looks up function names in.
+ * Only named functions are included, sorted by their address, and of
+ * aliases only the first one is kept.  Walking the entire symbol table
+ * on each lookup was the most expensive part of tracing with binaries
+ * of tens of thousands of symbols.
+ */
+static int mksyms(struct dso_st *dso)
+{
+	unsigned i, n;
+	Elf_Sym const *sym;
+
+	/* Count the functions first to allocate the exact amount. */
+	for (n = 0, sym = dso->symtab; sym < dso->symend; sym++)
+		if (is_function(sym))
+			n++;
+
+	dso->nsyms = 0;
+	if (!n)
+	{
+		dso->syms = NULL;
+		return 1;
+	} else if (!(dso->syms = malloc(sizeof(*dso->syms) * n)))
+	{
+		LOGIT("malloc(%zu): %m", sizeof(*dso->syms) * n);
+		return 0;
+	}
+
+	for (sym = dso->symtab; sym < dso->symend; sym++)
+	{
+		char const *name;
+
+		if (!is_function(sym))
+			continue;
+
+		name = dso->strtab + sym->st_name;
+		if (name >= dso->strend || *name == '$')
+			continue;
+
+		dso->syms[dso->nsyms].addr = sym->st_value;
+		dso->syms[dso->nsyms].size = sym->st_size;
+		dso->syms[dso->nsyms].name = name;
+		dso->syms[dso->nsyms].undefined = sym->st_shndx == SHN_UNDEF;
+		dso->nsyms++;
+	} /* for */
+
+	/* Sort by address and drop the aliases. */
+	qsort(dso->syms, dso->nsyms, sizeof(*dso->syms), cmpsyms);
+	for (i = n = 0; i < dso->nsyms; i++)
+		if (!n || dso->syms[n-1].addr != dso->syms[i].addr)
+			dso->syms[n++] = dso->syms[i];
+	dso->nsyms = n;
+
+	return 1;
+} /* mksyms */
+
+/* If $addr is defined by $dso, returns the symbol of its function. */
+static struct sym_st const *getsym(struct dso_st const *dso,
+	void const *addr)
+{
+	Elf_Addr eddr;
+	unsigned lo, hi;
+	struct sym_st const *closest;
+
+	/*
+	 * In the symtabs of libraries and dlopen()ed DSOs there are
+	 * offsets, relative to where they are loaded, but for executables
+	 * not linked position-independently they are true memory locations,
+	 * and their .bias is 0.  $eddr is $addr, comparable with the symbol
+	 * values.
+	 */
+	eddr = (Elf_Addr)addr - dso->bias;
+
+	/* $dso->syms tells where the functions begin, but $addr may point
+	 * anywhere inside the function.  Find the last one beginning at
+	 * or below $addr with binary search. */
+	lo = 0;
+	hi = dso->nsyms;
+	while (lo < hi)
+	{
+		unsigned mid;
+
+		mid = lo + (hi - lo) / 2;
+		if (dso->syms[mid].addr <= eddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo)
+		return NULL;
+	closest = &dso->syms[lo-1];
+
+	/* If we know the size of the function make sure $addr is inside.
+	 * Otherwise it's probably some unnamed code after it. */
+	if (closest->size && eddr - closest->addr >= closest->size)
+		return NULL;
+	if (closest->undefined && eddr != closest->addr)
+		return NULL;
+
+	return closest;
+} /* getsym */
+
+/* Maps the contents of $sec of the ELF file $fd of $fsize bytes into
+ * the next one of $dso->maps.  Returns where it starts or NULL. */
+static void const *map_section(struct dso_st *dso, int fd, off_t fsize,
+	Elf_Shdr const *sec)
+{
+	off_t start;
+	size_t size;
+	void const *map;
+
+	if (sec->sh_type == SHT_NOBITS || sec->sh_offset > fsize
+			|| sec->sh_size > fsize - sec->sh_offset)
+		return NULL;
+
+	/* mmap() needs a page-aligned offset. */
+	start = sec->sh_offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	size = sec->sh_offset + sec->sh_size - start;
+	if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, start))
+			== MAP_FAILED)
+		return NULL;
+
+	dso->maps[dso->nmaps].addr = map;
+	dso->maps[dso->nmaps].size = size;
+	dso->nmaps++;
+	return map + (sec->sh_offset - start);
+} /* map_section */
+
+/* Unmaps what map_section() mapped for $dso. */
+static void unmap_sections(struct dso_st *dso)
+{
+	while (dso->nmaps > 0)
+	{
+		dso->nmaps--;
+		munmap((void *)dso->maps[dso->nmaps].addr,
+			dso->maps[dso->nmaps].size);
+	}
+} /* unmap_sections */
+
+/*
+ * Reads the section headers of $fd, an ELF file of $fsize bytes, and maps
+ * its symbol table (.symtab, or .dynsym if it's stripped) and the string
+ * table belonging to it.  Only the section headers and these sections are
+ * read, not the debug information and the rest of the file.
+ */
+static int getelf(struct dso_st *dso, int fd, off_t fsize)
+{
+	unsigned i;
+	size_t size;
+	Elf_Ehdr elf;
+	Elf_Shdr *shdrs;
+	Elf_Shdr const *sec, *strsec, *symsec;
+
+	/* Is it ELF at all? */
+	if (pread(fd, &elf, sizeof(elf), 0) != sizeof(elf))
+		return 0;
+	if (elf.e_ident[0] != ELFMAG0 || elf.e_ident[1] != ELFMAG1)
+		return 0;
+	if (elf.e_ident[2] != ELFMAG2 || elf.e_ident[3] != ELFMAG3)
+		return 0;
+
+	/* Are we using the appropriate ELF types for this DSO?  According to
+	 * the magic file the number of bits is encoded in e_ident. */
+#ifdef __LP64__
+	if (elf.e_ident[4] != 2)
 		/* We're 64-bit but the DSO is not. */
 		return 0;
 #else
-	if (elf->e_ident[4] != 1)
+	if (elf.e_ident[4] != 1)
 		/* We're 32-bit but the DSO is not. */
 		return 0;
 #endif
+	if (elf.e_shentsize != sizeof(*shdrs) || !elf.e_shnum)
+		return 0;
 
-	/* Find the string and symbol tables. */
-	strsec = symsec = NULL;
-	for (i = 0, sec = file + elf->e_shoff; i < elf->e_shnum; i++, sec++)
-		if (sec->sh_type == SHT_STRTAB)
-			strsec = sec;
-		else if (sec->sh_type == SHT_SYMTAB)
+	size = sizeof(*shdrs) * elf.e_shnum;
+	if (!(shdrs = malloc(size)))
+	{
+		LOGIT("malloc(%zu): %m", size);
+		return 0;
+	} else if (pread(fd, shdrs, size, elf.e_shoff) != size)
+		goto out;
+
+	/* Find the symbol table, preferring the static one, and its string
+	 * table by .sh_link.  A DSO can have many string tables. */
+	symsec = NULL;
+	for (i = 0, sec = shdrs; i < elf.e_shnum; i++, sec++)
+		if (sec->sh_type == SHT_SYMTAB)
+		{
 			symsec = sec;
+			break;
+		} else if (sec->sh_type == SHT_DYNSYM)
+			symsec = sec;
+
+	/* Sanity checking. */
+	if (!symsec || symsec->sh_entsize != sizeof(Elf_Sym))
+		goto out;
+	if (symsec->sh_link >= elf.e_shnum)
+		goto out;
+	strsec = &shdrs[symsec->sh_link];
+	if (strsec->sh_type != SHT_STRTAB)
+		goto out;
+
+	/* All is well, fill $dso. */
+	if (!(dso->symtab = map_section(dso, fd, fsize, symsec))
+		|| !(dso->strtab = map_section(dso, fd, fsize, strsec)))
+	{
+		unmap_sections(dso);
+		goto out;
+	}
+	dso->symend = (void const *)dso->symtab + symsec->sh_size;
+	dso->strend = dso->strtab + strsec->sh_size;
+
+	free(shdrs);
+	return 1;
+
+out:	free(shdrs);
+	return 0;
+} /* getelf */
+
+/* Returns the number of symbols in the dynamic symbol table whose
+ * .gnu.hash section is at $hash.  This table doesn't tell directly,
+ * but each hash chain ends with a value having its lowest bit set,
+ * and the last chain ends with the last symbol. */
+static unsigned gnu_hash_nsyms(Elf32_Word const *hash)
+{
+	Elf32_Word nbuckets, symoffset, bloomsize, last;
+	Elf32_Word const *buckets, *chain;
+	unsigned i;
+
+	nbuckets  = hash[0];
+	symoffset = hash[1];
+	bloomsize = hash[2];
+	buckets = &hash[4 + bloomsize * (sizeof(Elf_Addr) / 4)];
+	chain = &buckets[nbuckets];
+
+	for (last = 0, i = 0; i < nbuckets; i++)
+		if (last < buckets[i])
+			last = buckets[i];
+	if (last < symoffset)
+		return symoffset;
+
+	while (!(chain[last - symoffset] & 1))
+		last++;
+	return last + 1;
+} /* gnu_hash_nsyms */
+
+/*
+ * Finds the dynamic symbol table of $dso through its dynamic section
+ * in the memory, for when the file doesn't have section headers or can't
+ * be opened.  The size of the table is only told by the hash tables.
+ */
+static int getdynsym(struct dso_st *dso)
+{
+	unsigned i, nsyms;
+	Elf_Dyn const *dyn;
+	Elf32_Word const *hash, *gnu_hash;
+	char const *strtab;
+	Elf_Sym const *symtab;
+	size_t strsz;
+	char *copy;
+
+	dyn = NULL;
+	for (i = 0; i < dso->phnum; i++)
+		if (dso->phdrs[i].p_type == PT_DYNAMIC)
+			dyn = (Elf_Dyn const *)(dso->bias
+				+ dso->phdrs[i].p_vaddr);
+	if (!dyn)
+		return 0;
+
+	/* The dynamic linker may have relocated the addresses
+	 * in the dynamic section. */
+#define DYNPTR(ptr)	(void const *)((ptr) < dso->bias \
+				? (ptr) + dso->bias : (ptr))
+	strtab = NULL;
+	symtab = NULL;
+	hash = gnu_hash = NULL;
+	strsz = 0;
+	for (; dyn->d_tag != DT_NULL; dyn++)
+		switch (dyn->d_tag)
+		{
+		case DT_STRTAB:
+			strtab = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		case DT_STRSZ:
+			strsz = dyn->d_un.d_val;
+			break;
+		case DT_SYMTAB:
+			symtab = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		case DT_SYMENT:
+			if (dyn->d_un.d_val != sizeof(Elf_Sym))
+				return 0;
+			break;
+		case DT_HASH:
+			hash = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		case DT_GNU_HASH:
+			gnu_hash = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		}
+#undef DYNPTR
+
+	if (!strtab || !symtab)
+		return 0;
+	if (gnu_hash)
+		nsyms = gnu_hash_nsyms(gnu_hash);
+	else if (hash)
+		/* It has an entry in the chain for each symbol. */
+		nsyms = hash[1];
+	else
+		return 0;
+
+	/* mksyms() only needs the symbol table, but the names must
+	 * stay even if the DSO is unloaded. */
+	if (!(copy = malloc(strsz)))
+	{
+		LOGIT("malloc(%zu): %m", strsz);
+		return 0;
+	}
+	memcpy(copy, strtab, strsz);
+
+	dso->strtab = copy;
+	dso->strend = copy + strsz;
+	dso->symtab = symtab;
+	dso->symend = symtab + nsyms;
+	return 1;
+} /* getdynsym */
+
+/*
+ * Loads the symbol table of $dso from the file if possible, otherwise
+ * from the memory, and indexes it.  Returns whether it succeeded.
+ * This is done only once for each DSO, under $Registry_lock.
+ */
+static int getdso(struct dso_st *dso)
+{
+	int hfile, found;
+	struct stat sbuf;
+
+	pthread_mutex_lock(&Registry_lock);
+	if (dso->loaded)
+		goto out;
+
+	found = 0;
+	if ((hfile = open(dso->fname, O_RDONLY)) >= 0)
+	{	/* The mappings stay after closing it. */
+		if (fstat(hfile, &sbuf) == 0)
+			found = getelf(dso, hfile, sbuf.st_size);
+		close(hfile);
+	}
+
+	if (found || getdynsym(dso))
+	{
+		if (mksyms(dso))
+			__atomic_store_n(&dso->loaded, 1, __ATOMIC_RELEASE);
+		else
+			unmap_sections(dso);
+	}
+	if (!dso->loaded)
+		dso->loaded = -1;
+
+out:	pthread_mutex_unlock(&Registry_lock);
+	return dso->loaded > 0;
+} /* getdso */
+
+/* Report decisions {{{ */
+/* These routines belong to an upper layer, but performance justified
+ * their presence here. */
+/* Returns the current snapshot of the configuration.  The tracing threads
+ * take it once per event, the rest of them whenever they need it. */
+static inline struct config_st *get_config(void)
+{
+	return __atomic_load_n(&Config, __ATOMIC_ACQUIRE);
+} /* get_config */
+
+/* Returns the basename of $fname if calls to it are to be reported. */
+static char const *report_dso(char const *fname)
+{
+	char const *base;
+	struct config_st const *config;
+
+	/* Match against the .dso_filter if we have one. */
+	config = get_config();
+	if (config->dso_filter)
+	{
+		if ((base = match_words(config->dso_filter, fname)) != NULL)
+			return config->dso_whitelist ? base : NULL;
+		else if (config->dso_whitelist)
+			return NULL;
+	}
+
+	/* Return the basename of $fname. */
+	return (!(base = strrchr(fname, '/'))) ? fname : base + 1;
+} /* report_dso */
+
+/* Returns whether to report a call to $funame.  If $funame is NULL,
+ * returns 0 if there's whitelisting. */
+static int report_function(char const *funame)
+{
+	struct config_st const *config;
+
+	config = get_config();
+	if (!config->fun_filter)
+		return 1;
+	else if (funame && match_eglob(config->fun_filter, funame))
+		return  config->fun_whitelist;
+	else
+		return !config->fun_whitelist;
+} /* report_function */
+/* }}} */
+
+/* The DSO registry {{{ */
+/*
+ * The DSOs of the program are found with dl_iterate_phdr() and kept in
+ * $Registry, sorted by their address, so we can find which one an address
+ * belongs to by binary search, without asking the dynamic linker.  It's
+ * rebuilt whenever DSOs are dlopen()ed or dlclose()d, or if an address
+ * doesn't belong to any of those known and the dynamic linker's list has
+ * changed since the last time.  The registry is replaced as
+ * a whole, so it can be read without locking.  The dso_st:s are never
+ * freed, however.
+ */
+/* Returns the absolute path of the DSO $name of the dynamic linker,
+ * in $buf if necessary, or NULL if it can't be found out. */
+static char const *dso_path(char const *name, char *buf)
+{
+	ssize_t len;
+
+	/* The executable doesn't have a name, and dlopen()ed DSOs may have
+	 * a relative one, which wouldn't be found after a chdir(). */
+	if (!name[0])
+	{
+		if ((len = readlink("/proc/self/exe", buf, PATH_MAX - 1)) < 0)
+			return NULL;
+		buf[len] = '\0';
+		return buf;
+	} else if (name[0] != '/' && strchr(name, '/')
+			&& realpath(name, buf))
+		return buf;
+	else
+		return name;
+} /* dso_path */
+
+/* Orders dso_st:s by address for qsort(). */
+static int cmpdsos(void const *lhs, void const *rhs)
+{
+	struct dso_st const *l = *(struct dso_st **)lhs;
+	struct dso_st const *r = *(struct dso_st **)rhs;
+
+	return l->start < r->start ? -1 : l->start > r->start;
+} /* cmpdsos */
+
+/* Sets $data to the number of DSOs the dynamic linker has loaded and
+ * unloaded so far, or 0 if it doesn't tell.  Called through
+ * dl_iterate_phdr(). */
+static int get_generation(struct dl_phdr_info *info, size_t size, void *data)
+{
+	if (size >= offsetof(struct dl_phdr_info, dlpi_subs)
+			+ sizeof(info->dlpi_subs))
+		*(unsigned long long *)data = info->dlpi_adds + info->dlpi_subs;
+	else
+		*(unsigned long long *)data = 0;
+	return 1;
+} /* get_generation */
+
+/* Returns what get_generation() says, which changes whenever a DSO is
+ * loaded or unloaded. */
+static unsigned long long dso_generation(void)
+{
+	unsigned long long generation;
+
+	generation = 0;
+	dl_iterate_phdr(get_generation, &generation);
+	return generation;
+} /* dso_generation */
+
+/* What rescan_dso() collects: the DSOs currently loaded, and how many
+ * of them were in $Registry already.  If it .failed, not all of them. */
+struct rescan_st
+{
+	struct registry_st *registry;
+	unsigned size, kept;
+	int failed;
+};
+
+/* Frees $dso if it's not in $old. */
+static void free_new_dso(struct dso_st *dso, struct registry_st const *old)
+{
+	unsigned i;
+
+	if (old)
+		for (i = 0; i < old->ndsos; i++)
+			if (old->dsos[i] == dso)
+				return;
+	free((char *)dso->fname);
+	free((char *)dso->lname);
+	free(dso);
+} /* free_new_dso */
+
+/* Adds the DSO described by $info to the new registry in $data.
+ * Called through dl_iterate_phdr(). */
+static int rescan_dso(struct dl_phdr_info *info, size_t size, void *data)
+{
+	unsigned i;
+	Elf_Addr start, end;
+	char path[PATH_MAX];
+	char const *fname;
+	struct rescan_st *rescan = data;
+	struct registry_st const *old;
+	struct dso_st *dso;
+
+	get_generation(info, size, &rescan->registry->generation);
+
+	/* Where is it loaded? */
+	start = ~(Elf_Addr)0;
+	end = 0;
+	for (i = 0; i < info->dlpi_phnum; i++)
+	{
+		Elf_Phdr const *phdr;
+
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		if (start > phdr->p_vaddr)
+			start = phdr->p_vaddr;
+		if (end < phdr->p_vaddr + phdr->p_memsz)
+			end = phdr->p_vaddr + phdr->p_memsz;
+	}
+	if (start >= end)
+		return 0;
+	start += info->dlpi_addr;
+	end += info->dlpi_addr;
+
+	/* Is it the same as one we knew about? */
+	dso = NULL;
+	if ((old = Registry) != NULL)
+		for (i = 0; i < old->ndsos; i++)
+			if (old->dsos[i]->start == start
+				&& old->dsos[i]->end == end
+				&& old->dsos[i]->bias == info->dlpi_addr
+				&& !strcmp(old->dsos[i]->lname,
+					info->dlpi_name))
+			{
+				dso = old->dsos[i];
+				rescan->kept++;
+				break;
+			}
+
+	if (!dso)
+	{	/* A new one. */
+		if (!(fname = dso_path(info->dlpi_name, path)))
+			return 0;
+		if (!(dso = calloc(1, sizeof(*dso))))
+		{
+			LOGIT("calloc(%zu): %m", sizeof(*dso));
+			return 0;
+		}
+		if (!(dso->fname = strdup(fname))
+			|| !(dso->lname = strdup(info->dlpi_name)))
+		{
+			LOGIT("strdup: %m");
+			free((char *)dso->fname);
+			free(dso);
+			return 0;
+		}
+		dso->start = start;
+		dso->end = end;
+		dso->bias = info->dlpi_addr;
+		dso->phdrs = info->dlpi_phdr;
+		dso->phnum = info->dlpi_phnum;
+	}
+
+	if (rescan->registry->ndsos >= rescan->size)
+	{
+		struct registry_st *bigger;
+
+		rescan->size *= 2;
+		if (!(bigger = realloc(rescan->registry,
+			sizeof(*bigger) + sizeof(*bigger->dsos)*rescan->size)))
+		{
+			LOGIT("realloc: %m");
+			free_new_dso(dso, old);
+			rescan->failed = 1;
+			return 1;
+		}
+		rescan->registry = bigger;
+	}
+	rescan->registry->dsos[rescan->registry->ndsos++] = dso;
+
+	return 0;
+} /* rescan_dso */
+
+/*
+ * Replaces $Registry with the DSOs currently loaded, if it has changed.
+ * If any DSO has been unloaded the address caches are thrown away, because
+ * another one may be loaded at the same address.  (Since the threads may
+ * still be using them, they are not freed.)
+ */
+static void rescan_dsos(void)
+{
+	unsigned i, j;
+	struct rescan_st rescan;
+	struct registry_st *old;
+	struct addr_cache_st *mapped;
+	struct addr_cache_st const *cache;
+
+	pthread_mutex_lock(&Registry_lock);
+
+	rescan.size = 64;
+	rescan.kept = 0;
+	rescan.failed = 0;
+	if (!(rescan.registry = malloc(sizeof(*rescan.registry)
+			+ sizeof(*rescan.registry->dsos) * rescan.size)))
+	{
+		LOGIT("malloc: %m");
+		goto out;
+	}
+	rescan.registry->generation = 0;
+	rescan.registry->ndsos = 0;
+	dl_iterate_phdr(rescan_dso, &rescan);
+
+	old = Registry;
+	if (rescan.failed)
+	{	/* Better to miss the new DSOs than the rest of the old ones. */
+		for (i = 0; i < rescan.registry->ndsos; i++)
+			free_new_dso(rescan.registry->dsos[i], old);
+		free(rescan.registry);
+		goto out;
+	}
+	if (old && rescan.kept == old->ndsos
+		&& rescan.kept == rescan.registry->ndsos)
+	{	/* Nothing has changed. */
+		__atomic_store_n(&old->generation,
+			rescan.registry->generation, __ATOMIC_RELAXED);
+		free(rescan.registry);
+		goto out;
+	}
+
+	qsort(rescan.registry->dsos, rescan.registry->ndsos,
+		sizeof(*rescan.registry->dsos), cmpdsos);
+	__atomic_store_n(&Registry, rescan.registry, __ATOMIC_RELEASE);
+
+	if (old && rescan.kept < old->ndsos)
+	{	/* Forget about what the unloaded DSOs had. */
+		__atomic_store_n(&get_config()->addr_cache, NULL,
+			__ATOMIC_RELEASE);
+		__atomic_store_n(&Fun_flags, NULL, __ATOMIC_RELEASE);
+
+		/* Only keep the maps written of the DSOs still loaded. */
+		pthread_mutex_lock(&Mapped_lock);
+		mapped = NULL;
+		for (i = 0; i < rescan.registry->ndsos; i++)
+		{
+			struct dso_st const *dso;
+
+			dso = rescan.registry->dsos[i];
+			for (j = 0; j < old->ndsos; j++)
+				if (old->dsos[j] == dso)
+					break;
+			if (j >= old->ndsos)
+				continue;
+			for (cache = Mapped; cache; cache = cache->prev)
+				if (find_addr(cache, (void const *)dso->start))
+				{
+					cache_addr(&mapped,
+						(void const *)dso->start,
+						NULL, NULL, NULL, 0);
+					break;
+				}
+		}
+		__atomic_store_n(&Mapped, mapped, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&Mapped_lock);
+	}
+
+	/* The old registry may still be searched by other threads. */
+
+out:	pthread_mutex_unlock(&Registry_lock);
+} /* rescan_dsos */
+
+/* Returns the dso_st containing $addr from $registry or NULL. */
+static struct dso_st *search_dsos(struct registry_st const *registry,
+	void const *addr)
+{
+	unsigned lo, hi;
+
+	if (!registry)
+		return NULL;
+
+	/* Find the last one starting at or below $addr. */
+	lo = 0;
+	hi = registry->ndsos;
+	while (lo < hi)
+	{
+		unsigned mid;
+
+		mid = lo + (hi - lo) / 2;
+		if (registry->dsos[mid]->start <= (Elf_Addr)addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || (Elf_Addr)addr >= registry->dsos[lo-1]->end)
+		return NULL;
+	return registry->dsos[lo-1];
+} /* search_dsos */
+
+/* Returns the DSO $addr belongs to, or NULL if it's not known even after
+ * rescanning the DSOs. */
+static struct dso_st *find_dso(void const *addr)
+{
+	struct dso_st *dso;
+	struct registry_st const *registry;
+	unsigned long long generation;
+
+	registry = __atomic_load_n(&Registry, __ATOMIC_ACQUIRE);
+	if ((dso = search_dsos(registry, addr)) != NULL)
+		return dso;
+
+	/* It may have been loaded by other means than dlopen(), but
+	 * not if nothing has been loaded since the last rescan. */
+	if (registry && (generation = dso_generation()) != 0
+			&& generation == __atomic_load_n(&registry->generation,
+				__ATOMIC_RELAXED))
+		return NULL;
+	rescan_dsos();
+	return search_dsos(__atomic_load_n(&Registry, __ATOMIC_ACQUIRE),
+		addr);
+} /* find_dso */
+/* }}} */
+
+/*
+ * Sets $funamep to the name of the function $addr is contained within.
+ * If $fnamep is not NULL sets it to the name of the DSO where function
+ * is defined.  Returns 1 if everything is OK, 0 if the name was not
+ * found, or -1 if it is not to be reported.  Unless $filtered every
+ * function is to be reported.
+ */
+static int addr2name(char const **fnamep, char const **funamep,
+	void const *addr, int filtered)
+{
+	char const *fname;
+	struct dso_st *dso;
+	struct sym_st const *sym;
+
+	/* Find the file that defined the function of $addr. */
+	if (fnamep)
+		*fnamep = "[???]";
+	if (!(dso = find_dso(addr)))
+		/* We're in trouble, don't do anything. */
+		return !filtered || report_function(NULL) ? 0 : -1;
+
+	/* Check whether calls to this DSO is to be reported here
+	 * to avoid loading it unnecessarily. */
+	if (!filtered)
+		fname = (fname = strrchr(dso->fname, '/')) != NULL
+			? fname + 1 : dso->fname;
+	else if (!(fname = report_dso(dso->fname)))
+		return -1;
+	if (fnamep)
+		*fnamep = fname;
+
+	/* Load the symbols of the DSO when we first need them. */
+	if (__atomic_load_n(&dso->loaded, __ATOMIC_ACQUIRE) <= 0
+			&& !getdso(dso))
+		return !filtered || report_function(NULL) ? 0 : -1;
+	sym = getsym(dso, addr);
+
+	/*
+	 * If a non-PIC executable takes the address of a function defined
+	 * by a library, that address becomes the function's PLT entry in
+	 * the executable, even for the library itself.  Such addresses are
+	 * covered by undefined symbols.  Look up the real definition, which
+	 * is in one of the libraries loaded after us.
+	 */
+	if (sym && sym->undefined)
+	{
+		void const *real;
+
+		if ((real = dlsym(RTLD_NEXT, sym->name)) && real != addr)
+			return addr2name(fnamep, funamep, real, filtered);
+	}
+
+	*funamep = sym ? sym->name : NULL;
+	return !filtered || report_function(*funamep)
+		? *funamep != NULL : -1;
+} /* addr2name */
+
+/* Address cache {{{ */
+/*
+ * The address cache is shared by all threads without locking.  Entries are
+ * never removed or changed once they're complete, and when a table becomes
+ * too crowded a bigger one is published in its place.  The old tables are
+ * kept around on the .prev chain, because other threads may still be
+ * reading them, and their entries are migrated on demand.
+ */
+/* Returns the entry of $addr in $cache if it's complete, otherwise NULL. */
+static struct addr_st const *find_addr(struct addr_cache_st const *cache,
+	void const *addr)
+{
+	unsigned long h, i;
+
+	/* Fibonacci hashing: the low bits of function addresses are
+	 * not random at all, so spread them with multiplication. */
+	h = (unsigned long)addr * (unsigned long)0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	for (i = 0; i < cache->size; i++, h++)
+	{
+		struct addr_st const *entry;
+		void const *key;
+
+		entry = &cache->entries[h & (cache->size - 1)];
+		if (!(key = __atomic_load_n(&entry->addr, __ATOMIC_ACQUIRE)))
+			return NULL;
+		else if (key == addr)
+			return __atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE)
+				? entry : NULL;
+	} /* for */
+
+	return NULL;
+} /* find_addr */
+
+/* Replaces $old with a table of twice as many entries if it's still
+ * the current one in $tablep.  Returns the current table or NULL on
+ * failure. */
+static struct addr_cache_st *grow_addr_cache(struct addr_cache_st **tablep,
+	struct addr_cache_st *old)
+{
+	unsigned size;
+	struct addr_cache_st *cache;
+
+	size = old ? 2*old->size : 1024;
+	if (!(cache = calloc(1, sizeof(*cache) + sizeof(*cache->entries)*size)))
+	{
+		LOGIT("calloc(%zu): %m",
+			sizeof(*cache) + sizeof(*cache->entries)*size);
+		return NULL;
+	}
+	cache->size = size;
+	cache->prev = old;
+
+	if (__atomic_compare_exchange_n(tablep, &old, cache, 0,
+			__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+		return cache;
+
+	/* Someone else has grown it already, $old is the current one. */
+	free(cache);
+	return old;
+} /* grow_addr_cache */
+
+/* Adds $addr to the current table of $tablep if there's room.  Returns
+ * whether it did, rather than another thread or nobody. */
+static int cache_addr(struct addr_cache_st **tablep, void const *addr,
+	char const *fname, char const *funame, struct label_st const *label,
+	int verdict)
+{
+	unsigned long h, i;
+	struct addr_cache_st *cache;
+
+	/* Find a table where we can have an entry.  Keep the load factor
+	 * below 1/2 to have short probe sequences. */
+	cache = __atomic_load_n(tablep, __ATOMIC_ACQUIRE);
+	for (;;)
+	{
+		if (cache && __atomic_fetch_add(&cache->used, 1,
+				__ATOMIC_RELAXED) < cache->size / 2)
+			break;
+		if (!(cache = grow_addr_cache(tablep, cache)))
+			return 0;
+	}
+
+	/* Claim an empty slot. */
+	h = (unsigned long)addr * (unsigned long)0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	for (i = 0; i < cache->size; i++, h++)
+	{
+		struct addr_st *entry;
+		void const *key;
+
+		entry = &cache->entries[h & (cache->size - 1)];
+		key = NULL;
+		if (__atomic_compare_exchange_n(&entry->addr, &key, addr, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+		{
+			entry->fname	= fname;
+			entry->funame	= funame;
+			entry->verdict	= verdict;
+			if (label)
+				entry->label = *label;
+			__atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
+			return 1;
+		} else if (key == addr)
+			/* Another thread is adding it right now. */
+			return 0;
+	} /* for */
+
+	return 0;
+} /* cache_addr */
+
+/* Renders the name of the function at $addr as the text trace shows it,
+ * once for all its events.  The label is NULL if there's no memory. */
+static struct label_st mklabel(char const *fname, char const *funame,
+	void const *addr)
+{
+	int len;
+	char *str;
+	char const *colon;
+	struct label_st label;
+
+	/* Print or omit the "<$fname>:" in front of $funame? */
+	if (Log_fname)
+		colon = ":";
+	else
+		fname = colon = "";
+
+	if (funame)
+		len = asprintf(&str, "%s%s%s()", fname, colon, funame);
+	else
+		len = asprintf(&str, "%s%s[%p]", fname, colon, addr);
+
+	if (len < 0)
+	{
+		label.str = NULL;
+		label.len = 0;
+	} else
+	{
+		label.str = str;
+		label.len = len;
+	}
+	return label;
+} /* mklabel */
+
+/*
+ * Like addr2name(), but remembers its verdict about $addr in the address
+ * cache of $config, so subsequent calls of the same function don't need
+ * to go through the registry, symbol lookup and the $TRACY_* filters again.
+ * $fnamep is not optional, but $labelp is: it's only made for the text
+ * trace.
+ */
+static int resolve(struct config_st *config, char const **fnamep,
+	char const **funamep, struct label_st *labelp, void const *addr)
+{
+	int verdict;
+	struct label_st label;
+	struct addr_st const *entry;
+	struct addr_cache_st const *cache, *current;
+
+	current = __atomic_load_n(&config->addr_cache, __ATOMIC_ACQUIRE);
+	for (cache = current; cache; cache = cache->prev)
+		if ((entry = find_addr(cache, addr)) != NULL)
+		{
+			/* Move it to the $current table if it's not there. */
+			if (cache != current)
+				cache_addr(&config->addr_cache, addr,
+					entry->fname, entry->funame,
+					&entry->label, entry->verdict);
+			*fnamep  = entry->fname;
+			*funamep = entry->funame;
+			if (labelp)
+				*labelp = entry->label;
+			return entry->verdict;
+		}
+
+	/* Miss, do it the hard way. */
+	*funamep = NULL;
+	verdict = addr2name(fnamep, funamep, addr, 1);
+	if (verdict >= 0 && Mode == MODE_TRACE && !Async && !Shm)
+		label = mklabel(*fnamep, verdict > 0 ? *funamep : NULL, addr);
+	else
+		label.str = NULL, label.len = 0;
+	if (!cache_addr(&config->addr_cache, addr, *fnamep, *funamep, &label,
+		verdict) && label.str)
+	{	/* Nothing would free it.  If another thread has cached
+		 * $addr already, take its label. */
+		free((char *)label.str);
+		label.str = NULL, label.len = 0;
+		if ((cache = __atomic_load_n(&config->addr_cache,
+				__ATOMIC_ACQUIRE)) != NULL
+			&& (entry = find_addr(cache, addr)) != NULL)
+			label = entry->label;
+	}
+	if (labelp)
+		*labelp = label;
+
+	/* The readers of $Shm need the names of the functions. */
+	if (Shm && verdict > 0)
+		print_meta("%p = %s:%s()", addr, *fnamep, *funamep);
+	else if (Shm && verdict == 0)
+		print_meta("%p = %s:[%p]", addr, *fnamep, addr);
+
+	return verdict;
+} /* resolve */
+
+/* Adds $addr to $Backlog unless it's already there. */
+static void remember_addr(void const *addr)
+{
+	struct addr_cache_st const *current;
+
+	current = __atomic_load_n(&Backlog, __ATOMIC_ACQUIRE);
+	if (!current || !find_addr(current, addr))
+		/* If it's in an older table collect_backlog()
+		 * will take care of the duplicate. */
+		cache_addr(&Backlog, addr, NULL, NULL, NULL, 0);
+} /* remember_addr */
+
+/* Returns the unique addresses in $Backlog in a malloc()ed array
+ * and their number in $np. */
+static void const **collect_backlog(unsigned *np)
+{
+	unsigned i, n, size;
+	void const **addrs;
+	struct addr_cache_st const *current, *cache, *newer;
+
+	/* There can't be more than this many. */
+	current = __atomic_load_n(&Backlog, __ATOMIC_ACQUIRE);
+	for (size = 0, cache = current; cache; cache = cache->prev)
+		size += cache->size / 2;
+
+	*np = 0;
+	if (!size)
+		return NULL;
+	if (!(addrs = malloc(sizeof(*addrs) * size)))
+	{
+		LOGIT("malloc(%zu): %m", sizeof(*addrs) * size);
+		return NULL;
+	}
+
+	/* Take the entries of each table unless they have been moved
+	 * to a newer one. */
+	for (n = 0, cache = current; cache; cache = cache->prev)
+		for (i = 0; i < cache->size; i++)
+		{
+			void const *addr;
+
+			if (!(addr = cache->entries[i].addr))
+				continue;
+			for (newer = current; newer != cache;
+					newer = newer->prev)
+				if (find_addr(newer, addr))
+					break;
+			if (newer == cache)
+				addrs[n++] = addr;
+		}
+
+	*np = n;
+	return addrs;
+} /* collect_backlog */
+/* }}} */
+/* }}} */
+
+/* Clocks {{{ */
+/*
+ * The events are timestamped with the raw value of the clock chosen by
+ * $TRACY_CLOCK, which is only converted to nanoseconds when the events are
+ * formatted.  calibrate_clock() takes a reference point of the clock and
+ * the real time at startup, so all clocks can be converted to real time.
+ * For the TSC it also measures its frequency.
+ */
+/* Returns the current value of $Clock in its own unit. */
+static inline unsigned long long read_clock(void)
+{
+	struct timespec ts;
+
+#ifdef HAVE_TSC
+	if (Clock == CLOCK_TSC)
+		return __builtin_ia32_rdtsc();
+#endif
+
+	clock_gettime(Clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+} /* read_clock */
+
+/* Converts $time, a value read_clock() returned, to nanoseconds
+ * since the Epoch. */
+static unsigned long long clock2ns(unsigned long long time)
+{
+	long double delta;
+
+	if (Clock == CLOCK_REALTIME)
+		return time;
+
+	/* $time may precede $Clock_base. */
+	delta = (long double)time - (long double)Clock_base;
+	return Clock_base_ns + (long long)(delta * Clock_ns_per_tick);
+} /* clock2ns */
+
+/* Converts a difference of read_clock() values to nanoseconds. */
+static unsigned long long ticks2ns(unsigned long long ticks)
+{
+	return ticks * Clock_ns_per_tick;
+} /* ticks2ns */
+
+/* Establishes the relation between $Clock and the real time. */
+static void calibrate_clock(void)
+{
+	struct timespec ts;
+
+	Clock_ns_per_tick = 1;
+	if (Clock == CLOCK_REALTIME)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	Clock_base = read_clock();
+	Clock_base_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+#ifdef HAVE_TSC
+	if (Clock == CLOCK_TSC)
+	{	/* Count the ticks during a short nap. */
+		struct timespec nap;
+		unsigned long long ns, ticks;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+		ticks = read_clock();
+
+		nap.tv_sec = 0;
+		nap.tv_nsec = 20000000;
+		nanosleep(&nap, NULL);
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec - ns;
+		ticks = read_clock() - ticks;
+		Clock_ns_per_tick = (long double)ns / ticks;
+	}
+#endif
+} /* calibrate_clock */
+/* }}} */
+
+/* Limiting the trace {{{ */
+/*
+ * $TRACY_SAMPLE, $TRACY_FUN_RATE and $TRACY_BUDGET bound the volume of
+ * the trace.  Rather than dropping events here and there, which would
+ * leave the ENTER:s and LEAVE:s unpaired, they decide about whole calls:
+ * if one is refused, neither it nor anything it calls is traced, which
+ * is followed by $Nesting and $My_skip.
+ */
+/* Returns whether to trace the subtree of the call entered
+ * at $Nesting according to the $TRACY_SAMPLE of $config. */
+static int sample_tree(struct config_st const *config)
+{
+	unsigned long long x;
+
+	if (Nesting != config->sample_depth)
+		return 1;
+
+	/* xorshift64*, seeded differently in each thread */
+	if (!(x = My_seed))
+		x = (unsigned long long)gettid() * 0x9E3779B97F4A7C15ULL
+			^ read_clock() ^ 1;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	My_seed = x;
+	return (x * 0x2545F4914F6CDD1DULL >> 32) % config->sample_rate == 0;
+} /* sample_tree */
+
+/* Returns whether $addr has been traced less than $Fun_rate times by
+ * this thread in the last second, and counts this one if so.  The table
+ * is direct-mapped, so functions sharing a slot may go over the rate. */
+static int check_fun_rate(void const *addr, unsigned long long now)
+{
+	unsigned long h;
+	struct rate_st *rate;
+
+	if (!My_rates)
+	{	/* Freed when the thread exits. */
+		if (!(My_rates = calloc(RATE_SLOTS, sizeof(*My_rates))))
+			return 1;
+		pthread_setspecific(Rate_key, My_rates);
+	}
+
+	h = (unsigned long)addr * (unsigned long)0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	rate = &My_rates[h & (RATE_SLOTS - 1)];
+	if (rate->addr != addr || now - rate->window >= Second_ticks)
+	{
+		rate->addr = addr;
+		rate->window = now;
+		rate->count = 0;
+	}
+
+	if (rate->count >= Fun_rate)
+		return 0;
+	rate->count++;
+	return 1;
+} /* check_fun_rate */
+
+/* Takes $n events out of the $Budget of the current second.  Threads
+ * take it from $Budget_used in batches, so they rarely need to touch
+ * the same cache line. */
+static int take_budget(unsigned n, unsigned long long now)
+{
+	unsigned long long start;
+
+	start = __atomic_load_n(&Budget_start, __ATOMIC_ACQUIRE);
+	if ((long long)(now - start) >= (long long)Second_ticks)
+	{	/* Start a new window unless another thread just did. */
+		if (__atomic_compare_exchange_n(&Budget_start, &start, now,
+				0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			__atomic_store_n(&Budget_used, 0, __ATOMIC_RELAXED);
+			start = now;
+		}
+	}
+
+	if (My_budget_start != start)
+	{	/* What's left from the previous window is void. */
+		My_budget_start = start;
+		My_tokens = 0;
+	}
+
+	while (My_tokens < n)
+	{
+		if (__atomic_fetch_add(&Budget_used, Budget_batch,
+				__ATOMIC_RELAXED) >= Budget)
+			return 0;
+		My_tokens += Budget_batch;
+	}
+
+	My_tokens -= n;
+	return 1;
+} /* take_budget */
+
+/* Returns whether to trace the call of $addr, which hasn't been omitted
+ * otherwise, and its subtree according to $TRACY_FUN_RATE and
+ * $TRACY_BUDGET. */
+static int admit_call(void const *addr)
+{
+	unsigned long long now;
+
+	if (!Fun_rate && !Budget)
+		return 1;
+
+	now = read_clock();
+	if (Fun_rate && !check_fun_rate(addr, now))
+		return 0;
+
+	/* Reserve for the LEAVE as well. */
+	if (Budget && !take_budget(Entries_only ? 1 : 2, now))
+		return 0;
+
+	return 1;
+} /* admit_call */
+/* }}} */
+
+/* Printing the trace {{{ */
+/*
+ * The text trace is formatted by hand rather than with printf(), which
+ * would parse the format and take the locale into account for each event,
+ * and fprintf(stderr) would lock the stream as well.  The function names
+ * are rendered by mklabel() once, and the lines are written to stderr
+ * with a single write() each.  The put_*() functions append to a buffer
+ * ending at $end, and truncate what doesn't fit.
+ */
+/* What the indentation is copied from. */
+static char const Spaces[] =
+	"                                                                ";
+
+static char *put_str(char *p, char const *end, char const *str, size_t len)
+{
+	if (len > (size_t)(end - p))
+		len = end - p;
+	memcpy(p, str, len);
+	return p + len;
+} /* put_str */
+
+static char *put_spaces(char *p, char const *end, unsigned n)
+{
+	for (; n > sizeof(Spaces) - 1; n -= sizeof(Spaces) - 1)
+		p = put_str(p, end, Spaces, sizeof(Spaces) - 1);
+	return put_str(p, end, Spaces, n);
+} /* put_spaces */
+
+/* Appends $n in decimal, padded with zeroes to $width digits. */
+static char *put_dec(char *p, char const *end, unsigned long long n,
+	unsigned width)
+{
+	char digits[20], *d;
+
+	d = &digits[sizeof(digits)];
+	do
+		*--d = '0' + n % 10;
+	while ((n /= 10) != 0);
+	while (d > digits && (unsigned)(&digits[sizeof(digits)] - d) < width)
+		*--d = '0';
+	return put_str(p, end, d, &digits[sizeof(digits)] - d);
+} /* put_dec */
+
+/* Appends $addr like "%p". */
+static char *put_addr(char *p, char const *end, void const *addr)
+{
+	char digits[2 + 2*sizeof(addr)], *d;
+	unsigned long n;
+
+	n = (unsigned long)addr;
+	d = &digits[sizeof(digits)];
+	do
+		*--d = "0123456789abcdef"[n & 0xf];
+	while ((n >>= 4) != 0);
+	*--d = 'x';
+	*--d = '0';
+	return put_str(p, end, d, &digits[sizeof(digits)] - d);
+} /* put_addr */
+
+/* Formats the time and/or TID prefix of a trace message into $p. */
+static char *procinfo(char *p, char const *end, unsigned long long time,
+	pid_t tid)
+{
+	unsigned long long ns;
+
+	if (Log_time)
+	{
+		ns = clock2ns(time);
+		p = put_dec(p, end, ns / 1000000000, 1);
+		p = put_str(p, end, ".", 1);
+		p = put_dec(p, end, ns % 1000000000, 9);
+	}
+
+	if (Log_time && Log_tid)
+	{
+		p = put_str(p, end, "[", 1);
+		p = put_dec(p, end, tid, 1);
+		p = put_str(p, end, "] ", 2);
+	} else if (Log_tid)
+	{
+		p = put_dec(p, end, tid, 1);
+		p = put_str(p, end, " ", 1);
+	} else if (Log_time)
+		p = put_str(p, end, " ", 1);
+
+	return p;
+} /* procinfo */
+
+/* Formats $ev, a call or return of thread $tid, into $buf of $size like
+ * "[<time>][<tid>] ENTER[<depth>] <fname>:<funame>()".  Returns the length
+ * of the message, which is truncated if it doesn't fit. */
+static size_t format_event(char *buf, size_t size,
+	struct event_st const *ev, pid_t tid)
+{
+	char *p, *end;
+
+	p = buf;
+	end = &buf[size];
+	p = procinfo(p, end, ev->time, tid);
+	if (Entries_only)
+		/* No direction. */;
+	else if (ev->is_entry == EVENT_CALL)
+		p = put_str(p, end, "CALL", 4);
+	else if (ev->is_entry)
+		p = put_str(p, end, "ENTER", 5);
+	else
+		p = put_str(p, end, "LEAVE", 5);
+
+	p = put_str(p, end, "[", 1);
+	p = put_dec(p, end, ev->depth, 1);
+	p = put_str(p, end, "]", 1);
+	p = put_spaces(p, end, 1 + Indent*ev->depth);
+
+	/* resolve_backlog() will resolve .addr when we exit. */
+	if (ev->label.str)
+		p = put_str(p, end, ev->label.str, ev->label.len);
+	else
+	{
+		p = put_str(p, end, "[", 1);
+		p = put_addr(p, end, ev->addr);
+		p = put_str(p, end, "]", 1);
+	}
+
+	return p - buf;
+} /* format_event */
+
+/* Binary format {{{ */
+/*
+ * With $TRACY_ASYNC=binary the trace is written to $Output_fd in the compact
+ * format described in tracy.h.
+ */
+/* Stores $n in $p as a varint and returns the next byte position. */
+static char *put_varint(char *p, unsigned long long n)
+{
+	for (; n >= 0x80; n >>= 7)
+		*p++ = (n & 0x7f) | 0x80;
+	*p++ = n;
+	return p;
+}
+
+/* Maps signed numbers to unsigned ones such that small absolute values
+ * remain small. */
+static unsigned long long zigzag(long long n)
+{
+	return ((unsigned long long)n << 1) ^ (n >> 63);
+}
+
+/* Stores a $length-prefixed $str in $p. */
+static char *put_string(char *p, char const *str)
+{
+	size_t len;
+
+	len = strlen(str);
+	p = put_varint(p, len);
+	memcpy(p, str, len);
+	return p + len;
+}
+
+/* Writes all of $buf to $fd.  The writes of different threads
+ * are serialized, so the sections they write don't mix. */
+static void write_all(int fd, void const *buf, size_t len)
+{
+	ssize_t n;
+
+	pthread_mutex_lock(&Output_lock);
+	for (; len > 0; buf += n, len -= n)
+		if ((n = write(fd, buf, len)) < 0)
+		{
+			if (errno != EINTR)
+				break;
+			n = 0;
+		}
+	pthread_mutex_unlock(&Output_lock);
+} /* write_all */
+
+/*
+ * Returns $template with %p replaced by our PID, %t by $Start_time and %%
+ * by '%' in $buf, which is PATH_MAX long.  If we're a $Descendant and
+ * there's no %p in $template, ".<PID>" is appended, so that we don't
+ * overwrite the file of the parent.
+ */
+static char const *output_fname(char *buf, char const *template)
+{
+	char *p;
+	int has_pid;
+
+	/* Leave room for the longest expansion and the suffix. */
+	has_pid = 0;
+	for (p = buf; *template && p < &buf[PATH_MAX - 48]; template++)
+		if (template[0] != '%')
+			*p++ = template[0];
+		else if (template[1] == 'p')
+		{
+			p += sprintf(p, "%d", getpid());
+			has_pid = 1;
+			template++;
+		} else if (template[1] == 't')
+		{
+			p += sprintf(p, "%lld", (long long)Start_time);
+			template++;
+		} else if (template[1] == '%')
+		{
+			*p++ = '%';
+			template++;
+		} else
+			*p++ = '%';
+
+	if (Descendant && !has_pid)
+		p += sprintf(p, ".%d", getpid());
+	*p = '\0';
+	return buf;
+} /* output_fname */
+
+/* Stores the file header and the BIN_PROCESS section in $p, which has
+ * room for BIN_HEADER_SIZE bytes. */
+static char *put_header(char *p)
+{
+	memcpy(p, TRACY_MAGIC, 6);
+	p[6] = TRACY_VERSION;
+	p[7] = Log_time ? BIN_HAS_TIME : 0;
+	p += 8;
+	*p++ = BIN_PROCESS;
+	return put_varint(p, getpid());
+} /* put_header */
+
+static void write_header(void)
+{
+	char hdr[BIN_HEADER_SIZE];
+
+	write_all(Output_fd, hdr, put_header(hdr) - hdr);
+} /* write_header */
+
+/* Creates the output file named after $template and returns its descriptor
+ * or -1, and its name in $fname, which is PATH_MAX long.  A $Descendant
+ * doesn't overwrite existing files, because they may be of the same process
+ * before it executed us (which has the same PID), but adds a number to the
+ * name. */
+static int create_output(char *fname, char const *template)
+{
+	unsigned i, len;
+	int fd, flags;
+
+	output_fname(fname, template);
+	len = strlen(fname);
+	flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+	flags |= Descendant ? O_EXCL : O_TRUNC;
+	for (i = 1; (fd = open(fname, flags, 0666)) < 0; i++)
+		if (errno != EEXIST || i > 1000)
+		{
+			LOGIT("%s: %m", fname);
+			return -1;
+		} else
+			sprintf(&fname[len], ".%u", i);
+
+	return fd;
+} /* create_output */
+
+/* Opens the output file named after $template for writing.  The first time
+ * it's created like by create_output() and its name is stored in $*fnamep,
+ * then the same file is overwritten. */
+static FILE *fopen_output(char const *template, char **fnamep)
+{
+	char fname[PATH_MAX];
+	FILE *st;
+	int fd;
+
+	if (*fnamep)
+	{
+		if (!(st = fopen(*fnamep, "w")))
+			LOGIT("%s: %m", *fnamep);
+		return st;
+	}
+
+	if ((fd = create_output(fname, template)) < 0)
+		return NULL;
+	if (!(st = fdopen(fd, "w")))
+	{
+		LOGIT("fdopen(%s): %m", fname);
+		close(fd);
+		return NULL;
+	}
+
+	*fnamep = strdup(fname);
+	return st;
+} /* fopen_output */
+
+/* Creates the file of the binary trace named after $Output_fname and
+ * writes the header.  Returns whether it could. */
+static int open_output(void)
+{
+	char fname[PATH_MAX];
+
+	if ((Output_fd = create_output(fname, Output_fname)) < 0)
+		return 0;
+
+	write_header();
+	return 1;
+} /* open_output */
+
+/* Makes a BIN_EVENTS section in $buf of $size of as many events of $ring
+ * from $*tailp up to $head as fit, and advances $*tailp past them.
+ * Returns where the section starts in $buf and its length in $*lenp. */
+static char *put_events(char *buf, size_t size, struct ring_st const *ring,
+	unsigned long *tailp, unsigned long head, size_t *lenp)
+{
+	char hdr[32], *p, *payload;
+	unsigned long tail, nevents;
+	unsigned long long prev_time;
+	long long prev_addr;
+	size_t hlen;
+
+	/* The section header has to precede the records, and the header
+	 * needs to know their length, so we leave room for it at the
+	 * beginning. */
+	payload = p = &buf[sizeof(hdr)];
+	prev_time = prev_addr = 0;
+	for (tail = *tailp, nevents = 0; tail != head
+		&& p < &buf[size] - 32; tail++, nevents++)
+	{
+		struct event_st const *ev;
+		unsigned long long time;
+
+		ev = &ring->events[tail & (Ring_size - 1)];
+		time = Log_time ? clock2ns(ev->time) : 0;
+
+		*p++ = ev->is_entry ? BIN_ENTER : BIN_LEAVE;
+		p = put_varint(p, ev->depth);
+		p = put_varint(p, zigzag(time - prev_time));
+		p = put_varint(p, zigzag((long)ev->addr - prev_addr));
+		prev_time = time;
+		prev_addr = (long)ev->addr;
+	} /* for */
+	*tailp = tail;
+
+	hdr[0] = BIN_EVENTS;
+	hlen = put_varint(put_varint(put_varint(&hdr[1], ring->tid),
+		nevents), p - payload) - hdr;
+	memcpy(payload - hlen, hdr, hlen);
+	*lenp = hlen + (p - payload);
+	return payload - hlen;
+} /* put_events */
+
+/* Writes the events of $ring from its tail up to $head
+ * in as many BIN_EVENTS sections as necessary. */
+static void drain_binary(struct ring_st *ring, unsigned long head)
+{
+	static char buf[64 * 1024];
+	unsigned long tail;
+	char const *section;
+	size_t len;
+
+	tail = ring->tail;
+	while (tail != head)
+	{
+		section = put_events(buf, sizeof(buf), ring, &tail, head,
+			&len);
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		write_all(Output_fd, section, len);
+	}
+} /* drain_binary */
+
+/* Reports that $count events have been lost from $ring. */
+static void write_dropped(struct ring_st const *ring, unsigned long count)
+{
+	char buf[32], *p;
+
+	p = buf;
+	*p++ = BIN_DROPPED;
+	p = put_varint(put_varint(p, ring->tid), count);
+	write_all(Output_fd, buf, p - buf);
+} /* write_dropped */
+
+/* Writes the BIN_SYMTAB sections of the $n $addrs and the BIN_END.
+ * Called by resolve_backlog(). */
+static void write_symtab(void const **addrs, unsigned n)
+{
+	static char buf[64 * 1024];
+	unsigned char end[9];
+	void const *addr;
+	off_t symtab;
+	size_t len;
+	unsigned i;
+
+	/* Reserve room at the beginning of $buf for the section header. */
+	symtab = lseek(Output_fd, 0, SEEK_CUR);
+	len = 16;
+	for (;;)
+	{
+		char const *fname, *funame;
+		char hdr[16];
+		size_t hlen;
+		int eof, success;
+
+		/* Flush $buf if the next entry might not fit, or we're done. */
+		eof = !n--;
+		if (!eof)
+		{
+			addr = *addrs++;
+			success = resolve(get_config(), &fname, &funame,
+				NULL, addr);
+			if (success < 0)
+				continue;
+		}
+
+		if (eof || len + 32 + strlen(fname)
+			+ (success ? strlen(funame) : 0) > sizeof(buf))
+		{
+			if (len > 16)
+			{
+				hdr[0] = BIN_SYMTAB;
+				hlen = put_varint(&hdr[1], len - 16) - hdr;
+				memcpy(&buf[16 - hlen], hdr, hlen);
+				write_all(Output_fd, &buf[16 - hlen],
+					hlen + len - 16);
+			}
+			len = 16;
+			if (eof)
+				break;
+		}
+
+		/* Skip the entries which don't fit at all. */
+		if (len + 32 + strlen(fname)
+				+ (success ? strlen(funame) : 0) > sizeof(buf))
+			continue;
+		len = put_varint(&buf[len], (unsigned long)addr) - buf;
+		buf[len++] = success;
+		len = put_string(&buf[len], fname) - buf;
+		len = put_string(&buf[len], success ? funame : "") - buf;
+	} /* for */
+
+	end[0] = BIN_END;
+	for (i = 0; i < 8; i++)
+		end[1 + i] = (unsigned long long)symtab >> (8 * i);
+	write_all(Output_fd, end, sizeof(end));
+} /* write_symtab */
+/* }}} */
+
+/* Shared memory output {{{ */
+/*
+ * With $TRACY_SHM the events are not formatted, but stored in the rings
+ * of a shared memory region laid out as described in tracy.h, and the names
+ * of the functions and the load map are written to its symbol log, so that
+ * other processes can follow the trace while the program is running, without
+ * a system call per event.  Like in buffered mode each thread has its own
+ * ring and the rings of exited threads are reused, but we don't wait for
+ * the readers: if they don't keep up the old events are overwritten.
+ */
+/* Returns the $i:th ring of $Shm. */
+static struct tracy_shm_ring_st *shm_ring(unsigned i)
+{
+	return (struct tracy_shm_ring_st *)((char *)Shm + Shm->rings_offset
+		+ i * Shm->ring_stride);
+} /* shm_ring */
+
+/* Creates the shared memory object or file $name with $nrings rings
+ * of $Ring_size events and sets up $Shm in it.  $name is a POSIX shared
+ * memory object if it's like "/tracy" (a single slash in front).
+ * Returns whether it succeeded. */
+static int open_shm(char const *name, unsigned nrings)
+{
+	int fd;
+	void *region;
+	size_t size, header, stride;
+
+	header = (sizeof(*Shm) + 63) & ~63;
+	stride = sizeof(struct tracy_shm_ring_st)
+		+ sizeof(struct tracy_shm_event_st) * Ring_size;
+	size = header + nrings * stride + SHM_SYMLOG_SIZE;
+
+	if (name[0] == '/' && !strchr(&name[1], '/'))
+		fd = shm_open(name, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	else
+		fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (fd < 0)
+	{
+		LOGIT("%s: %m", name);
+		return 0;
+	}
+
+	/* The region is sparse, only what's used takes up memory. */
+	region = MAP_FAILED;
+	if (ftruncate(fd, size) < 0)
+		LOGIT("%s: ftruncate: %m", name);
+	else if ((region = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+			fd, 0)) == MAP_FAILED)
+		LOGIT("%s: mmap: %m", name);
+	close(fd);
+	if (region == MAP_FAILED)
+		return 0;
+
+	Shm = region;
+	Shm->version = TRACY_SHM_VERSION;
+	Shm->flags = Log_time ? SHM_HAS_TIME : 0;
+	Shm->pid = getpid();
+	Shm->nrings = nrings;
+	Shm->ring_size = Ring_size;
+	Shm->ring_stride = stride;
+	Shm->rings_offset = header;
+	Shm->symlog_offset = header + nrings * stride;
+	Shm->symlog_size = SHM_SYMLOG_SIZE;
+	Shm->clock_base = Clock_base;
+	Shm->clock_base_ns = Clock_base_ns;
+	Shm->ns_per_tick = Clock_ns_per_tick;
+
+	/* Readers may be waiting for the magic to appear. */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(Shm->magic, TRACY_SHM_MAGIC, sizeof(Shm->magic));
+	return 1;
+} /* open_shm */
+
+static void put_shm_event(struct tracy_shm_ring_st *ring,
+	uint64_t time, uint64_t addr, uint32_t depth, uint32_t type);
+
+/* Returns the calling thread's ring in $Shm or NULL if all of them
+ * are taken. */
+static struct tracy_shm_ring_st *get_shm_ring(void)
+{
+	unsigned i;
+	struct tracy_shm_ring_st *ring;
+
+	if (My_shm_ring)
+		return My_shm_ring;
+
+	for (i = 0; i < Shm->nrings; i++)
+	{
+		uint32_t free;
+
+		ring = shm_ring(i);
+		free = 0;
+		if (!__atomic_load_n(&ring->owned, __ATOMIC_RELAXED)
+			&& __atomic_compare_exchange_n(&ring->owned, &free, 1,
+				0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	if (i >= Shm->nrings)
+		return NULL;
+
+	/* The readers attribute the events to the new .tid from now on.
+	 * Those who are behind learn it from the SHM_OWNER event. */
+	__atomic_store_n(&ring->tid, gettid(), __ATOMIC_RELEASE);
+	put_shm_event(ring, 0, ring->tid, 0, SHM_OWNER);
+	pthread_setspecific(Shm_key, ring);
+	return My_shm_ring = ring;
+} /* get_shm_ring */
+
+/* Called when a thread having a ring in $Shm exits. */
+static void release_shm_ring(void *ring)
+{
+	__atomic_store_n(&((struct tracy_shm_ring_st *)ring)->owned, 0,
+		__ATOMIC_RELEASE);
+}
+
+/* Appends $ev to the calling thread's ring in $Shm. */
+static void shm_event(struct event_st const *ev)
+{
+	struct tracy_shm_ring_st *ring;
+
+	if (!(ring = get_shm_ring()))
+	{
+		__atomic_fetch_add(&Shm->lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	put_shm_event(ring, ev->time, (uintptr_t)ev->addr, ev->depth,
+		ev->is_entry ? BIN_ENTER : BIN_LEAVE);
+} /* shm_event */
+
+/* Appends an event to $ring, which is the calling thread's. */
+static void put_shm_event(struct tracy_shm_ring_st *ring,
+	uint64_t time, uint64_t addr, uint32_t depth, uint32_t type)
+{
+	uint64_t head;
+	struct tracy_shm_event_st *slot;
+
+	/* Make sure the readers see the new .head before they could see
+	 * the slot of an old event overwritten. */
+	head = ring->head;
+	slot = &ring->events[head & (Shm->ring_size - 1)];
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->time  = time;
+	slot->addr  = addr;
+	slot->depth = depth;
+	slot->type  = type;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+} /* put_shm_event */
+
+/* Prints a line of the symbol table or the load map with LOGIT(),
+ * or appends it to the symbol log of $Shm.  Lines which don't fit
+ * in the log are lost. */
+static void print_meta(char const *fmt, ...)
+{
+	char line[PATH_MAX + 256], *log;
+	uint64_t offset;
+	va_list args;
+	int len;
+
+	va_start(args, fmt);
+	len = vsnprintf(line, sizeof(line) - 1, fmt, args);
+	va_end(args);
+	if (len < 0)
+		return;
+	if (len > (int)sizeof(line) - 2)
+		len = sizeof(line) - 2;
+
+	if (!Shm)
+	{
+		LOGIT("%s", line);
+		return;
+	}
+
+	/* Reserve room for the line and write it, its first byte last,
+	 * which tells the readers it's complete. */
+	line[len++] = '\n';
+	offset = __atomic_fetch_add(&Shm->symlog_used, len, __ATOMIC_RELAXED);
+	if (offset + len > Shm->symlog_size)
+		return;
+	log = (char *)Shm + Shm->symlog_offset + offset;
+	memcpy(&log[1], &line[1], len - 1);
+	__atomic_store_n(&log[0], line[0], __ATOMIC_RELEASE);
+} /* print_meta */
+
+/* Tells the readers that no more events will come. */
+static void finish_shm(void)
+{
+	/* The children of fork() share the region of their parent. */
+	if (Shm->pid == (uint32_t)getpid())
+		__atomic_store_n(&Shm->finished, 1, __ATOMIC_RELEASE);
+	else if (My_shm_ring)
+		release_shm_ring(My_shm_ring);
+}
+/* }}} */
+
+/* Load map {{{ */
+/*
+ * With $TRACY_OFFLINE nothing is resolved by the traced program, not even
+ * at exit.  Instead we record where each DSO is loaded, and ares finds the
+ * function names in the ELF files after the run.  The load map is written
+ * when tracing starts and whenever dlopen() brings in new DSOs, as "MAP:"
+ * lines in text mode and BIN_MAP sections in binary mode.
+ */
+/* Returns the build ID of the DSO described by $info in $idp and its
+ * length, or 0 if it doesn't have one. */
+static unsigned get_buildid(struct dl_phdr_info const *info,
+	unsigned char const **idp)
+{
+	unsigned i;
+
+	for (i = 0; i < info->dlpi_phnum; i++)
+	{
+		Elf_Phdr const *phdr;
+		char const *p, *end;
+		unsigned align;
+
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type != PT_NOTE)
+			continue;
+
+		/* Notes are padded to 4 bytes, except in 8-aligned
+		 * segments. */
+		align = phdr->p_align == 8 ? 8 : 4;
+		p = (char const *)info->dlpi_addr + phdr->p_vaddr;
+		end = p + phdr->p_memsz;
+		while (p + sizeof(Elf_Nhdr) <= end)
+		{
+			Elf_Nhdr const *note;
+			char const *name, *desc;
+
+			note = (Elf_Nhdr const *)p;
+			name = p + sizeof(*note);
+			desc = name + ((note->n_namesz + align-1) & ~(align-1));
+			if (note->n_type == NT_GNU_BUILD_ID
+				&& note->n_namesz == 4
+				&& !memcmp(name, "GNU", 4))
+			{
+				*idp = (unsigned char const *)desc;
+				return note->n_descsz;
+			}
+			p = desc + ((note->n_descsz + align-1) & ~(align-1));
+		}
+	} /* for */
+
+	return 0;
+} /* get_buildid */
+
+/* Writes the map of $info if write_maps() hasn't done it before.
+ * Called through dl_iterate_phdr(). */
+static int write_map(struct dl_phdr_info *info, size_t size, void *unused)
+{
+	char exe[PATH_MAX], buf[PATH_MAX + 256], *p;
+	unsigned char const *id;
+	Elf_Addr start, end;
+	unsigned i, idlen;
+	char const *path;
+	struct addr_cache_st const *cache;
+
+	/* Where is it loaded? */
+	start = ~(Elf_Addr)0;
+	end = 0;
+	for (i = 0; i < info->dlpi_phnum; i++)
+	{
+		Elf_Phdr const *phdr;
+
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type != PT_LOAD)
+			continue;
+		if (start > phdr->p_vaddr)
+			start = phdr->p_vaddr;
+		if (end < phdr->p_vaddr + phdr->p_memsz)
+			end = phdr->p_vaddr + phdr->p_memsz;
+	}
+	if (start >= end)
+		return 0;
+	start += info->dlpi_addr;
+	end += info->dlpi_addr;
+
+	/* Have we written it already?  DSOs are identified by their
+	 * first address. */
+	for (cache = Mapped; cache; cache = cache->prev)
+		if (find_addr(cache, (void const *)start))
+			return 0;
+	cache_addr(&Mapped, (void const *)start, NULL, NULL, NULL, 0);
+
+	/* ares needs to find the file. */
+	if (!(path = dso_path(info->dlpi_name, exe)))
+		return 0;
+	if (strlen(path) >= PATH_MAX)
+		return 0;
+	id = NULL;
+	if ((idlen = get_buildid(info, &id)) > 64)
+		idlen = 0;
+
+	if (Binary || Flight)
+	{
+		p = buf;
+		*p++ = BIN_MAP;
+		p = put_varint(p, info->dlpi_addr);
+		p = put_varint(p, start);
+		p = put_varint(p, end);
+		p = put_string(p, path);
+		p = put_varint(p, idlen);
+		if (idlen)
+			memcpy(p, id, idlen);
+		p += idlen;
+		if (Flight)
+			add_flight_map(buf, p - buf);
+		else
+			write_all(Output_fd, buf, p - buf);
+	} else
+	{
+		for (p = buf, i = 0; i < idlen; i++)
+			p += sprintf(p, "%.2x", id[i]);
+		if (!idlen)
+			strcpy(buf, "-");
+		print_meta("MAP: 0x%lx-0x%lx 0x%lx %s %s",
+			(unsigned long)start, (unsigned long)end,
+			(unsigned long)info->dlpi_addr, buf, path);
+	}
+
+	return 0;
+} /* write_map */
+
+/* Writes the maps of the DSOs loaded since the last time. */
+static void write_maps(void)
+{
+	pthread_mutex_lock(&Mapped_lock);
+	dl_iterate_phdr(write_map, NULL);
+	pthread_mutex_unlock(&Mapped_lock);
+} /* write_maps */
+
+/* Tries to open $fname in the directories of $paths separated by ':',
+ * in which "$ORIGIN" is the directory $origin of $olen bytes.  Returns
+ * the handle or NULL. */
+static void *dlopen_in(void *(*real_dlopen)(char const *, int),
+	char const *paths, char const *origin, size_t olen,
+	char const *fname, int flags)
+{
+	char path[PATH_MAX], *p, *end;
+	void *handle;
+
+	for (; paths && *paths; paths += *paths == ':')
+	{
+		p = path;
+		end = &path[PATH_MAX - 1];
+		for (; *paths && *paths != ':'; paths++)
+		{
+			size_t len;
+
+			len = 0;
+			if (!strncmp(paths, "$ORIGIN", 7))
+				len = 7;
+			else if (!strncmp(paths, "${ORIGIN}", 9))
+				len = 9;
+			if (len && p + olen < end)
+			{
+				memcpy(p, origin, olen);
+				p += olen;
+				paths += len - 1;
+			} else if (p < end)
+				*p++ = *paths;
+		}
+
+		/* An empty directory is the current one. */
+		if (p == path)
+			*p++ = '.';
+		if (p + 1 + strlen(fname) > end)
+			continue;
+		*p++ = '/';
+		strcpy(p, fname);
+		if (!access(path, F_OK)
+				&& (handle = real_dlopen(path, flags)) != NULL)
+			return handle;
+	}
+
+	return NULL;
+} /* dlopen_in */
+
+/*
+ * The dynamic linker searches the DT_RPATH or DT_RUNPATH of the caller of
+ * dlopen() for names without a '/', which would be us when we call the
+ * real one.  So for those we look there ourselves first, in the order the
+ * dynamic linker would: DT_RPATH, or $LD_LIBRARY_PATH then DT_RUNPATH.
+ * What's searched for every caller is left to the real dlopen().
+ */
+static void *dlopen_for(void *(*real_dlopen)(char const *, int),
+	char const *fname, int flags, void const *caller)
+{
+	char exe[PATH_MAX];
+	char const *strtab, *origin, *slash;
+	Elf_Addr bias;
+	Elf_Dyn const *dyn;
+	struct link_map *map;
+	long runpath, rpath;
+	Dl_info info;
+	void *handle;
+
+	if (!fname || strchr(fname, '/')
+			|| !dladdr1(caller, &info, (void **)&map,
+				RTLD_DL_LINKMAP)
+			|| !map || !map->l_ld)
+		return real_dlopen(fname, flags);
+
+	/* It may be loaded already, then it's not looked for. */
+	if ((handle = real_dlopen(fname, flags | RTLD_NOLOAD)) != NULL)
+		return handle;
+
+	bias = map->l_addr;
+	strtab = NULL;
+	runpath = rpath = -1;
+	for (dyn = map->l_ld; dyn->d_tag != DT_NULL; dyn++)
+		if (dyn->d_tag == DT_STRTAB)
+			strtab = (char const *)(dyn->d_un.d_ptr < bias
+				? dyn->d_un.d_ptr + bias : dyn->d_un.d_ptr);
+		else if (dyn->d_tag == DT_RUNPATH)
+			runpath = dyn->d_un.d_val;
+		else if (dyn->d_tag == DT_RPATH)
+			rpath = dyn->d_un.d_val;
+	if (!strtab || (runpath < 0 && rpath < 0)
+			|| !(origin = dso_path(map->l_name, exe))
+			|| !(slash = strrchr(origin, '/')))
+		return real_dlopen(fname, flags);
+
+	if (runpath < 0)
+		handle = dlopen_in(real_dlopen, &strtab[rpath],
+			origin, slash - origin, fname, flags);
+	else if (!(handle = dlopen_in(real_dlopen, getenv("LD_LIBRARY_PATH"),
+			origin, slash - origin, fname, flags)))
+		handle = dlopen_in(real_dlopen, &strtab[runpath],
+			origin, slash - origin, fname, flags);
+	return handle ? handle : real_dlopen(fname, flags);
+} /* dlopen_for */
+
+/* Records the DSOs loaded by dlopen() in the registry and the load map.
+ * This overrides the real dlopen() if we're $LD_PRELOAD:ed, or if we're
+ * $Attached and attach_dso() has made the DSOs call it, so it's an entry
+ * point of the library too.  It looks for $fname like the real one would
+ * for our caller. */
+void *dlopen(char const *fname, int flags)
+{
+	static void *(*real_dlopen)(char const *, int);
+	void *handle;
+
+	if (!real_dlopen)
+		real_dlopen = dlsym(RTLD_NEXT, "dlopen");
+	if ((handle = dlopen_for(real_dlopen, fname, flags,
+			__builtin_return_address(0))) != NULL)
+	{
+		rescan_dsos();
+		if (Offline)
+			write_maps();
+		if (Attached)
+			/* It's bound to the no-op hooks of libc. */
+			attach_dsos();
+	}
+	return handle;
+} /* dlopen */
+
+/* Like dlopen(), but removes the unloaded DSOs from the registry. */
+int dlclose(void *handle)
+{
+	static int (*real_dlclose)(void *);
+	int ret;
+
+	if (!real_dlclose)
+		real_dlclose = dlsym(RTLD_NEXT, "dlclose");
+	if (!(ret = real_dlclose(handle)))
+		rescan_dsos();
+	return ret;
+} /* dlclose */
+/* }}} */
+
+/* Print the symbol address => name resolution table in $TRACY_ASYNC mode.
+ * With $TRACY_OFFLINE the table is empty. */
+static void resolve_backlog(void)
+{
+	unsigned i, n;
+	void const **addrs;
+
+	if (Offline)
+	{
+		addrs = NULL;
+		n = 0;
+	} else
+		addrs = collect_backlog(&n);
+	if (Binary)
+	{
+		write_symtab(addrs, n);
+		close(Output_fd);
+		free(addrs);
+		return;
+	}
+
+	print_meta("SYMTAB:");
+	for (i = 0; i < n; i++)
+	{
+		char const *fname, *funame;
+
+		/* With $Shm resolve() logs the names itself. */
+		switch (resolve(get_config(), &fname, &funame, NULL,
+			addrs[i]))
+		{
+		case 1:
+			if (!Shm)
+				LOGIT("%p = %s:%s()", addrs[i], fname, funame);
+			break;
+		case 0:
+			if (!Shm)
+				LOGIT("%p = %s:[%p]", addrs[i], fname,
+					addrs[i]);
+			break;
+		}
+	}
+	free(addrs);
+}
+
+/* Buffered output {{{ */
+/*
+ * In $TRACY_BUFFERED mode the instrumented threads don't print anything,
+ * just append their event_st:s to their own ring_st, which is like a pipe
+ * with a single reader and a single writer.  The rings are emptied by
+ * the writer thread, which formats the messages and writes them to stderr
+ * in large chunks.  The rings are never freed, but they are reused when
+ * the thread they belonged to has exited.
+ */
+/* Returns the ring of the calling thread or NULL if it can't have one. */
+static struct ring_st *get_ring(void)
+{
+	struct ring_st *ring, *head;
+
+	if (My_ring)
+		return My_ring;
+
+	/* Try to take over the ring of an exited thread.  Its events
+	 * must have been written or dumped, otherwise they'd be reported
+	 * with our TID or lost. */
+	for (ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); ring;
+		ring = ring->next)
+	{
+		int free;
+
+		free = 0;
+		if (!__atomic_compare_exchange_n(&ring->owned, &free, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+		if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+			== ring->head)
+		{	/* A flight recorder only has the events of its
+			 * owner. */
+			if (Flight)
+			{
+				__atomic_store_n(&ring->head, 0,
+					__ATOMIC_RELEASE);
+				__atomic_store_n(&ring->tail, 0,
+					__ATOMIC_RELEASE);
+			}
+			break;
+		}
+		__atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+	}
+
+	if (!ring)
+	{	/* Make a new one. */
+		size_t size;
+
+		size = sizeof(*ring) + sizeof(*ring->events)*Ring_size;
+		if (!(ring = calloc(1, size)))
+		{
+			LOGIT("calloc(%zu): %m", size);
+			return NULL;
+		}
+		ring->owned = 1;
+
+		head = __atomic_load_n(&Rings, __ATOMIC_RELAXED);
+		do
+			ring->next = head;
+		while (!__atomic_compare_exchange_n(&Rings, &head, ring, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	/* Let release_ring() give it up when we exit. */
+	ring->tid = gettid();
+	pthread_setspecific(Ring_key, ring);
+	return My_ring = ring;
+} /* get_ring */
+
+/* Called when a thread having a ring exits.  If it calls instrumented
+ * functions after this, it gets another ring. */
+static void release_ring(void *ring)
+{
+	/* The writer thread can still process what's left in it. */
+	My_ring = NULL;
+	__atomic_store_n(&((struct ring_st *)ring)->owned, 0,
+		__ATOMIC_RELEASE);
+
+	if (My_altstack)
+	{	/* Set up by get_flight_ring(). */
+		stack_t ss;
+
+		memset(&ss, 0, sizeof(ss));
+		ss.ss_flags = SS_DISABLE;
+		sigaltstack(&ss, NULL);
+		free(My_altstack);
+		My_altstack = NULL;
+	}
+}
+
+/* Appends $ev to the calling thread's ring.  If it's full either drops
+ * $ev or waits for the writer thread, according to $Ring_block. */
+static void buffer_event(struct event_st const *ev)
+{
+	unsigned long head;
+	struct ring_st *ring;
+
+	if (!(ring = get_ring()))
+		return;
+
+	head = ring->head;
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+		>= Ring_size)
+	{
+		if (!Ring_block || !Writer_running)
+		{
+			__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		sched_yield();
+	}
+
+	ring->events[head & (Ring_size - 1)] = *ev;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+} /* buffer_event */
+
+/* Writes what's in $buf to $Trace_fd, or logs the messages one by one. */
+static void flush_output(char *buf, size_t *lenp)
+{
+#ifdef CONFIG_GLIB
+	char *line, *nl;
+
+	for (line = buf; line < &buf[*lenp]; line = nl + 1)
+	{
+		nl = memchr(line, '\n', &buf[*lenp] - line);
+		*nl = '\0';
+		LOGIT("%s", line);
+	}
+#else
+	size_t done;
+	ssize_t n;
+	int fd;
+
+	fd = __atomic_load_n(&Trace_fd, __ATOMIC_RELAXED);
+	for (done = 0; done < *lenp; done += n)
+		if ((n = write(fd, &buf[done], *lenp - done)) < 0)
+			break;
+#endif
+	*lenp = 0;
+} /* flush_output */
+
+/* Formats and writes the contents of all rings.  Returns whether any
+ * of them was filling up, in which case we should go on without rest. */
+static int drain_rings(void)
+{
+	static char buf[64 * 1024];
+	unsigned long dropped;
+	struct ring_st *ring;
+	size_t len;
+	int any;
+
+	any = 0;
+	len = 0;
+	for (ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); ring;
+		ring = ring->next)
+	{
+		unsigned long head, tail;
+
+		/* Report the rings that overflowed. */
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported)
+		{
+			if (Binary)
+				write_dropped(ring, dropped - ring->reported);
+			else
+				LOGIT("%u: %lu events dropped", ring->tid,
+					dropped - ring->reported);
+			ring->reported = dropped;
+		}
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->tail == head)
+			continue;
+		if (head - ring->tail >= Ring_size / 2)
+			any = 1;
+
+		if (Binary)
+		{
+			drain_binary(ring, head);
+			continue;
+		}
+
+		for (tail = ring->tail; tail != head; tail++)
+		{
+			/* Leave room for the newline and let long messages
+			 * be truncated. */
+			if (sizeof(buf) - len < 512)
+				flush_output(buf, &len);
+			len += format_event(&buf[len], 511,
+				&ring->events[tail & (Ring_size - 1)],
+				ring->tid);
+			buf[len++] = '\n';
+
+			/* Let the producer go on if it's waiting. */
+			if (!((tail + 1) % 256))
+				__atomic_store_n(&ring->tail, tail + 1,
+					__ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+	} /* for */
+
+	flush_output(buf, &len);
+	return any;
+} /* drain_rings */
+
+/* The writer thread. */
+static void *writer_thread(void *unused)
+{
+	struct timespec nap;
+
+	/* Taking a nap even if there was something to write lets the events
+	 * accumulate, so we can write them in fewer and bigger chunks. */
+	nap.tv_sec  = 0;
+	nap.tv_nsec = 1000000;
+	while (__atomic_load_n(&Writer_running, __ATOMIC_ACQUIRE))
+		if (!drain_rings())
+			nanosleep(&nap, NULL);
+
+	/* Write out what's been left. */
+	drain_rings();
+	return NULL;
+} /* writer_thread */
+
+/* Stops the writer thread on exit(). */
+static void stop_writer(void)
+{
+	/* A child of fork() may have failed to start its own. */
+	if (!Buffered)
+		return;
+
+	__atomic_store_n(&Writer_running, 0, __ATOMIC_RELEASE);
+	pthread_join(Writer, NULL);
+
+	/* Don't buffer the events happening from now on.  The binary trace
+	 * is finished with the symbol table, so stop tracing altogether. */
+	Buffered = 0;
+	if (Binary)
+		Tracing = 0;
+	drain_rings();
+} /* stop_writer */
+/* }}} */
+
+/* Flight recorder {{{ */
+/*
+ * With $TRACY_MODE=flight the events are kept in the rings of the threads
+ * like in buffered mode, but nothing writes them out: the rings just wrap
+ * around, always holding the last $Ring_size events of each thread.  They
+ * are written in the binary format only when dump_flight() is called: on
+ * $TRACY_DUMP_SIGNAL, on a fatal signal and at exit.  Since it may run in
+ * a signal handler, possibly while the program is crashing, it only uses
+ * async-signal-safe functions and what's been prepared beforehand: the
+ * name of the file and the BIN_MAP sections of the load map, which is
+ * recorded like with $TRACY_OFFLINE.  The other threads don't stop during
+ * the dump, so the events they overwrite while it's read are left out.
+ * The rings of the exited threads are only given to new ones after their
+ * events have been dumped.
+ */
+/* The signals after which we may want to see what led to them. */
+static int const Fatal_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+static struct sigaction Fatal_actions[
+	sizeof(Fatal_signals) / sizeof(Fatal_signals[0])];
+
+/* Adds the BIN_MAP section of $len bytes at $map to $Flight_maps.  Called
+ * by write_map() with $Mapped_lock held.  The old buffers are not freed,
+ * because dump_flight() may be reading them. */
+static void add_flight_map(char const *map, size_t len)
+{
+	char *maps;
+	size_t size;
+
+	if (Flight_maps_len + len > Flight_maps_size)
+	{
+		size = Flight_maps_size ? 2 * Flight_maps_size : 4096;
+		while (size < Flight_maps_len + len)
+			size *= 2;
+		if (!(maps = malloc(size)))
+		{
+			LOGIT("malloc(%zu): %m", size);
+			return;
+		}
+		memcpy(maps, Flight_maps, Flight_maps_len);
+		__atomic_store_n(&Flight_maps, maps, __ATOMIC_RELEASE);
+		Flight_maps_size = size;
+	}
+
+	memcpy(&Flight_maps[Flight_maps_len], map, len);
+	__atomic_store_n(&Flight_maps_len, Flight_maps_len + len,
+		__ATOMIC_RELEASE);
+} /* add_flight_map */
+
+/* Returns the ring of the calling thread like get_ring(), and gives the
+ * thread an alternate signal stack, so that dump_flight() can run even
+ * if the stack has overflowed. */
+static struct ring_st *get_flight_ring(void)
+{
+	stack_t ss;
+
+	if (!My_altstack && (My_altstack = malloc(ALTSTACK_SIZE)) != NULL)
+	{	/* Freed by release_ring(). */
+		memset(&ss, 0, sizeof(ss));
+		ss.ss_sp = My_altstack;
+		ss.ss_size = ALTSTACK_SIZE;
+		if (sigaltstack(&ss, NULL) < 0)
+		{
+			free(My_altstack);
+			My_altstack = NULL;
+		}
+	}
+	return get_ring();
+} /* get_flight_ring */
+
+/* Adds $ev to the calling thread's ring, overwriting the oldest event. */
+static void record_event(struct event_st const *ev)
+{
+	unsigned long head;
+	struct ring_st *ring;
+
+	if (!(ring = My_ring) && !(ring = get_flight_ring()))
+		return;
+
+	head = ring->head;
+	ring->events[head & (Ring_size - 1)] = *ev;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+} /* record_event */
+
+/* Writes all of $buf to $fd without the $Output_lock of write_all(),
+ * and adds its length to $*offp. */
+static void write_raw(int fd, void const *buf, size_t len,
+	unsigned long long *offp)
+{
+	ssize_t n;
+
+	*offp += len;
+	for (; len > 0; buf += n, len -= n)
+		if ((n = write(fd, buf, len)) < 0)
+		{
+			if (errno != EINTR)
+				break;
+			n = 0;
+		}
+} /* write_raw */
+
+/* Writes the events of $ring in BIN_EVENTS sections to $fd, using $buf
+ * of $size.  If its owner has exited, lets get_ring() reuse it. */
+static void dump_ring(int fd, struct ring_st *ring,
+	char *buf, size_t size, unsigned long long *offp)
+{
+	unsigned long head, tail, start, now;
+	char const *section;
+	size_t len;
+	int owned;
+
+	/* The owner may be overwriting the oldest event right now,
+	 * unless it has exited. */
+	owned = __atomic_load_n(&ring->owned, __ATOMIC_ACQUIRE);
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = head >= Ring_size ? head - Ring_size + 1 : 0;
+	while (tail != head)
+	{
+		start = tail;
+		section = put_events(buf, size, ring, &tail, head, &len);
+
+		/* Has the owner come around to the events we've read?
+		 * Then skip ahead, with some leeway.  The fence keeps the
+		 * reads of the events before that of $ring->head. */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+		if (now < start)
+			/* Another thread has taken it over. */
+			break;
+		if (now - start >= Ring_size)
+		{
+			tail = now - Ring_size + Ring_size / 8;
+			if ((long)(head - tail) <= 0)
+				break;
+			continue;
+		}
+
+		write_raw(fd, section, len, offp);
+	}
+
+	if (!owned)
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+} /* dump_ring */
+
+/* Writes the rings into the file named by $Flight_fname.  It's async-signal
+ * safe.  If another dump is in progress it doesn't wait for it. */
+static void dump_flight(void)
+{
+	static char buf[64 * 1024];
+	unsigned char end[9];
+	unsigned long long off;
+	struct ring_st *ring;
+	char const *maps;
+	size_t len;
+	int fd, busy, saved_errno;
+	unsigned i;
+
+	busy = 0;
+	if (!__atomic_compare_exchange_n(&Flight_dumping, &busy, 1, 0,
+			__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	saved_errno = errno;
+	if ((fd = open(Flight_fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0666)) < 0)
+		goto out;
+
+	off = 0;
+	write_raw(fd, buf, put_header(buf) - buf, &off);
+	len = __atomic_load_n(&Flight_maps_len, __ATOMIC_ACQUIRE);
+	maps = __atomic_load_n(&Flight_maps, __ATOMIC_ACQUIRE);
+	write_raw(fd, maps, len, &off);
+
+	for (ring = __atomic_load_n(&Rings, __ATOMIC_ACQUIRE); ring;
+		ring = ring->next)
+		dump_ring(fd, ring, buf, sizeof(buf), &off);
+
+	/* There's no symbol table, ares will find the functions
+	 * in the DSOs. */
+	end[0] = BIN_END;
+	for (i = 0; i < 8; i++)
+		end[1 + i] = off >> (8 * i);
+	write_raw(fd, end, sizeof(end), &off);
+	close(fd);
+
+out:	errno = saved_errno;
+	__atomic_store_n(&Flight_dumping, 0, __ATOMIC_RELEASE);
+} /* dump_flight */
+
+/* The handler of $TRACY_DUMP_SIGNAL. */
+static void flight_signal(int signum)
+{
+	dump_flight();
+} /* flight_signal */
+
+/* The handler of the $Fatal_signals: dumps the rings, then lets the signal
+ * do whatever it would have done without us. */
+static void fatal_signal(int signum)
+{
+	unsigned i;
+
+	dump_flight();
+	for (i = 0; i < sizeof(Fatal_signals) / sizeof(Fatal_signals[0]); i++)
+		if (Fatal_signals[i] == signum)
+			sigaction(signum, &Fatal_actions[i], NULL);
+
+	/* The signal is blocked until we return.  If it was a fault, the
+	 * faulting instruction is restarted then anyway. */
+	raise(signum);
+} /* fatal_signal */
+
+/* Prepares the dump and installs the handlers of the $Fatal_signals. */
+static void start_flight(void)
+{
+	unsigned i;
+	struct sigaction sa;
+
+	output_fname(Flight_fname, Output_fname);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = fatal_signal;
+	sa.sa_flags = SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < sizeof(Fatal_signals) / sizeof(Fatal_signals[0]); i++)
+		if (sigaction(Fatal_signals[i], &sa, &Fatal_actions[i]) < 0)
+			LOGIT("sigaction(%d): %m", Fatal_signals[i]);
+
+	atexit(dump_flight);
+} /* start_flight */
+/* }}} */
+
+/* Performance counters {{{ */
+/*
+ * With $TRACY_PMU each thread opens the named counters for itself when
+ * it first enters profile_enter(), and reads them at every call and return
+ * of a function to account their delta to it like the time.  If the kernel
+ * lets us (the hardware counters on x86 usually), they're read with rdpmc
+ * from the page the kernel maps for each of them, otherwise with read(2),
+ * which is much slower.
+ */
+static struct pmu_event_st const Known_pmu_events[] =
+{
+	{ "cycles",		PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions",	PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-references",	PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache-misses",	PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_CACHE_MISSES },
+	{ "branches",		PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "branch-misses",	PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_BRANCH_MISSES },
+	{ "ref-cycles",		PERF_TYPE_HARDWARE,
+		PERF_COUNT_HW_REF_CPU_CYCLES },
+	{ "task-clock",		PERF_TYPE_SOFTWARE,
+		PERF_COUNT_SW_TASK_CLOCK },
+	{ "page-faults",	PERF_TYPE_SOFTWARE,
+		PERF_COUNT_SW_PAGE_FAULTS },
+	{ "context-switches",	PERF_TYPE_SOFTWARE,
+		PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu-migrations",	PERF_TYPE_SOFTWARE,
+		PERF_COUNT_SW_CPU_MIGRATIONS },
+};
+
+/* Sets $Pmu_events to the counters listed in $str, separated by ',' or
+ * ':'.  Returns how many of them there are. */
+static unsigned mkpmu(char const *str)
+{
+	unsigned i, n;
+	size_t len;
+
+	for (n = 0; *str; str += len + !!str[len])
+	{
+		len = strcspn(str, ",:");
+		if (!len)
+			continue;
+
+		for (i = 0; i < sizeof(Known_pmu_events)
+				/ sizeof(Known_pmu_events[0]); i++)
+			if (strlen(Known_pmu_events[i].name) == len
+				&& !memcmp(Known_pmu_events[i].name, str, len))
+				break;
+		if (i >= sizeof(Known_pmu_events)
+				/ sizeof(Known_pmu_events[0]))
+			LOGIT("unknown counter in $TRACY_PMU: %.*s",
+				(int)len, str);
+		else if (n >= PMU_MAX)
+			LOGIT("too many counters in $TRACY_PMU, "
+				"ignoring %.*s", (int)len, str);
+		else
+			Pmu_events[n++] = &Known_pmu_events[i];
+	} /* for */
+
+	return n;
+} /* mkpmu */
+
+/* Opens the $Pmu_events of the calling thread in $prof.  The counters
+ * which can't be opened always read 0. */
+static void open_pmu(struct profile_st *prof)
+{
+	static unsigned warned;
+	unsigned i;
+	struct perf_event_attr attr;
+
+	for (i = 0; i < Pmu_count; i++)
+	{
+		void *page;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = Pmu_events[i]->type;
+		attr.config = Pmu_events[i]->config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		prof->pmu_pages[i] = NULL;
+		if ((prof->pmu_fds[i] = syscall(SYS_perf_event_open, &attr,
+				0, -1, -1, PERF_FLAG_FD_CLOEXEC)) < 0)
+		{	/* Only complain in the first thread. */
+			if (!(__atomic_fetch_or(&warned, 1 << i,
+					__ATOMIC_RELAXED) & (1 << i)))
+				LOGIT("perf_event_open(%s): %m",
+					Pmu_events[i]->name);
+			continue;
+		}
+
+#ifdef HAVE_RDPMC
+		page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ,
+			MAP_SHARED, prof->pmu_fds[i], 0);
+		if (page == MAP_FAILED)
+			continue;
+		if (((struct perf_event_mmap_page *)page)->cap_user_rdpmc)
+			prof->pmu_pages[i] = page;
+		else
+			munmap(page, sysconf(_SC_PAGESIZE));
+#endif
+	} /* for */
+} /* open_pmu */
+
+/* Closes the counters open_pmu() opened.  Called when a thread exits. */
+static void close_pmu(void *ptr)
+{
+	unsigned i;
+	struct profile_st *prof = ptr;
+
+	for (i = 0; i < Pmu_count; i++)
+	{
+		if (prof->pmu_pages[i])
+			munmap(prof->pmu_pages[i], sysconf(_SC_PAGESIZE));
+		if (prof->pmu_fds[i] >= 0)
+			close(prof->pmu_fds[i]);
+		prof->pmu_pages[i] = NULL;
+		prof->pmu_fds[i] = -1;
+	}
+} /* close_pmu */
+
+/* Reads the counters of the calling thread into $values. */
+static void read_pmu(struct profile_st const *prof, unsigned long long *values)
+{
+	unsigned i;
+
+	for (i = 0; i < Pmu_count; i++)
+	{
+#ifdef HAVE_RDPMC
+		struct perf_event_mmap_page const *page;
+
+		if ((page = prof->pmu_pages[i]) != NULL)
+		{	/* The kernel changes the page under .lock when it
+			 * moves the counter, so retry until it's stable. */
+			unsigned seq, idx, width;
+			unsigned long long count, pmc;
+
+			do
+			{
+				seq = __atomic_load_n(&page->lock,
+					__ATOMIC_ACQUIRE);
+				idx = page->index;
+				count = page->offset;
+				if (idx)
+				{
+					width = page->pmc_width;
+					pmc = __builtin_ia32_rdpmc(idx - 1);
+					/* Sign-extend the $width bits. */
+					pmc <<= 64 - width;
+					count += (long long)pmc >> (64 - width);
+				}
+				__atomic_signal_fence(__ATOMIC_SEQ_CST);
+			} while (__atomic_load_n(&page->lock, __ATOMIC_ACQUIRE)
+				!= seq);
+
+			values[i] = count;
+			continue;
+		}
+#endif
+
+		if (prof->pmu_fds[i] < 0 || read(prof->pmu_fds[i], &values[i],
+				sizeof(values[i])) != sizeof(values[i]))
+			values[i] = 0;
+	} /* for */
+} /* read_pmu */
+
+/* Accounts what the counters counted during the call of $frame until
+ * $now to its function, and to its caller's children if it has one. */
+static void account_pmu(struct prof_frame_st *frame,
+	struct prof_frame_st *caller, unsigned long long const *now)
+{
+	unsigned i;
+	unsigned long long *pmu;
+	struct prof_fun_st *fun;
+
+	fun = frame->fun;
+	if (!(pmu = fun->pmu))
+	{	/* dump_profile() may be reading $fun. */
+		if (!(pmu = calloc(PMU_MAX, sizeof(*pmu))))
+			return;
+		__atomic_store_n(&fun->pmu, pmu, __ATOMIC_RELEASE);
+	}
+
+	for (i = 0; i < Pmu_count; i++)
+	{
+		unsigned long long delta;
+
+		delta = now[i] - frame->pmu_start[i];
+		pmu[i] += delta - frame->pmu_children[i];
+		if (caller)
+			caller->pmu_children[i] += delta;
+	}
+} /* account_pmu */
+/* }}} */
+
+/* Profiling {{{ */
+/*
+ * In $TRACY_MODE=profile nothing is printed while the program is running.
+ * Instead each thread keeps a shadow stack of the calls in progress, and
+ * accounts the time of each returning call to its function's prof_fun_st
+ * in its own table, along with a histogram of how long the calls took.
+ * dump_profile() merges the tables of all threads and prints a summary
+ * sorted by the time spent in the functions' own code.
+ * The threads are not stopped for that, so the summary printed on a signal
+ * may be slightly inconsistent.  With $TRACY_CALLGRAPH the calls are also
+ * counted by where they come from, the return address the instrumentation
+ * passes to __cyg_profile_func_enter(), which gives the call graph without
+ * keeping the calling context.
+ */
+/* Returns the entry of $addr in $table, or the empty slot where it should
+ * be added. */
+static struct prof_fun_st *find_prof_fun(struct prof_table_st *table,
+	void const *addr)
+{
+	unsigned long h;
+	struct prof_fun_st *fun;
+
+	/* Hash it like find_addr(). */
+	h = (unsigned long)addr * (unsigned long)0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	for (;; h++)
+	{
+		fun = &table->entries[h & (table->size - 1)];
+		if (!fun->addr || fun->addr == addr)
+			return fun;
+	}
+} /* find_prof_fun */
+
+/* Returns the bucket of the latency histograms where $ticks are counted.
+ * Below 1 << HIST_SUB_BITS every value has its own bucket, then each
+ * power of two has as many, so a bucket is at most 1/8 of its values
+ * wide, like in HdrHistogram. */
+static inline unsigned hist_bucket(unsigned long long ticks)
+{
+	unsigned shift;
+
+	if (ticks < (1 << HIST_SUB_BITS))
+		return ticks;
+	shift = 63 - __builtin_clzll(ticks) - HIST_SUB_BITS;
+	if (shift > HIST_MAX_SHIFT)
+		return HIST_BUCKETS - 1;
+	return ((shift + 1) << HIST_SUB_BITS)
+		| ((ticks >> shift) & ((1 << HIST_SUB_BITS) - 1));
+} /* hist_bucket */
+
+/* Returns the largest value hist_bucket() puts in $bucket. */
+static unsigned long long hist_value(unsigned bucket)
+{
+	unsigned shift;
+	unsigned long long low;
+
+	if (bucket < (1 << HIST_SUB_BITS))
+		return bucket;
+	shift = (bucket >> HIST_SUB_BITS) - 1;
+	low = (unsigned long long)((1 << HIST_SUB_BITS)
+		| (bucket & ((1 << HIST_SUB_BITS) - 1))) << shift;
+	return low + (1ULL << shift) - 1;
+} /* hist_value */
+
+/* Returns the $permille:th percentile of the $hist of $fun in nanoseconds,
+ * not more than its .max. */
+static unsigned long long hist_percentile(struct prof_fun_st const *fun,
+	unsigned permille)
+{
+	unsigned i;
+	unsigned long long count, rank, seen;
+
+	if (!fun->hist)
+		return 0;
+	for (count = 0, i = 0; i < HIST_BUCKETS; i++)
+		count += fun->hist[i];
+	if (!count)
+		return 0;
+
+	/* The smallest value at least $permille of the calls took
+	 * at most. */
+	rank = (count * permille + 999) / 1000;
+	for (seen = 0, i = 0; i < HIST_BUCKETS - 1; i++)
+		if ((seen += fun->hist[i]) >= rank)
+			break;
+	return ticks2ns(hist_value(i) < fun->max ? hist_value(i) : fun->max);
+} /* hist_percentile */
+
+/* Counts a call of $fun which took $elapsed ticks in its histogram. */
+static inline void record_latency(struct prof_fun_st *fun,
+	unsigned long long elapsed)
+{
+	unsigned long *hist;
+
+	if (!(hist = fun->hist))
+	{	/* dump_profile() may be reading $fun. */
+		if (!(hist = calloc(HIST_BUCKETS, sizeof(*hist))))
+			return;
+		__atomic_store_n(&fun->hist, hist, __ATOMIC_RELEASE);
+	}
+	hist[hist_bucket(elapsed)]++;
+	if (fun->max < elapsed)
+		fun->max = elapsed;
+} /* record_latency */
+
+/* Replaces $prof's table with one twice as large, and updates its stack
+ * to point to the new entries.  The old table is not freed, because
+ * dump_profile() may be reading it. */
+static int grow_prof_table(struct profile_st *prof)
+{
+	unsigned i, size;
+	struct prof_table_st *table, *old;
+
+	old = prof->table;
+	size = old ? 2*old->size : 1024;
+	if (!(table = calloc(1, sizeof(*table) + sizeof(*table->entries)*size)))
+	{
+		LOGIT("calloc(%zu): %m",
+			sizeof(*table) + sizeof(*table->entries)*size);
+		return 0;
+	}
+	table->size = size;
+
+	if (old)
+	{
+		for (i = 0; i < old->size; i++)
+			if (old->entries[i].addr)
+				*find_prof_fun(table, old->entries[i].addr)
+					= old->entries[i];
+		table->used = old->used;
+		for (i = 0; i < prof->depth; i++)
+			prof->stack[i].fun = find_prof_fun(table,
+				prof->stack[i].fun->addr);
+	}
+
+	__atomic_store_n(&prof->table, table, __ATOMIC_RELEASE);
+	return 1;
+} /* grow_prof_table */
+
+/* Returns the entry of the calls of $callee from $site in $table, or the
+ * empty slot where it should be added. */
+static struct prof_edge_st *find_prof_edge(struct prof_edge_table_st *table,
+	void const *site, void const *callee)
+{
+	unsigned long h;
+	struct prof_edge_st *edge;
+
+	h = ((unsigned long)site ^ (unsigned long)callee)
+		* (unsigned long)0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	for (;; h++)
+	{
+		edge = &table->entries[h & (table->size - 1)];
+		if (!edge->callee
+			|| (edge->site == site && edge->callee == callee))
+			return edge;
+	}
+} /* find_prof_edge */
+
+/* Like grow_prof_table() for the table of the edges of the call graph. */
+static int grow_edge_table(struct profile_st *prof)
+{
+	unsigned i, size;
+	struct prof_edge_table_st *table, *old;
+	struct prof_edge_st const *edge;
+
+	old = prof->edges;
+	size = old ? 2*old->size : 1024;
+	if (!(table = calloc(1, sizeof(*table) + sizeof(*table->entries)*size)))
+	{
+		LOGIT("calloc(%zu): %m",
+			sizeof(*table) + sizeof(*table->entries)*size);
+		return 0;
+	}
+	table->size = size;
+
+	if (old)
+	{
+		for (i = 0; i < old->size; i++)
+			if ((edge = &old->entries[i])->callee)
+				*find_prof_edge(table, edge->site,
+					edge->callee) = *edge;
+		table->used = old->used;
+		for (i = 0; i < prof->depth; i++)
+			if ((edge = prof->stack[i].edge) != NULL)
+				prof->stack[i].edge = find_prof_edge(table,
+					edge->site, edge->callee);
+	}
+
+	__atomic_store_n(&prof->edges, table, __ATOMIC_RELEASE);
+	return 1;
+} /* grow_edge_table */
+
+/* Returns the edge of the call graph of $prof from $site to $callee,
+ * adding it if necessary. */
+static struct prof_edge_st *get_prof_edge(struct profile_st *prof,
+	void const *site, void const *callee)
+{
+	struct prof_edge_st *edge;
+
+	if (!prof->edges && !grow_edge_table(prof))
+		return NULL;
+
+	edge = find_prof_edge(prof->edges, site, callee);
+	if (!edge->callee)
+	{
+		if (prof->edges->used >= prof->edges->size / 2)
+		{
+			if (!grow_edge_table(prof))
+				return NULL;
+			edge = find_prof_edge(prof->edges, site, callee);
+		}
+		prof->edges->used++;
+		edge->site = site;
+		__atomic_store_n(&edge->callee, callee, __ATOMIC_RELEASE);
+	}
+	return edge;
+} /* get_prof_edge */
+
+/* Returns the profile of the calling thread or NULL if it can't have one. */
+static struct profile_st *get_profile(void)
+{
+	struct profile_st *prof, *head;
+
+	if (My_profile)
+		return My_profile;
+
+	/* The profiles of exited threads are kept for dump_profile(). */
+	if (!(prof = calloc(1, sizeof(*prof))))
+	{
+		LOGIT("calloc(%zu): %m", sizeof(*prof));
+		return NULL;
+	}
+	prof->tid = gettid();
+	if (!grow_prof_table(prof))
+	{
+		free(prof);
+		return NULL;
+	}
+	if (Pmu_count)
+	{
+		open_pmu(prof);
+		pthread_setspecific(Pmu_key, prof);
+	}
+
+	head = __atomic_load_n(&Profiles, __ATOMIC_RELAXED);
+	do
+		prof->next = head;
+	while (!__atomic_compare_exchange_n(&Profiles, &head, prof, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return My_profile = prof;
+} /* get_profile */
+
+/* Returns the child of $parent in the calling-context tree of $prof
+ * which stands for the calls of $addr, making it if necessary. */
+static struct cct_node_st *cct_child(struct profile_st *prof,
+	struct cct_node_st *parent, void const *addr)
+{
+	unsigned long h, i;
+	struct cct_node_st *node;
+
+	if (prof->cct_used >= prof->cct_size / 2)
+	{	/* Rehash to a table twice as large. */
+		unsigned size;
+		struct cct_node_st **hash;
+
+		size = prof->cct_size ? 2*prof->cct_size : 1024;
+		if (!(hash = calloc(size, sizeof(*hash))))
+		{
+			LOGIT("calloc(%zu): %m", sizeof(*hash) * size);
+			return NULL;
+		}
+
+		for (i = 0; i < prof->cct_size; i++)
+		{
+			if (!(node = prof->cct_hash[i]))
+				continue;
+			h = ((unsigned long)node->addr
+				^ (unsigned long)node->parent)
+				* (unsigned long)0x9E3779B97F4A7C15ULL;
+			for (h ^= h >> 29; hash[h & (size-1)]; h++)
+				;
+			hash[h & (size-1)] = node;
+		}
+
+		free(prof->cct_hash);
+		prof->cct_hash = hash;
+		prof->cct_size = size;
+	}
+
+	h = ((unsigned long)addr ^ (unsigned long)parent)
+		* (unsigned long)0x9E3779B97F4A7C15ULL;
+	for (h ^= h >> 29; (node = prof->cct_hash[h & (prof->cct_size-1)])
+		!= NULL; h++)
+		if (node->addr == addr && node->parent == parent)
+			return node;
+
+	/* New node. */
+	if (!prof->pool || prof->npool >= 1024)
+	{
+		if (!(prof->pool = calloc(1024, sizeof(*prof->pool))))
+		{
+			LOGIT("calloc(%zu): %m", sizeof(*prof->pool) * 1024);
+			return NULL;
+		}
+		prof->npool = 0;
+	}
+
+	node = &prof->pool[prof->npool++];
+	node->addr = addr;
+	node->parent = parent;
+	node->next = parent->children;
+	__atomic_store_n(&parent->children, node, __ATOMIC_RELEASE);
+
+	prof->cct_hash[h & (prof->cct_size-1)] = node;
+	prof->cct_used++;
+	return node;
+} /* cct_child */
+
+/* Pushes a call of $addr from $site onto the shadow stack of the calling
+ * thread. */
+static void profile_enter(void const *addr, void const *site)
+{
+	char const *fname, *funame;
+	struct profile_st *prof;
+	struct prof_frame_st *frame;
+	struct prof_fun_st *fun;
+	struct cct_node_st *node;
+	struct prof_edge_st *edge;
+	struct config_st *config;
+
+	/* Omitted functions' time is accounted to their callers. */
+	config = get_config();
+	if (resolve(config, &fname, &funame, NULL, addr) < 0)
+		return;
+	if (!(prof = get_profile()))
+		return;
+	if (prof->too_deep > 0
+		|| (config->depth_limited && prof->depth >= config->depth_limit))
+	{	/* Account it to the caller, like omitted functions. */
+		prof->too_deep++;
+		return;
+	}
+
+	/* If we run out of memory the call is accounted to the caller too,
+	 * counted in .too_deep so that profile_exit() takes its return
+	 * for it and doesn't pop an outer call of a recursive function.
+	 * What it calls is counted there as well, like above, so that
+	 * the returns don't get mixed up. */
+	if (prof->depth >= prof->stacksize)
+	{
+		unsigned size;
+
+		size = prof->stacksize ? 2*prof->stacksize : 256;
+		if (!(frame = realloc(prof->stack, sizeof(*frame) * size)))
+		{
+			LOGIT("realloc(%zu): %m", sizeof(*frame) * size);
+			prof->too_deep++;
+			return;
+		}
+		prof->stack = frame;
+		prof->stacksize = size;
+	}
+
+	node = NULL;
+	if (Folded_fname && !(node = cct_child(prof, prof->depth > 0
+			? prof->stack[prof->depth-1].node : &prof->root,
+			addr)))
+	{
+		prof->too_deep++;
+		return;
+	}
+	edge = NULL;
+	if (Callgraph_fname && !(edge = get_prof_edge(prof, site, addr)))
+	{
+		prof->too_deep++;
+		return;
+	}
+
+	fun = find_prof_fun(prof->table, addr);
+	if (!fun->addr)
+	{	/* New function, keep the load factor below 1/2. */
+		if (prof->table->used >= prof->table->size / 2)
+		{
+			if (!grow_prof_table(prof))
+			{
+				prof->too_deep++;
+				return;
+			}
+			fun = find_prof_fun(prof->table, addr);
+		}
+		prof->table->used++;
+		__atomic_store_n(&fun->addr, addr, __ATOMIC_RELEASE);
+	}
+
+	fun->calls++;
+	fun->active++;
+	if (fun->maxdepth < prof->depth)
+		fun->maxdepth = prof->depth;
+	if (edge)
+	{
+		edge->calls++;
+		edge->active++;
+	}
+
+	frame = &prof->stack[prof->depth++];
+	frame->fun = fun;
+	frame->node = node;
+	frame->edge = edge;
+	frame->children = 0;
+	if (Pmu_count)
+	{
+		memset(frame->pmu_children, 0, sizeof(frame->pmu_children));
+		read_pmu(prof, frame->pmu_start);
+	}
+	frame->start = read_clock();
+} /* profile_enter */
+
+/* Pops the call of $addr from the shadow stack of the calling thread. */
+static void profile_exit(void const *addr)
+{
+	unsigned long long now, pmu_now[PMU_MAX];
+	char const *fname, *funame;
+	struct profile_st *prof;
+	unsigned depth;
+
+	now = read_clock();
+	if (!(prof = My_profile))
+		return;
+	if (resolve(get_config(), &fname, &funame, NULL, addr) < 0)
+		return;
+	if (prof->too_deep > 0)
+	{	/* Returning from beyond the .depth_limit. */
+		prof->too_deep--;
+		return;
+	}
+
+	/* If some calls haven't returned properly (because of longjmp()
+	 * or an exception) they end here too.  If there's no $addr on the
+	 * stack its call started before tracing was turned on. */
+	for (depth = prof->depth; depth > 0; depth--)
+		if (prof->stack[depth-1].fun->addr == addr)
+			break;
+	if (!depth)
+		return;
+	if (Pmu_count)
+		read_pmu(prof, pmu_now);
+
+	while (prof->depth >= depth)
+	{
+		unsigned long long elapsed;
+		struct prof_frame_st *frame;
+
+		frame = &prof->stack[--prof->depth];
+		elapsed = now - frame->start;
+		frame->fun->self += elapsed - frame->children;
+		if (!--frame->fun->active)
+			frame->fun->total += elapsed;
+		record_latency(frame->fun, elapsed);
+		if (frame->node)
+		{
+			frame->node->calls++;
+			frame->node->total += elapsed;
+			frame->node->self  += elapsed - frame->children;
+		}
+		if (frame->edge && !--frame->edge->active)
+			frame->edge->total += elapsed;
+		if (Pmu_count)
+			account_pmu(frame, prof->depth > 0
+				? &prof->stack[prof->depth-1] : NULL, pmu_now);
+		if (prof->depth > 0)
+			prof->stack[prof->depth-1].children += elapsed;
+	}
+} /* profile_exit */
+
+/* Orders prof_fun_st:s by address for qsort(). */
+static int cmpfunaddrs(void const *lhs, void const *rhs)
+{
+	struct prof_fun_st const *l = lhs, *r = rhs;
+	return l->addr < r->addr ? -1 : l->addr > r->addr;
+} /* cmpfunaddrs */
+
+/* Orders prof_fun_st:s by decreasing .self for qsort(). */
+static int cmpfunself(void const *lhs, void const *rhs)
+{
+	struct prof_fun_st const *l = lhs, *r = rhs;
+	return l->self > r->self ? -1 : l->self < r->self;
+} /* cmpfunself */
+
+/* Adds up the calling-context tree of $src in $dst.  Returns 0 if it
+ * ran out of memory. */
+static int merge_cct(struct cct_node_st *dst, struct cct_node_st const *src)
+{
+	struct
+	{
+		struct cct_node_st *dst;
+		struct cct_node_st const *src;
+	} *stack, *tmp;
+	unsigned sp, stacksize;
+
+	/* Go through the tree without recursion, because it may be deep. */
+	stacksize = 256;
+	if (!(stack = malloc(sizeof(*stack) * stacksize)))
+		return 0;
+	sp = 0;
+	stack[sp].dst = dst;
+	stack[sp].src = src;
+	sp++;
+
+	while (sp > 0)
+	{
+		struct cct_node_st const *child;
+
+		sp--;
+		dst = stack[sp].dst;
+		src = stack[sp].src;
+		for (child = __atomic_load_n(&src->children, __ATOMIC_ACQUIRE);
+			child; child = child->next)
+		{
+			struct cct_node_st *same;
+
+			for (same = dst->children; same; same = same->next)
+				if (same->addr == child->addr)
+					break;
+			if (!same)
+			{
+				if (!(same = calloc(1, sizeof(*same))))
+					goto out;
+				same->addr = child->addr;
+				same->parent = dst;
+				same->next = dst->children;
+				dst->children = same;
+			}
+
+			same->calls += child->calls;
+			same->total += child->total;
+			same->self  += child->self;
+
+			if (sp >= stacksize)
+			{
+				stacksize *= 2;
+				if (!(tmp = realloc(stack,
+						sizeof(*stack) * stacksize)))
+					goto out;
+				stack = tmp;
+			}
+			stack[sp].dst = same;
+			stack[sp].src = child;
+			sp++;
+		} /* for */
+	} /* while */
+
+	free(stack);
+	return 1;
+
+out:
+	free(stack);
+	return 0;
+} /* merge_cct */
+
+/* Frees what merge_cct() has built under $root. */
+static void free_cct(struct cct_node_st *root)
+{
+	struct cct_node_st *node, *next;
+
+	/* Free the leaves and cut them off from their parents, until
+	 * nothing but the $root is left. */
+	for (node = root->children; node; node = next)
+		if (node->children)
+			next = node->children;
+		else
+		{
+			next = node->next ? node->next : node->parent;
+			node->parent->children = node->next;
+			free(node);
+			if (next == root)
+				break;
+		}
+} /* free_cct */
+
+/* Writes the call chains of the tree under $root in the "folded" format of
+ * flamegraph.pl: the names of the functions in the chain separated by ';',
+ * and the time spent in the last one (or the number of its calls). */
+static void write_folded(FILE *st, struct cct_node_st const *root)
+{
+	unsigned depth, size, i;
+	struct cct_node_st const *node, **chain, **tmp;
+
+	size = 256;
+	if (!(chain = malloc(sizeof(*chain) * size)))
+		return;
+
+	/* Traverse the tree in pre-order by following the links. */
+	depth = 0;
+	node = root->children;
+	while (node)
+	{
+		unsigned long long value;
+
+		if (depth >= size)
+		{
+			size *= 2;
+			if (!(tmp = realloc(chain, sizeof(*chain) * size)))
+				break;
+			chain = tmp;
+		}
+		chain[depth] = node;
+
+		value = Folded_counts ? node->calls : ticks2ns(node->self);
+		if (value > 0)
+		{
+			for (i = 0; i <= depth; i++)
+			{
+				char const *fname, *funame;
+
+				if (i > 0)
+					putc(';', st);
+				if (addr2name(&fname, &funame,
+						chain[i]->addr, 0) > 0)
+					fputs(funame, st);
+				else
+					fprintf(st, "[%p]", chain[i]->addr);
+			}
+			fprintf(st, " %llu\n", value);
+		}
+
+		if (node->children)
+		{
+			node = node->children;
+			depth++;
+			continue;
+		}
+		while (node != root && !node->next)
+		{
+			node = node->parent;
+			depth--;
+		}
+		node = node != root ? node->next : NULL;
+	} /* while */
+
+	free(chain);
+} /* write_folded */
+
+/* Merges the calling-context trees of all threads and writes them
+ * to $Folded_fname. */
+static void dump_folded(void)
+{
+	FILE *st;
+	struct cct_node_st root;
+	struct profile_st const *prof;
+
+	memset(&root, 0, sizeof(root));
+	for (prof = __atomic_load_n(&Profiles, __ATOMIC_ACQUIRE);
+			prof; prof = prof->next)
+		if (!merge_cct(&root, &prof->root))
+		{
+			LOGIT("merge_cct: %m");
+			break;
+		}
+
+	if ((st = fopen_output(Folded_fname, &Folded_file)) != NULL)
+	{
+		write_folded(st, &root);
+		fclose(st);
+	}
+
+	free_cct(&root);
+} /* dump_folded */
+
+/* Orders prof_edge_st:s by callee and site for qsort(). */
+static int cmpedges(void const *lhs, void const *rhs)
+{
+	struct prof_edge_st const *l = lhs, *r = rhs;
+
+	if (l->callee != r->callee)
+		return l->callee < r->callee ? -1 : 1;
+	return l->site < r->site ? -1 : l->site > r->site;
+} /* cmpedges */
+
+/* Orders graph_edge_st:s by the name of their caller, then by callee
+ * address for qsort().  Callers without a name are told apart by
+ * the site of the call. */
+static int cmpgraph(void const *lhs, void const *rhs)
+{
+	int cmp;
+	struct graph_edge_st const *l = lhs, *r = rhs;
+
+	if ((cmp = strcmp(l->caller_fname, r->caller_fname)) != 0)
+		return cmp;
+	if (l->caller && r->caller)
+	{
+		if ((cmp = strcmp(l->caller, r->caller)) != 0)
+			return cmp;
+	} else if (l->caller || r->caller)
+		return l->caller ? -1 : 1;
+	else if (l->edge.site != r->edge.site)
+		return l->edge.site < r->edge.site ? -1 : 1;
+	if (l->edge.callee != r->edge.callee)
+		return l->edge.callee < r->edge.callee ? -1 : 1;
+	return l->edge.site < r->edge.site ? -1 : l->edge.site > r->edge.site;
+} /* cmpgraph */
+
+/* Returns whether $l and $r are called from the same function. */
+static int same_caller(struct graph_edge_st const *l,
+	struct graph_edge_st const *r)
+{
+	if (strcmp(l->caller_fname, r->caller_fname))
+		return 0;
+	if (l->caller && r->caller)
+		return !strcmp(l->caller, r->caller);
+	return !l->caller && !r->caller && l->edge.site == r->edge.site;
+} /* same_caller */
+
+/* Prints the name of the function $name at $addr, qualified with $fname
+ * unless it's NULL, as a node of the call graph. */
+static void put_graph_name(FILE *st, char const *fname, char const *name,
+	void const *addr)
+{
+	if (fname)
+		fprintf(st, "%s:", fname);
+	if (name)
+		fputs(name, st);
+	else
+		fprintf(st, "[%p]", addr);
+} /* put_graph_name */
+
+/* Writes the $n $edges and the $nfuns $funs in the callgrind format,
+ * which kcachegrind and gprof2dot understand.  The calls are positioned
+ * at their return addresses, and the functions at their entry points. */
+static void write_callgrind(FILE *st, struct graph_edge_st const *edges,
+	unsigned n, struct prof_fun_st const *funs, unsigned nfuns)
+{
+	unsigned i;
+	struct graph_edge_st const *prev;
+
+	fprintf(st, "# callgrind format\n");
+	fprintf(st, "version: 1\ncreator: libtracy\npid: %d\n", getpid());
+	fprintf(st, "positions: instr\nevents: ns\n");
+
+	/* The functions' own time. */
+	for (i = 0; i < nfuns; i++)
+	{
+		char const *fname, *funame;
+
+		if (addr2name(&fname, &funame, funs[i].addr, 0) <= 0)
+			funame = NULL;
+		fprintf(st, "\nfl=%s\nfn=", fname);
+		put_graph_name(st, NULL, funame, funs[i].addr);
+		fprintf(st, "\n%p %llu\n", funs[i].addr,
+			ticks2ns(funs[i].self));
+	}
+
+	/* The calls, grouped by caller. */
+	for (prev = NULL, i = 0; i < n; prev = &edges[i++])
+	{
+		struct graph_edge_st const *edge = &edges[i];
+
+		if (!prev || !same_caller(prev, edge))
+		{
+			fprintf(st, "\nfl=%s\nfn=", edge->caller_fname);
+			put_graph_name(st, NULL, edge->caller,
+				edge->edge.site);
+			putc('\n', st);
+		}
+
+		fprintf(st, "cfl=%s\ncfn=", edge->callee_fname);
+		put_graph_name(st, NULL, edge->callee, edge->edge.callee);
+		fprintf(st, "\ncalls=%lu %p\n%p %llu\n", edge->edge.calls,
+			edge->edge.callee, edge->edge.site,
+			ticks2ns(edge->edge.total));
+	} /* for */
+} /* write_callgrind */
+
+/* Writes the $n $edges as a graph for dot(1), adding up the calls from
+ * different sites of the same caller.  The functions are labelled with
+ * the time spent in them. */
+static void write_dot(FILE *st, struct graph_edge_st const *edges,
+	unsigned n, struct prof_fun_st const *funs, unsigned nfuns)
+{
+	unsigned i;
+
+	fprintf(st, "digraph callgraph {\n\tnode [shape=box];\n");
+	for (i = 0; i < nfuns; i++)
+	{
+		char const *fname, *funame;
+
+		if (addr2name(&fname, &funame, funs[i].addr, 0) <= 0)
+			funame = NULL;
+		fputs("\t\"", st);
+		put_graph_name(st, fname, funame, funs[i].addr);
+		fprintf(st, "\" [label=\"%s\\n%lu calls\\n%llu ns self"
+			"\\n%llu ns total\"];\n", funame ? funame : "[?]",
+			funs[i].calls, ticks2ns(funs[i].self),
+			ticks2ns(funs[i].total));
+	}
+
+	for (i = 0; i < n; )
+	{
+		unsigned long calls;
+		unsigned long long total;
+		unsigned j;
+
+		/* $edges are sorted by caller, then by callee. */
+		calls = total = 0;
+		for (j = i; j < n && edges[j].edge.callee
+				== edges[i].edge.callee
+			&& same_caller(&edges[j], &edges[i]); j++)
+		{
+			calls += edges[j].edge.calls;
+			total += edges[j].edge.total;
+		}
+
+		fputs("\t\"", st);
+		put_graph_name(st, edges[i].caller_fname, edges[i].caller,
+			edges[i].edge.site);
+		fputs("\" -> \"", st);
+		put_graph_name(st, edges[i].callee_fname, edges[i].callee,
+			edges[i].edge.callee);
+		fprintf(st, "\" [label=\"%lu\\n%llu ns\"];\n",
+			calls, ticks2ns(total));
+		i = j;
+	} /* for */
+
+	fprintf(st, "}\n");
+} /* write_dot */
+
+/* Merges the call graphs of all threads and writes them to
+ * $Callgraph_fname along with the time of the $nfuns $funs: as a DOT
+ * graph if its name ends with ".dot", otherwise in the callgrind format. */
+static void dump_callgraph(struct prof_fun_st const *funs, unsigned nfuns)
+{
+	unsigned i, n, size, len;
+	FILE *st;
+	struct prof_edge_st *edges;
+	struct graph_edge_st *graph;
+	struct profile_st const *prof;
+
+	for (size = 0, prof = __atomic_load_n(&Profiles, __ATOMIC_ACQUIRE);
+			prof; prof = prof->next)
+	{
+		struct prof_edge_table_st const *table;
+
+		if ((table = __atomic_load_n(&prof->edges, __ATOMIC_ACQUIRE)))
+			size += table->size;
+	}
+	if (!(edges = malloc(sizeof(*edges) * (size + 1))))
+	{
+		LOGIT("malloc(%zu): %m", sizeof(*edges) * (size + 1));
+		return;
+	}
+
+	/* Collect the edges of all threads and add up the same ones,
+	 * like dump_profile() does with the functions. */
+	for (n = 0, prof = __atomic_load_n(&Profiles, __ATOMIC_ACQUIRE);
+			prof; prof = prof->next)
+	{
+		struct prof_edge_table_st const *table;
+
+		if (!(table = __atomic_load_n(&prof->edges, __ATOMIC_ACQUIRE)))
+			continue;
+		for (i = 0; i < table->size && n < size; i++)
+			if (__atomic_load_n(&table->entries[i].callee,
+					__ATOMIC_ACQUIRE))
+				edges[n++] = table->entries[i];
+	}
+
+	qsort(edges, n, sizeof(*edges), cmpedges);
+	for (size = 0, i = 0; i < n; i++)
+		if (size > 0 && edges[size-1].callee == edges[i].callee
+			&& edges[size-1].site == edges[i].site)
+		{
+			edges[size-1].calls += edges[i].calls;
+			edges[size-1].total += edges[i].total;
+		} else
+			edges[size++] = edges[i];
+	n = size;
+
+	/* Find out who calls whom. */
+	if (!(graph = malloc(sizeof(*graph) * (n + 1))))
+	{
+		LOGIT("malloc(%zu): %m", sizeof(*graph) * (n + 1));
+		free(edges);
+		return;
+	}
+	for (i = 0; i < n; i++)
+	{
+		graph[i].edge = edges[i];
+		if (addr2name(&graph[i].caller_fname, &graph[i].caller,
+				edges[i].site, 0) <= 0)
+			graph[i].caller = NULL;
+		if (addr2name(&graph[i].callee_fname, &graph[i].callee,
+				edges[i].callee, 0) <= 0)
+			graph[i].callee = NULL;
+	}
+	free(edges);
+	qsort(graph, n, sizeof(*graph), cmpgraph);
+
+	if ((st = fopen_output(Callgraph_fname, &Callgraph_file)) != NULL)
+	{
+		/* Children add their PID to the name. */
+		len = strlen(Callgraph_fname);
+		if (len > 4 && !strcmp(&Callgraph_fname[len-4], ".dot"))
+			write_dot(st, graph, n, funs, nfuns);
+		else
+			write_callgrind(st, graph, n, funs, nfuns);
+		fclose(st);
+	}
+
+	free(graph);
+} /* dump_callgraph */
+
+/* Prints the summary of the profiles of all threads. */
+static void dump_profile(void)
+{
+	unsigned i, j, n, size;
+	unsigned long calls, *hists;
+	unsigned long long *pmus;
+	char pmucols[PMU_MAX * 16 + 1];
+	struct prof_fun_st *funs;
+	struct profile_st const *prof;
+
+	/* Don't let a signal and exit() mix their output. */
+	pthread_mutex_lock(&Profile_lock);
+
+	for (size = 0, prof = __atomic_load_n(&Profiles, __ATOMIC_ACQUIRE);
+			prof; prof = prof->next)
+		size += __atomic_load_n(&prof->table, __ATOMIC_ACQUIRE)->size;
+	if (!(funs = malloc(sizeof(*funs) * (size + 1))))
+	{
+		LOGIT("malloc(%zu): %m", sizeof(*funs) * (size + 1));
+		goto out;
+	}
+
+	/* Collect the functions of all threads, then add up the
+	 * statistics of the same functions. */
+	for (n = 0, prof = __atomic_load_n(&Profiles, __ATOMIC_ACQUIRE);
+			prof; prof = prof->next)
+	{
+		struct prof_table_st const *table;
+
+		table = __atomic_load_n(&prof->table, __ATOMIC_ACQUIRE);
+		/* The $table may have grown since we counted. */
+		for (i = 0; i < table->size && n < size; i++)
+			if (__atomic_load_n(&table->entries[i].addr,
+					__ATOMIC_ACQUIRE))
+			{
+				funs[n] = table->entries[i];
+				funs[n].hist = __atomic_load_n(
+					&table->entries[i].hist,
+					__ATOMIC_ACQUIRE);
+				funs[n++].pmu = __atomic_load_n(
+					&table->entries[i].pmu,
+					__ATOMIC_ACQUIRE);
+			}
+	}
+
+	/* The histograms are added up in $hists, the counters in $pmus. */
+	hists = calloc((size_t)n * HIST_BUCKETS + 1, sizeof(*hists));
+	pmus = calloc((size_t)n * PMU_MAX + 1, sizeof(*pmus));
+	if (!hists || !pmus)
+	{
+		LOGIT("calloc: %m");
+		free(hists);
+		free(pmus);
+		free(funs);
+		goto out;
+	}
+
+	qsort(funs, n, sizeof(*funs), cmpfunaddrs);
+	for (size = 0, i = 0; i < n; i++)
+	{
+		unsigned long const *hist;
+		unsigned long long const *pmu;
+
+		hist = funs[i].hist;
+		pmu = funs[i].pmu;
+		if (size > 0 && funs[size-1].addr == funs[i].addr)
+		{
+			funs[size-1].calls += funs[i].calls;
+			funs[size-1].total += funs[i].total;
+			funs[size-1].self  += funs[i].self;
+			if (funs[size-1].max < funs[i].max)
+				funs[size-1].max = funs[i].max;
+			if (funs[size-1].maxdepth < funs[i].maxdepth)
+				funs[size-1].maxdepth = funs[i].maxdepth;
+		} else
+		{
+			funs[size] = funs[i];
+			funs[size].hist = &hists[size * HIST_BUCKETS];
+			funs[size].pmu = &pmus[size * PMU_MAX];
+			size++;
+		}
+
+		for (j = 0; hist && j < HIST_BUCKETS; j++)
+			funs[size-1].hist[j] += hist[j];
+		for (j = 0; pmu && j < Pmu_count; j++)
+			funs[size-1].pmu[j] += pmu[j];
+	} /* for */
+	n = size;
+	qsort(funs, n, sizeof(*funs), cmpfunself);
+
+	for (calls = 0, i = 0; i < n; i++)
+		calls += funs[i].calls;
+	LOGIT("PROFILE: %u functions, %lu calls", n, calls);
+
+	/* The counters of $TRACY_PMU in the functions' own code
+	 * come after the times. */
+	for (pmucols[0] = '\0', j = 0; j < Pmu_count; j++)
+		sprintf(&pmucols[strlen(pmucols)], " %15.15s",
+			Pmu_events[j]->name);
+	LOGIT("%10s %15s %15s %12s %12s %12s %12s%s %5s  %s",
+		"calls", "total ns", "self ns", "p50 ns", "p99 ns", "p999 ns",
+		"max ns", pmucols, "depth", "function");
+	for (i = 0; i < n; i++)
+	{
+		char const *fname, *funame;
+		unsigned long long total, self, p50, p99, p999, max;
+
+		total = ticks2ns(funs[i].total);
+		self  = ticks2ns(funs[i].self);
+		p50   = hist_percentile(&funs[i], 500);
+		p99   = hist_percentile(&funs[i], 990);
+		p999  = hist_percentile(&funs[i], 999);
+		max   = ticks2ns(funs[i].max);
+		for (pmucols[0] = '\0', j = 0; j < Pmu_count; j++)
+			sprintf(&pmucols[strlen(pmucols)], " %15llu",
+				funs[i].pmu[j]);
+		if (addr2name(&fname, &funame, funs[i].addr, 0) > 0)
+			LOGIT("%10lu %15llu %15llu %12llu %12llu %12llu %12llu"
+				"%s %5u  %s:%s()",
+				funs[i].calls, total, self, p50, p99, p999,
+				max, pmucols, funs[i].maxdepth, fname, funame);
+		else
+			LOGIT("%10lu %15llu %15llu %12llu %12llu %12llu %12llu"
+				"%s %5u  %s:[%p]",
+				funs[i].calls, total, self, p50, p99, p999,
+				max, pmucols, funs[i].maxdepth, fname,
+				funs[i].addr);
+	}
+
+	if (Callgraph_fname)
+		dump_callgraph(funs, n);
+	free(hists);
+	free(pmus);
+	free(funs);
+	if (Folded_fname)
+		dump_folded();
+out:
+	pthread_mutex_unlock(&Profile_lock);
+} /* dump_profile */
+
+/* Prints the summary if a signal asked for it. */
+static inline void check_dump(void)
+{
+	if (__atomic_load_n(&Dump_requested, __ATOMIC_RELAXED)
+			&& __atomic_exchange_n(&Dump_requested, 0,
+				__ATOMIC_ACQUIRE))
+		dump_profile();
+} /* check_dump */
+/* }}} */
+
+/* Auto-exclusion {{{ */
+/*
+ * With $TRACY_AUTO_EXCLUDE each thread measures how long the calls of
+ * the functions take, from the end of the ENTER to the beginning of the
+ * LEAVE, so what's logged doesn't count.  When a function makes at least
+ * $TRACY_AUTO_EXCLUDE_RATE calls within a second, taking less than
+ * $TRACY_AUTO_EXCLUDE on average, it's demoted: from then on its calls
+ * are only counted, and omitted like with $TRACY_EXFUNS before anything
+ * else is done.  The other threads follow suit when they notice that
+ * $Auto_generation has changed.  The statistics live in a direct-mapped
+ * table like $TRACY_FUN_RATE's, and demoted functions keep their slots.
+ * report_auto_exclude() lists them at exit.
+ */
+/* Returns the $TRACY_AUTO_EXCLUDE table of the calling thread. */
+static struct auto_table_st *get_autos(void)
+{
+	struct auto_table_st *autos, *head;
+
+	if (My_autos)
+		return My_autos;
+
+	/* Kept after the thread exits for report_auto_exclude(). */
+	if (!(autos = calloc(1, sizeof(*autos))))
+	{
+		LOGIT("calloc(%zu): %m", sizeof(*autos));
+		return NULL;
+	}
+
+	head = __atomic_load_n(&Auto_tables, __ATOMIC_RELAXED);
+	do
+		autos->next = head;
+	while (!__atomic_compare_exchange_n(&Auto_tables, &head, autos, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return My_autos = autos;
+} /* get_autos */
+
+/* Returns whether to go on with the call of $addr, and pushes it onto
+ * the calling thread's stack of calls.  Returns 0 if it's demoted. */
+static int auto_enter(void const *addr)
+{
+	unsigned long h;
+	unsigned generation;
+	struct auto_table_st *autos;
+	struct auto_frame_st *frame;
+	struct auto_st *slot;
+
+	if (!(autos = get_autos()))
+		return 1;
+	if (autos->depth >= AUTO_DEPTH)
+	{	/* Too deep to follow. */
+		autos->depth++;
+		return 1;
+	}
+	frame = &autos->frames[autos->depth++];
+	frame->addr = addr;
+	frame->skipped = 0;
+
+	h = (unsigned long)addr * (unsigned long)0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+	slot = &autos->slots[h & (AUTO_SLOTS - 1)];
+	generation = __atomic_load_n(&Auto_generation, __ATOMIC_ACQUIRE);
+	if (slot->addr != addr)
+	{
+		if (slot->demoted)
+		{	/* Is taken, we can't measure $addr. */
+			frame->slot = NULL;
+			return 1;
+		}
+		slot->addr = addr;
+		slot->window = read_clock();
+		slot->ticks = slot->calls = slot->skipped = 0;
+		slot->generation = generation - 1;
+	}
+	if (!slot->demoted && slot->generation != generation)
+	{	/* Has another thread demoted it? */
+		struct addr_cache_st const *cache;
+
+		slot->generation = generation;
+		for (cache = __atomic_load_n(&Auto_excluded,
+				__ATOMIC_ACQUIRE); cache; cache = cache->prev)
+			if (find_addr(cache, addr))
+			{
+				slot->demoted = 1;
+				break;
+			}
+	}
+
+	frame->slot = slot;
+	if (slot->demoted)
+	{
+		slot->skipped++;
+		frame->skipped = 1;
+		return 0;
+	}
+	return 1;
+} /* auto_enter */
+
+/* Called when auto_enter() returned 1 and the ENTER has been logged. */
+static inline void auto_entered(void)
+{
+	struct auto_table_st *autos;
+
+	if ((autos = My_autos) != NULL && autos->depth <= AUTO_DEPTH)
+		autos->frames[autos->depth-1].start = read_clock();
+} /* auto_entered */
+
+/* Demotes the function of $slot. */
+static void demote(struct auto_st *slot)
+{
+	slot->demoted = 1;
+	cache_addr(&Auto_excluded, slot->addr, NULL, NULL, NULL, 1);
+	__atomic_fetch_add(&Auto_generation, 1, __ATOMIC_RELEASE);
+} /* demote */
+
+/* Pops the call of $addr from the calling thread's stack and accounts
+ * its time.  Returns whether to go on with the return, 0 if the call
+ * was skipped. */
+static int auto_exit(void const *addr)
+{
+	unsigned long long now;
+	struct auto_table_st *autos;
+	struct auto_frame_st *frame;
+	struct auto_st *slot;
+	unsigned depth;
+
+	now = read_clock();
+	if (!(autos = My_autos) || !autos->depth)
+		return 1;
+	if (autos->depth > AUTO_DEPTH)
+	{
+		autos->depth--;
+		return 1;
+	}
+
+	/* Like in profile_exit(), the calls which haven't returned properly
+	 * end here too, and if $addr is not on the stack its call started
+	 * before tracing did. */
+	for (depth = autos->depth; depth > 0; depth--)
+		if (autos->frames[depth-1].addr == addr)
+			break;
+	if (!depth)
+		return 1;
+	autos->depth = depth - 1;
+	frame = &autos->frames[depth-1];
+	if (frame->skipped)
+		return 0;
+
+	/* Has the slot been taken over during the call? */
+	if (!(slot = frame->slot) || slot->addr != addr || slot->demoted)
+		return 1;
+
+	if (now - slot->window >= Second_ticks)
+	{	/* Start a new window. */
+		slot->window = now;
+		slot->ticks = slot->calls = 0;
+	}
+	slot->ticks += now - frame->start;
+	if (++slot->calls >= Auto_rate && slot->ticks < Auto_exclude*slot->calls)
+		demote(slot);
+	return 1;
+} /* auto_exit */
+
+/* Orders auto_st:s by address for qsort(). */
+static int cmpautos(void const *lhs, void const *rhs)
+{
+	struct auto_st const *l = lhs, *r = rhs;
+	return l->addr < r->addr ? -1 : l->addr > r->addr;
+} /* cmpautos */
+
+/*
+ * Returns the name of the function $funame as gcc matches it against
+ * -finstrument-functions-exclude-function-list, which is what the user sees:
+ * demangled if it's a C++ symbol and __cxa_demangle() is around, and without
+ * the parameters and the return type of templates, like "Foo::get".  If the
+ * returned name is not $funame, it has to be free()d.
+ */
+static char *excluded_name(char const *funame)
+{
+	static char *(*demangle)(char const *, char *, size_t *, int *);
+	static int looked_up;
+	char *name, *p, *start;
+	int status;
+	unsigned depth;
+
+	if (strncmp(funame, "_Z", 2))
+		return (char *)funame;
+	if (!looked_up)
+	{
+		demangle = dlsym(RTLD_DEFAULT, "__cxa_demangle");
+		looked_up = 1;
+	}
+	if (!demangle || !(name = demangle(funame, NULL, NULL, &status)))
+		return (char *)funame;
+
+	/* Cut the parameters and what follows them, like " const".
+	 * Find the '(' matching the last ')'. */
+	if (!(p = strrchr(name, ')')))
+		return name;
+	for (depth = 0; p >= name; p--)
+		if (*p == ')')
+			depth++;
+		else if (*p == '(' && !--depth)
+			break;
+	if (p > name)
+		*p = '\0';
+
+	/* Cut the return type of templates, like "int " of "int tp<int>",
+	 * but not the "operator " of "Foo::operator new". */
+	for (start = name, depth = 0, p = name; *p; p++)
+		if (*p == '<')
+			depth++;
+		else if (*p == '>' && depth > 0)
+			depth--;
+		else if (*p == ' ' && !depth && (p - name < 8
+				|| strncmp(p - 8, "operator", 8)))
+			start = p + 1;
+	if (start > name)
+		memmove(name, start, strlen(start) + 1);
+	return name;
+} /* excluded_name */
+
+/* Writes $name to $st escaped for gcc's @file. */
+static void write_excluded(FILE *st, char const *name)
+{
+	for (; *name; name++)
+	{
+		if (strchr(" \t\\'\"", *name))
+			putc('\\', st);
+		putc(*name, st);
+	}
+} /* write_excluded */
+
+/* Lists the demoted functions with the number of their calls omitted,
+ * and writes them to $Auto_list_fname in a form gcc takes with @file.
+ * gcc matches the names in the list as substrings of the names of the
+ * functions it compiles, so a short name excludes every function whose
+ * name contains it, and it splits the list at commas, so the names which
+ * have one (in template arguments) can't be listed. */
+static void report_auto_exclude(void)
+{
+	unsigned i, n, size;
+	struct auto_st *demoted;
+	struct auto_table_st const *autos;
+	FILE *st;
+
+	for (size = 0, autos = __atomic_load_n(&Auto_tables, __ATOMIC_ACQUIRE);
+			autos; autos = autos->next)
+		size += AUTO_SLOTS;
+	if (!(demoted = malloc(sizeof(*demoted) * (size + 1))))
+	{
+		LOGIT("malloc(%zu): %m", sizeof(*demoted) * (size + 1));
+		return;
+	}
+
+	/* Add up the calls of each function in all threads. */
+	for (n = 0, autos = __atomic_load_n(&Auto_tables, __ATOMIC_ACQUIRE);
+			autos; autos = autos->next)
+		for (i = 0; i < AUTO_SLOTS; i++)
+			if (autos->slots[i].demoted)
+				demoted[n++] = autos->slots[i];
+	qsort(demoted, n, sizeof(*demoted), cmpautos);
+	for (size = 0, i = 0; i < n; i++)
+		if (size > 0 && demoted[size-1].addr == demoted[i].addr)
+			demoted[size-1].skipped += demoted[i].skipped;
+		else
+			demoted[size++] = demoted[i];
+	n = size;
+
+	if (n > 0)
+		LOGIT("AUTO-EXCLUDED: %u functions", n);
+	st = NULL;
+	if (Auto_list_fname)
+		st = fopen_output(Auto_list_fname, &Auto_list_file);
+	if (st)
+		fputs("-finstrument-functions-exclude-function-list=", st);
+
+	for (size = 0, i = 0; i < n; i++)
+	{
+		char const *dso, *funame;
+
+		if (addr2name(&dso, &funame, demoted[i].addr, 0) > 0)
+		{
+			char *name;
+
+			LOGIT("%12lu  %s:%s()", demoted[i].skipped, dso, funame);
+			if (!st)
+				continue;
+			name = excluded_name(funame);
+			if (strchr(name, ','))
+				LOGIT("%s can't be excluded by gcc, "
+					"because its name has a comma", name);
+			else
+			{
+				if (size++)
+					putc(',', st);
+				write_excluded(st, name);
+			}
+			if (name != funame)
+				free(name);
+		} else
+			LOGIT("%12lu  %s:[%p]", demoted[i].skipped, dso,
+				demoted[i].addr);
+	}
+
+	if (st)
+	{
+		putc('\n', st);
+		fclose(st);
+	}
+	free(demoted);
+} /* report_auto_exclude */
+/* }}} */
+
+/* Trigger windows {{{ */
+/*
+ * With $TRACY_TRIGGER a thread is only traced while it's in a call of
+ * a function matching the pattern.  Before that nothing is traced, unless
+ * $TRACY_TRIGGER_HISTORY, in which case the last events are kept in the
+ * thread's history ring, and printed when the trigger is entered.
+ */
+/* Returns the FUN_* flags of the function at $addr according to the
+ * patterns of $TRACY_TRIGGER, $TRACY_CHAIN_WITH, $TRACY_CHAIN_WITHOUT and
+ * $TRACY_PRUNE.  The verdict is cached in $Fun_flags.  The $TRACY_*LIBS
+ * and $TRACY_*FUNS filters don't matter. */
+static unsigned fun_flags(void const *addr)
+{
+	unsigned flags;
+	char const *funame;
+	struct addr_st const *entry;
+	struct addr_cache_st const *cache;
+
+	for (cache = __atomic_load_n(&Fun_flags, __ATOMIC_ACQUIRE); cache;
+		cache = cache->prev)
+		if ((entry = find_addr(cache, addr)) != NULL)
+			return entry->verdict;
+
+	flags = 0;
+	funame = NULL;
+	if (addr2name(NULL, &funame, addr, 0) > 0)
+	{
+		if (Trigger && match_eglob(Trigger, funame))
+			flags |= FUN_TRIGGER;
+		if (Chain_with && match_eglob(Chain_with, funame))
+			flags |= FUN_WITH;
+		if (Chain_without && match_eglob(Chain_without, funame))
+			flags |= FUN_WITHOUT;
+		if (Prune && match_eglob(Prune, funame))
+			flags |= FUN_PRUNE;
+	}
+	cache_addr(&Fun_flags, addr, NULL, NULL, NULL, flags);
+	return flags;
+} /* fun_flags */
+
+/* Returns the calling thread's ID without a system call each time. */
+static inline pid_t my_tid(void)
+{
+	if (!My_tid)
+		My_tid = gettid();
+	return My_tid;
+} /* my_tid */
+
+/* Writes $ev wherever the trace goes. */
+static void log_event(struct event_st const *ev)
+{
+	if (Shm)
+		shm_event(ev);
+	else if (Flight)
+		record_event(ev);
+	else if (Buffered)
+		buffer_event(ev);
+	else
+	{
+		char line[512];
+		size_t len;
+
+		len = format_event(line, sizeof(line) - 1, ev, my_tid());
+		line[len++] = '\n';
+		flush_output(line, &len);
+	}
+} /* log_event */
+
+/* Logs $ev unless it's above $TRACY_MINDEPTH or a LEAVE not to be
+ * logged. */
+static void emit_event(struct event_st const *ev)
+{
+	if (ev->depth < get_config()->min_depth)
+		return;
+	if (Entries_only && !ev->is_entry)
+		return;
+	log_event(ev);
+} /* emit_event */
+
+/* Adds $ev to the calling thread's history, overwriting the oldest
+ * event if it's full. */
+static void remember_event(struct event_st const *ev)
+{
+	if (!My_history)
+	{	/* Freed when the thread exits. */
+		if (!(My_history = malloc(sizeof(*ev) * Trigger_history)))
+			return;
+		pthread_setspecific(History_key, My_history);
+	}
+
+	My_history[My_history_head] = *ev;
+	My_history_head = (My_history_head + 1) % Trigger_history;
+	if (My_history_len < Trigger_history)
+		My_history_len++;
+} /* remember_event */
+
+/* Logs and forgets the calling thread's history. */
+static void flush_history(void)
+{
+	unsigned i;
+
+	for (i = My_history_len; i > 0; i--)
+		emit_event(&My_history[(My_history_head + Trigger_history - i)
+			% Trigger_history]);
+	My_history_len = 0;
+} /* flush_history */
+/* }}} */
+
+/* Call chains {{{ */
+/*
+ * A call chain is a path of the call tree from the root to a leaf, ie. a call
+ * which didn't call any traced function.  The chain filters $TRACY_CHAIN_*
+ * decide about whole chains: if a chain matches, every call on it is logged,
+ * so a call is logged if any chain through it matches.  Which one does is
+ * only known when the leaves return, so until then the ENTERs are kept on
+ * the thread's stack of calls, and logged when the first matching leaf is
+ * found under them, with their original time and depth.  A call whose ENTER
+ * has been logged has its LEAVE logged as well.  So the order of the trace
+ * is the same, only the uninteresting chains are missing.
+ *
+ * When only $TRACY_CHAIN_WITH and $TRACY_CHAIN_MIN are set, a call either
+ * makes every chain through it match or it's up to what it calls, so the
+ * ENTERs are logged as soon as they match.  Otherwise the output lags behind
+ * the program by a chain.
+ *
+ * $TRACY_LOG_CALLS needs the same delay: a leaf is logged as a single CALL
+ * when it returns, as it's only known then that it has no children.
+ */
+/* Returns the frame of the call at $depth on the calling thread's stack,
+ * making room for it, or NULL if there's no memory. */
+static struct chain_frame_st *chain_frame(unsigned depth)
+{
+	unsigned size;
+	struct chain_frame_st *chain;
+
+	if (depth < My_chain_size)
+		return &My_chain[depth];
+
+	/* Freed when the thread exits. */
+	for (size = My_chain_size ? 2*My_chain_size : 64; size <= depth; )
+		size *= 2;
+	if (!(chain = realloc(My_chain, sizeof(*chain) * size)))
+		return NULL;
+	pthread_setspecific(Chain_key, chain);
+	My_chain = chain;
+	My_chain_size = size;
+	return &My_chain[depth];
+} /* chain_frame */
+
+/* Starts the stack at $depth, as if the calls above had been logged.
+ * This is where a $TRACY_TRIGGER window starts. */
+static void start_chain(unsigned depth)
+{
+	struct chain_frame_st *frame;
+
+	My_chain_logged = depth;
+	if (depth > 0 && (frame = chain_frame(depth - 1)) != NULL)
+	{
+		frame->with = frame->without = 0;
+		frame->has_children = 1;
+	}
+} /* start_chain */
+
+/* Does the chain ending in $frame at $depth match the filters? */
+static int chain_matches(struct chain_frame_st const *frame, unsigned depth)
+{
+	if (Chain_with && !frame->with)
+		return 0;
+	if (frame->without)
+		return 0;
+	if (depth + 1 < Chain_min)
+		return 0;
+	if (Chain_max && depth + 1 > Chain_max)
+		return 0;
+	return 1;
+} /* chain_matches */
+
+/* Logs the ENTERs of the calls below $depth which haven't been. */
+static void flush_chain(unsigned depth)
+{
+	for (; My_chain_logged < depth; My_chain_logged++)
+		emit_event(&My_chain[My_chain_logged].enter);
+} /* flush_chain */
+
+/* Passes $ev through the chain filters. */
+static void chain_event(struct event_st const *ev)
+{
+	unsigned flags;
+	struct chain_frame_st *frame, *parent;
+
+	if (!(frame = chain_frame(ev->depth)))
+	{	/* Better let it through than lose it. */
+		emit_event(ev);
+		return;
+	}
+
+	if (ev->is_entry)
+	{
+		if (My_chain_logged > ev->depth)
+			/* Only after an omitted LEAVE, just in case. */
+			My_chain_logged = ev->depth;
+
+		flags = Chain_with || Chain_without ? fun_flags(ev->addr) : 0;
+		frame->enter = *ev;
+		frame->with = !!(flags & FUN_WITH);
+		frame->without = !!(flags & FUN_WITHOUT);
+		frame->has_children = 0;
+		if (ev->depth > 0)
+		{
+			parent = &My_chain[ev->depth - 1];
+			parent->has_children = 1;
+			frame->with += parent->with;
+			frame->without += parent->without;
+		}
+
+		if (Chain_eager && chain_matches(frame, ev->depth))
+			flush_chain(ev->depth + 1);
+	} else if (!frame->has_children && My_chain_logged <= ev->depth
+		&& chain_matches(frame, ev->depth))
+	{	/* A matching chain ends here. */
+		flush_chain(ev->depth);
+		if (Log_calls && !Binary && !Shm)
+		{
+			struct event_st call;
+
+			call = frame->enter;
+			call.is_entry = EVENT_CALL;
+			emit_event(&call);
+		} else
+		{
+			emit_event(&frame->enter);
+			emit_event(ev);
+		}
+	} else if (ev->depth < My_chain_logged)
+	{	/* A matching chain went through here. */
+		emit_event(ev);
+		My_chain_logged = ev->depth;
+	}
+} /* chain_event */
+/* }}} */
+
+/* Determines which function the control flow entered/left and prints
+ * the trace message according to $config.  Returns whether it counts in
+ * $Callstack_depth, or -1 if the call and its subtree are not to be
+ * traced. */
+static int print_trace(struct config_st *config, void *addr, int is_entry)
+{
+	struct event_st ev;
+
+	/* Have we reached the limit? */
+	if (config->depth_limited && Callstack_depth >= config->depth_limit)
+		return 1;
+
+	/* $addr is what the compiler passed to us as the address of the
+	 * function, and the address cache is keyed by it.  Only unwind
+	 * the stack if the toolchain is known to lie about it. */
+	if (Use_backtrace)
+	{
+		void *addrs[3];
+
+		/*
+		 * In the frame:
+		 * [0] this function,
+		 * [1] the instrumentation function,
+		 * [2] the function we're interested in.
+		 */
+		if (backtrace(addrs, 3) < 3)
+			return 1;
+		addr = addrs[2];
+	}
+
+	ev.addr = addr;
+	ev.depth = Callstack_depth;
+	ev.is_entry = is_entry;
+	ev.time = Log_time ? read_clock() : 0;
+
+	if (Async)
+	{	/* resolve_backlog() will resolve $addr when we exit. */
+		if (is_entry && !Offline)
+			remember_addr(addr);
+
+		/* The flight recorder doesn't name the functions, but the
+		 * filters apply to it. */
+		if (Flight)
+		{
+			char const *fname, *funame;
+
+			if (resolve(config, &fname, &funame, NULL, addr) < 0)
+				return 0;
+		}
+
+		if (Entries_only && !is_entry && !Chains)
+			return 1;
+		ev.label.str = NULL;
+		ev.label.len = 0;
+	} else
+	{	/* Resolve $addr. */
+		char const *fname, *funame;
+
+		if (resolve(config, &fname, &funame, &ev.label, addr) < 0)
+			/* Omitted from output, don't count it
+			 * in $Callstack_depth. */
+			return 0;
+
+		/* Don't log LEAVE:s if $Entries_only.  The chain filters
+		 * need to know when the calls return though. */
+		if (Entries_only && !is_entry && !Chains)
+			return 1;
+	}
+
+	/* Keep it for later if we're waiting for the trigger. */
+	if (Trigger && !My_trigger)
+	{
+		remember_event(&ev);
+		return 1;
+	}
+
+	/* Is there room for it in the trace? */
+	if (is_entry && Limited && !admit_call(addr))
+		return -1;
+
+	/* Log the damn thing. */
+	if (Chains)
+		chain_event(&ev);
+	else
+		emit_event(&ev);
+
+	/* We've logged something. */
+	return 1;
+} /* print_trace */
+
+/* Remembers whether the call at $Nesting $level counts in the depth. */
+static inline void set_counted(unsigned level, int counted)
+{
+	unsigned long bit;
+
+	if (--level >= COUNTED_LEVELS)
+		return;
+	bit = 1ul << (level % (8 * sizeof(bit)));
+	if (counted)
+		My_counted[level / (8 * sizeof(bit))] |= bit;
+	else
+		My_counted[level / (8 * sizeof(bit))] &= ~bit;
+} /* set_counted */
+
+/* Returns what set_counted() said about $level, or if it's too deep,
+ * whether the depth can be decreased at all. */
+static inline int is_counted(unsigned level)
+{
+	unsigned long bit;
+
+	if (--level >= COUNTED_LEVELS)
+		return Callstack_depth > 0;
+	bit = 1ul << (level % (8 * sizeof(bit)));
+	return !!(My_counted[level / (8 * sizeof(bit))] & bit);
+} /* is_counted */
+
+/* Traces the call of $self, unless it's pruned, sampled out etc. */
+static inline void trace_enter(void *self)
+{
+	int ret;
+	struct config_st *config;
+
+	/* Are we in or starting a subtree not to be traced? */
+	if (My_prune)
+	{
+		Nesting++;
+		return;
+	}
+	config = get_config();
+	if (config->sample_rate > 1 && !My_skip && !sample_tree(config))
+		My_skip = Nesting + 1;
+	Nesting++;
+	set_counted(Nesting, 0);
+	if (My_skip)
+		return;
+
+	/* Is it the beginning of a trigger window? */
+	if (Trigger && !My_trigger)
+	{
+		if (fun_flags(self) & FUN_TRIGGER)
+		{
+			My_trigger = Nesting;
+			if (Trigger_history)
+				flush_history();
+			if (Chains)
+				start_chain(Callstack_depth);
+		} else if (!Trigger_history)
+			return;
+	}
+
+	if ((ret = print_trace(config, self, 1)) > 0)
+	{
+		Callstack_depth++;
+		set_counted(Nesting, 1);
+		if (Prune && (fun_flags(self) & FUN_PRUNE))
+			/* Don't trace what it calls. */
+			My_prune = Nesting;
+	} else if (ret < 0)
+		My_skip = Nesting;
+} /* trace_enter */
+
+/* Traces the return from $self like trace_enter() did the call. */
+static inline void trace_exit(void *self)
+{
+	int ending, counted;
+
+	/* Did the call begin before we were loaded or tracing was turned
+	 * on?  Then we don't know its depth. */
+	if (!Nesting)
+		return;
+	if (My_prune)
+	{	/* Is it the pruned call returning or one of its children? */
+		if (Nesting == My_prune)
+			My_prune = 0;
+		else
+		{
+			Nesting--;
+			return;
+		}
+	}
+	if (My_skip)
+	{	/* Is it the end of the subtree? */
+		if (Nesting <= My_skip)
+			My_skip = 0;
+		if (Nesting == My_trigger)
+			/* The trigger call was refused by admit_call(). */
+			My_trigger = 0;
+		if (Nesting)
+			Nesting--;
+		return;
+	}
+	ending = Nesting == My_trigger;
+	counted = is_counted(Nesting);
+	Nesting--;
+	if (Trigger && !My_trigger && !Trigger_history)
+		return;
+
+	/* Return like the call was made, even if the filters have changed
+	 * since.  The omitted calls are not reported. */
+	if (counted)
+	{
+		Callstack_depth--;
+		if (!print_trace(get_config(), self, 0)
+				&& Nesting >= COUNTED_LEVELS)
+			Callstack_depth++;
+	}
+	if (ending)
+		/* The trigger window is closed. */
+		My_trigger = 0;
+} /* trace_exit */
+
+/* The functions below are invoked automatically by code generated
+ * by the compiler.  These are the entry points of the library. */
+void __cyg_profile_func_enter(void *self, void *callsite)
+{
+	pthread_once(&Init_once, tracy_init);
+	if (!Tracing)
+		return;
+	if (Mode == MODE_PROFILE)
+	{
+		check_dump();
+		profile_enter(self, callsite);
+		return;
+	}
+
+	/* Demoted functions are not even traced. */
+	if (!Auto_exclude)
+		trace_enter(self);
+	else if (auto_enter(self))
+	{
+		trace_enter(self);
+		auto_entered();
+	}
+}
+
+void __cyg_profile_func_exit(void *self, void *callsite)
+{
+	if (!Tracing)
+		return;
+	if (Mode == MODE_PROFILE)
+	{
+		profile_exit(self);
+		check_dump();
+		return;
+	}
+
+	if (!Auto_exclude || auto_exit(self))
+		trace_exit(self);
+}
+/* }}} */
+
+/* Control socket {{{ */
+/*
+ * With $TRACY_CONTROL a thread of ours serves a Unix domain socket, through
+ * which the filters, the depth limits, the sampling and where the text trace
+ * goes can be changed while the program is running.  The clients are served
+ * one at a time.  Each request is applied to a copy of $Config, which is then
+ * published in its place, so the tracing threads only need to load a pointer
+ * to see a consistent configuration.  The old snapshots are never freed,
+ * because the threads may still be using them.  If the filters change, the
+ * new snapshot starts with an empty address cache, since the verdicts of the
+ * old one don't hold.  The trace is redirected by dup3()ing the new file onto
+ * $Trace_fd, so the threads writing the old one don't need to know.
+ */
+/* Returns whether the trace can be redirected with $TRACY_OUTPUT.
+ * Only the text trace, which is written by flush_output(), can. */
+static int can_redirect(void)
+{
+#ifdef CONFIG_GLIB
+	return 0;
+#else
+	return Mode == MODE_TRACE && !Flight && !Async && !Shm;
+#endif
+} /* can_redirect */
+
+/* Parses $value into $*np, which is 0 if it's empty.  Returns whether
+ * it's a number. */
+static int parse_number(char const *value, unsigned *np)
+{
+	char *end;
+	unsigned long n;
+
+	if (value[0] && (value[0] < '0' || value[0] > '9'))
+		return 0;
+	errno = 0;
+	n = strtoul(value, &end, 10);
+	if (*end || errno || n > UINT_MAX)
+		return 0;
+	*np = n;
+	return 1;
+} /* parse_number */
+
+/* Sets the $TRACY_* variable $name to $value in $config, like tracy_init()
+ * does from the environment.  An empty $value unsets it.  Of $TRACY_INLIBS
+ * and $TRACY_EXLIBS whichever is set replaces the DSO filter, and likewise
+ * with the functions.  Returns NULL or why it can't be set. */
+static char const *set_config(struct config_st *config, char const *name,
+	char const *value)
+{
+	unsigned n;
+	char *copy;
+
+	if (!strcmp(name, "TRACY_INLIBS") || !strcmp(name, "TRACY_EXLIBS"))
+	{
+		config->dso_filter = NULL;
+		config->libs = NULL;
+		if (!value[0])
+			return NULL;
+
+		/* The words point into $copy. */
+		if (!(copy = strdup(value))
+			|| !(config->dso_filter = mkwords(copy)))
+		{
+			free(copy);
+			return "out of memory";
+		}
+		config->dso_whitelist = name[6] == 'I';
+		config->libs = copy;
+	} else if (!strcmp(name, "TRACY_INFUNS")
+		|| !strcmp(name, "TRACY_EXFUNS"))
+	{
+		config->fun_filter = NULL;
+		config->funs = NULL;
+		if (!value[0])
+			return NULL;
+
+		if (!(copy = strdup(value))
+			|| !(config->fun_filter = mkglob(copy)))
+		{
+			free(copy);
+			return "out of memory";
+		}
+		config->fun_whitelist = name[6] == 'I';
+		config->funs = copy;
+	} else if (!strcmp(name, "TRACY_OUTPUT"))
+	{	/* apply_control() opens it. */
+		if (!can_redirect())
+			return "only the text trace can be redirected";
+		else if (!value[0])
+			config->output = NULL;
+		else if (!(config->output = strdup(value)))
+			return "out of memory";
+	} else if (strcmp(name, "TRACY_MAXDEPTH")
+		&& strcmp(name, "TRACY_MINDEPTH")
+		&& strcmp(name, "TRACY_SAMPLE")
+		&& strcmp(name, "TRACY_SAMPLE_DEPTH"))
+		return "can't be changed";
+	else if (!parse_number(value, &n))
+		return "not a number";
+	else if (!strcmp(name, "TRACY_MAXDEPTH"))
+	{
+		config->depth_limit = n;
+		config->depth_limited = value[0] != '\0';
+	} else if (!strcmp(name, "TRACY_MINDEPTH"))
+		config->min_depth = n;
+	else if (!strcmp(name, "TRACY_SAMPLE"))
+		config->sample_rate = n;
+	else
+		config->sample_depth = n;
+
+	return NULL;
+} /* set_config */
+
+/* Writes the settings of $config to $fd as a request which would restore
+ * them. */
+static void show_config(int fd, struct config_st const *config)
+{
+	dprintf(fd, "TRACY_%sLIBS=%s\n",
+		config->dso_filter && !config->dso_whitelist ? "EX" : "IN",
+		config->libs ? config->libs : "");
+	dprintf(fd, "TRACY_%sFUNS=%s\n",
+		config->fun_filter && !config->fun_whitelist ? "EX" : "IN",
+		config->funs ? config->funs : "");
+	if (config->depth_limited)
+		dprintf(fd, "TRACY_MAXDEPTH=%u\n", config->depth_limit);
+	else
+		dprintf(fd, "TRACY_MAXDEPTH=\n");
+	dprintf(fd, "TRACY_MINDEPTH=%u\n", config->min_depth);
+	dprintf(fd, "TRACY_SAMPLE=%u\n", config->sample_rate);
+	dprintf(fd, "TRACY_SAMPLE_DEPTH=%u\n", config->sample_depth);
+	if (can_redirect())
+		dprintf(fd, "TRACY_OUTPUT=%s\n",
+			config->output ? config->output : "");
+	dprintf(fd, "%s\n", __atomic_load_n(&Tracing, __ATOMIC_RELAXED)
+		? "start" : "stop");
+} /* show_config */
+
+/* Redirects the text trace to the file named after $output, or to stderr
+ * if it's NULL.  Returns NULL or why it couldn't. */
+static char const *redirect(char const *output)
+{
+	char fname[PATH_MAX];
+	int fd, trace_fd;
+
+	if (!output)
+		fd = STDERR_FILENO;
+	else if ((fd = open(output_fname(fname, output),
+			O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)) < 0)
+		return strerror(errno);
+
+	/* The first time we need a descriptor of our own to replace. */
+	trace_fd = Trace_fd;
+	if (trace_fd == STDERR_FILENO)
+		trace_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	else
+		trace_fd = dup3(fd, trace_fd, O_CLOEXEC);
+	if (fd != STDERR_FILENO)
+		close(fd);
+	if (trace_fd < 0)
+		return strerror(errno);
+
+	__atomic_store_n(&Trace_fd, trace_fd, __ATOMIC_RELAXED);
+	return NULL;
+} /* redirect */
+
+/* Publishes a copy of $config in the place of $current, which it was made
+ * of.  Returns NULL or why it couldn't. */
+static char const *apply_control(struct config_st const *config,
+	struct config_st *current)
+{
+	char const *error;
+	struct config_st *snapshot;
+
+	if (!(snapshot = malloc(sizeof(*snapshot))))
+		return "out of memory";
+	if (config->output != current->output
+		&& (error = redirect(config->output)) != NULL)
+	{
+		free(snapshot);
+		return error;
+	}
+
+	*snapshot = *config;
+	if (config->dso_filter != current->dso_filter
+			|| config->fun_filter != current->fun_filter)
+		snapshot->addr_cache = NULL;
+	else	/* What the threads have found out since is still valid. */
+		snapshot->addr_cache = __atomic_load_n(&current->addr_cache,
+			__ATOMIC_ACQUIRE);
+	__atomic_store_n(&Config, snapshot, __ATOMIC_RELEASE);
+	return NULL;
+} /* apply_control */
+
+/*
+ * Serves the requests of a client on $fd until it hangs up.  A request
+ * is a series of lines ending with an empty one or the end of the input.
+ * The lines are "<NAME>=<value>" assignments for set_config(), "start"
+ * and "stop" to turn tracing on and off, and "show" to have the resulting
+ * settings printed.  Each request is answered with "OK" or an "ERROR:",
+ * in which case nothing in it takes effect.
+ */
+static void serve_control(int fd)
+{
+	FILE *st;
+	char *line, *eq, bad[64];
+	size_t size;
+	ssize_t len;
+	unsigned nlines;
+	char const *error;
+	struct config_st next, *current;
+	int eof, changed, show, tracing;
+
+	/* The replies are written to $fd directly. */
+	if (!(st = fdopen(fd, "r")))
+	{
+		LOGIT("fdopen: %m");
+		close(fd);
+		return;
+	}
+
+	line = NULL;
+	size = 0;
+	nlines = 0;
+	bad[0] = '\0';
+	error = NULL;
+	current = NULL;
+	changed = show = 0;
+	tracing = -1;
+	for (eof = 0; !eof; )
+	{
+		if (!(eof = (len = getline(&line, &size, st)) < 0))
+		{
+			while (len > 0 && (line[len-1] == '\n'
+					|| line[len-1] == '\r'))
+				line[--len] = '\0';
+		}
+
+		if (!eof && line[0])
+		{
+			if (!nlines++)
+			{	/* The first line of a request. */
+				current = get_config();
+				next = *current;
+				error = NULL;
+				changed = show = 0;
+				tracing = -1;
+			}
+
+			if (error)
+				/* Skip the rest of a bad request. */;
+			else if (!strcmp(line, "start"))
+				tracing = 1;
+			else if (!strcmp(line, "stop"))
+				tracing = 0;
+			else if (!strcmp(line, "show"))
+				show = 1;
+			else if (!(eq = strchr(line, '=')))
+				error = "unknown command";
+			else
+			{
+				*eq = '\0';
+				error = set_config(&next, line, eq + 1);
+				changed = 1;
+			}
+			if (error && !bad[0])
+				snprintf(bad, sizeof(bad), "%s", line);
+			continue;
+		} else if (!nlines)
+			/* Nothing to do. */
+			continue;
+		nlines = 0;
+
+		if (!error && changed
+			&& (error = apply_control(&next, current)) != NULL)
+			snprintf(bad, sizeof(bad), "%s",
+				next.output != current->output
+					? "TRACY_OUTPUT" : "TRACY_CONTROL");
+		if (error)
+		{
+			dprintf(fd, "ERROR: %s: %s\n", bad, error);
+			bad[0] = '\0';
+			continue;
+		}
+
+		if (tracing >= 0)
+			__atomic_store_n(&Tracing, tracing, __ATOMIC_RELAXED);
+		if (show)
+			show_config(fd, get_config());
+		dprintf(fd, "OK\n");
+	} /* for */
+
+	free(line);
+	fclose(st);
+} /* serve_control */
+
+/* The body of the thread serving $Control_fd. */
+static void *control_thread(void *unused)
+{
+	int fd;
+	struct ucred cred;
+	socklen_t len;
+
+	for (;;)
+		if ((fd = accept4(Control_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+		{	/* $TRACY_OUTPUT can make us write anywhere we can,
+			 * so don't take requests from anyone else. */
+			len = sizeof(cred);
+			if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)
+					< 0 || cred.uid != geteuid())
+			{
+				dprintf(fd, "ERROR: permission denied\n");
+				close(fd);
+			} else
+				serve_control(fd);
+		} else if (errno != EINTR && errno != ECONNABORTED)
+		{
+			LOGIT("accept: %m");
+			break;
+		}
+	return NULL;
+} /* control_thread */
+
+/* Opens the socket named after $Control_fname and starts serving it. */
+static void start_control(void)
+{
+	pthread_t thread;
+	struct sockaddr_un addr;
+
+	output_fname(Control_path, Control_fname);
+	if (strlen(Control_path) >= sizeof(addr.sun_path))
+	{
+		LOGIT("%s: name too long", Control_path);
+		goto out0;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, Control_path);
+
+	/* A socket left behind by an earlier run would be in the way. */
+	if ((Control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+	{
+		LOGIT("socket: %m");
+		goto out0;
+	}
+	unlink(Control_path);
+
+	/* bind() creates the socket with this mode less the umask, so
+	 * it's private whatever the umask is.  Changing the umask
+	 * instead would affect the other threads too. */
+	if (fchmod(Control_fd, 0600) < 0
+		|| bind(Control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(Control_fd, 4) < 0)
+	{
+		LOGIT("%s: %m", Control_path);
+		goto out1;
+	}
+
+	if ((errno = pthread_create(&thread, NULL, control_thread, NULL))
+			!= 0)
+	{
+		LOGIT("pthread_create: %m");
+		unlink(Control_path);
+		goto out1;
+	}
+	pthread_detach(thread);
+	return;
+
+out1:	close(Control_fd);
+	Control_fd = -1;
+out0:	Control_path[0] = '\0';
+} /* start_control */
+
+/* Removes the socket on exit(). */
+static void stop_control(void)
+{
+	if (Control_path[0])
+		unlink(Control_path);
+} /* stop_control */
+/* }}} */
+
+/* Forking {{{ */
+/*
+ * The child of fork() inherits everything libtracy has, but only the thread
+ * which forked runs in it.  To trace it on its own it needs its own rings,
+ * writer thread, binary trace and backlog, and its profile shouldn't count
+ * the calls of the parent.  What the parent has buffered is written by the
+ * parent.  The locks others can hold while we fork are taken beforehand,
+ * in the order they nest, so that the child doesn't inherit them locked.
+ */
+static void fork_prepare(void)
+{
+	pthread_mutex_lock(&Profile_lock);
+	pthread_mutex_lock(&Registry_lock);
+	pthread_mutex_lock(&Mapped_lock);
+	pthread_mutex_lock(&Output_lock);
+}
+
+static void fork_parent(void)
+{
+	pthread_mutex_unlock(&Output_lock);
+	pthread_mutex_unlock(&Mapped_lock);
+	pthread_mutex_unlock(&Registry_lock);
+	pthread_mutex_unlock(&Profile_lock);
+}
+
+/* Forgets what the parent has counted in $prof, but keeps the calls
+ * in progress, as if they had started now. */
+static void reset_profile(struct profile_st *prof)
+{
+	unsigned i;
+	unsigned long long now;
+	struct cct_node_st *node;
+
+	prof->tid = gettid();
+	prof->next = NULL;
+
+	for (i = 0; i < prof->table->size; i++)
+	{
+		struct prof_fun_st *fun;
+
+		fun = &prof->table->entries[i];
+		fun->calls = fun->total = fun->self = fun->max = 0;
+		fun->maxdepth = 0;
+		if (fun->hist)
+			memset(fun->hist, 0, sizeof(*fun->hist) * HIST_BUCKETS);
+		if (fun->pmu)
+			memset(fun->pmu, 0, sizeof(*fun->pmu) * PMU_MAX);
+	}
+	for (i = 0; prof->edges && i < prof->edges->size; i++)
+	{
+		prof->edges->entries[i].calls = 0;
+		prof->edges->entries[i].total = 0;
+	}
+
+	/* The counters are the parent's. */
+	if (Pmu_count)
+	{
+		unsigned long long pmu[PMU_MAX];
+
+		close_pmu(prof);
+		open_pmu(prof);
+		read_pmu(prof, pmu);
+		for (i = 0; i < prof->depth; i++)
+		{
+			memcpy(prof->stack[i].pmu_start, pmu, sizeof(pmu));
+			memset(prof->stack[i].pmu_children, 0,
+				sizeof(prof->stack[i].pmu_children));
+		}
+	}
+
+	now = read_clock();
+	for (i = 0; i < prof->depth; i++)
+	{
+		prof->stack[i].start = now;
+		prof->stack[i].children = 0;
+	}
+
+	node = &prof->root;
+	for (;;)
+	{
+		node->calls = node->total = node->self = 0;
+		if (node->children)
+		{
+			node = node->children;
+			continue;
+		}
+		while (node != &prof->root && !node->next)
+			node = node->parent;
+		if (node == &prof->root)
+			break;
+		node = node->next;
+	}
+} /* reset_profile */
+
+static void fork_child(void)
+{
+	fork_parent();
+	Descendant = 1;
+	Start_time = time(NULL);
+
+	/* We're a new thread of a new process. */
+	My_tid = 0;
+
+	/* The files we've written so far are the parent's. */
+	free(Folded_file);
+	free(Callgraph_file);
+	free(Auto_list_file);
+	Folded_file = Callgraph_file = Auto_list_file = NULL;
+
+	/* The symbol table will only have the addresses of the child. */
+	Backlog = NULL;
+
+	if (Binary)
+	{
+		close(Output_fd);
+		if (!open_output())
+			Tracing = 0;
+		else if (Offline)
+		{
+			Mapped = NULL;
+			write_maps();
+		}
+	}
+
+	if (Buffered)
+	{	/* The rings of the parent's threads are left for the parent.
+		 * $Writer_running is still set. */
+		Rings = NULL;
+		My_ring = NULL;
+		pthread_setspecific(Ring_key, NULL);
+		if ((errno = pthread_create(&Writer, NULL, writer_thread,
+				NULL)) != 0)
+		{
+			LOGIT("pthread_create: %m");
+			Buffered = 0;
+			if (Binary)
+				Tracing = 0;
+		}
+	}
+
+	if (Flight)
+	{	/* The rings of the parent stay in it like the maps, but
+		 * we'll dump our own events to our own file. */
+		Rings = NULL;
+		My_ring = NULL;
+		pthread_setspecific(Ring_key, NULL);
+		output_fname(Flight_fname, Output_fname);
+	}
+
+	/* We share the $Shm region with the parent, but not the ring. */
+	if (Shm)
+	{
+		My_shm_ring = NULL;
+		pthread_setspecific(Shm_key, NULL);
+	}
+
+	if (My_profile)
+		reset_profile(My_profile);
+	Profiles = My_profile;
+
+	/* Keep what we've demoted, but only report our own calls. */
+	if (My_autos)
+	{
+		unsigned i;
+
+		My_autos->next = NULL;
+		for (i = 0; i < AUTO_SLOTS; i++)
+			My_autos->slots[i].skipped = 0;
+	}
+	Auto_tables = My_autos;
+
+	/* The thread serving $TRACY_CONTROL stayed in the parent,
+	 * start our own with our own socket. */
+	if (Control_fd >= 0)
+	{
+		close(Control_fd);
+		Control_fd = -1;
+		start_control();
+	}
+} /* fork_child */
+/* }}} */
+
+/* Attaching {{{ */
+/*
+ * If we're dlopen()ed into a program which is already running rather than
+ * $LD_PRELOAD:ed, its instrumented code calls the __cyg_profile_func_*() of
+ * libc, which do nothing, because the dynamic linker has bound them to the
+ * first definition it found, and ours came later.  So we point the GOT
+ * entries the DSOs call them through at ours ourselves, and those of dlopen()
+ * and dlclose() too, to catch the DSOs loaded later.  The entries protected
+ * by RELRO are made writable for the time being.  The calls in progress go
+ * to libc, including those of the other threads while we're at it, so some
+ * returns have no calls, which trace_exit() and profile_exit() skip.
+ */
+/* Our own hooks.  The aliases are not interposable, so they're ours
+ * even if the global definitions are someone else's. */
+extern __typeof__(__cyg_profile_func_enter) our_func_enter
+	__attribute__((alias("__cyg_profile_func_enter"), visibility("hidden")));
+extern __typeof__(__cyg_profile_func_exit) our_func_exit
+	__attribute__((alias("__cyg_profile_func_exit"), visibility("hidden")));
+extern __typeof__(dlopen) our_dlopen
+	__attribute__((alias("dlopen"), visibility("hidden"), nothrow));
+extern __typeof__(dlclose) our_dlclose
+	__attribute__((alias("dlclose"), visibility("hidden"), nothrow));
+
+static struct hook_st const Hooks[] =
+{
+	{ "__cyg_profile_func_enter",	(void *)our_func_enter	},
+	{ "__cyg_profile_func_exit",	(void *)our_func_exit	},
+	{ "dlopen",			(void *)our_dlopen	},
+	{ "dlclose",			(void *)our_dlclose	},
+};
+
+/* Stores $addr in the GOT entry at $slot, which is read-only if it's
+ * between $relro and $relro_end. */
+static void set_slot(void **slot, void *addr, Elf_Addr relro,
+	Elf_Addr relro_end)
+{
+	void *page;
+	long pagesize;
+
+	if (*slot == addr)
+		return;
+	if ((Elf_Addr)slot < relro || (Elf_Addr)slot >= relro_end)
+	{
+		__atomic_store_n(slot, addr, __ATOMIC_RELAXED);
+		return;
+	}
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	page = (void *)((Elf_Addr)slot & -pagesize);
+	if (mprotect(page, pagesize, PROT_READ | PROT_WRITE) < 0)
+	{
+		LOGIT("mprotect: %m");
+		return;
+	}
+	__atomic_store_n(slot, addr, __ATOMIC_RELAXED);
+	mprotect(page, pagesize, PROT_READ);
+} /* set_slot */
+
+/* Points the relocations of the DSO described by $info which refer to
+ * the $Hooks defined elsewhere at ours.  Called through dl_iterate_phdr()
+ * with the dynamic linker's lock held, so the DSOs stay and we don't race
+ * with ourselves. */
+static int attach_dso(struct dl_phdr_info *info, size_t size, void *unused)
+{
+	unsigned i, j;
+	Elf_Dyn const *dyn;
+	Elf_Addr bias, relro, relro_end;
+	char const *strtab;
+	Elf_Sym const *symtab;
+	size_t strsz;
+	int pltrel;
+	struct
+	{
+		char const *start;
+		size_t size, entsize;
+	} rels[3];
+
+	/* Find the dynamic section and the RELRO segment, which the dynamic
+	 * linker has made read-only up to the last whole page.  Don't
+	 * patch ourselves. */
+	bias = info->dlpi_addr;
+	dyn = NULL;
+	relro = relro_end = 0;
+	for (i = 0; i < info->dlpi_phnum; i++)
+	{
+		Elf_Phdr const *phdr;
+
+		phdr = &info->dlpi_phdr[i];
+		if (phdr->p_type == PT_DYNAMIC)
+			dyn = (Elf_Dyn const *)(bias + phdr->p_vaddr);
+		else if (phdr->p_type == PT_GNU_RELRO)
+		{
+			relro = bias + phdr->p_vaddr;
+			relro_end = (relro + phdr->p_memsz)
+				& -(Elf_Addr)sysconf(_SC_PAGESIZE);
+		} else if (phdr->p_type == PT_LOAD
+			&& (Elf_Addr)attach_dso - bias - phdr->p_vaddr
+				< phdr->p_memsz)
+			return 0;
+	}
+	if (!dyn)
+		return 0;
+
+	/* Like in getdynsym(), the addresses may have been relocated. */
+#define DYNPTR(ptr)	(void const *)((ptr) < bias ? (ptr) + bias : (ptr))
+	strtab = NULL;
+	symtab = NULL;
+	strsz = 0;
+	pltrel = DT_REL;
+	memset(rels, 0, sizeof(rels));
+	for (; dyn->d_tag != DT_NULL; dyn++)
+		switch (dyn->d_tag)
+		{
+		case DT_STRTAB:
+			strtab = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		case DT_STRSZ:
+			strsz = dyn->d_un.d_val;
+			break;
+		case DT_SYMTAB:
+			symtab = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		case DT_REL:
+			rels[0].start = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		case DT_RELSZ:
+			rels[0].size = dyn->d_un.d_val;
+			break;
+		case DT_RELA:
+			rels[1].start = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		case DT_RELASZ:
+			rels[1].size = dyn->d_un.d_val;
+			break;
+		case DT_JMPREL:
+			rels[2].start = DYNPTR(dyn->d_un.d_ptr);
+			break;
+		case DT_PLTRELSZ:
+			rels[2].size = dyn->d_un.d_val;
+			break;
+		case DT_PLTREL:
+			pltrel = dyn->d_un.d_val;
+			break;
+		}
+#undef DYNPTR
+	if (!strtab || !symtab)
+		return 0;
+	rels[0].entsize = sizeof(Elf_Rel);
+	rels[1].entsize = sizeof(Elf_Rela);
+	rels[2].entsize = pltrel == DT_RELA ? sizeof(Elf_Rela)
+		: sizeof(Elf_Rel);
+
+	/* Whatever the type of the relocations of the $Hooks are, in the GOT
+	 * or not, they're the address of the function.  An Elf_Rela starts
+	 * like an Elf_Rel. */
+	for (i = 0; i < sizeof(rels) / sizeof(rels[0]); i++)
+	{
+		char const *p;
+
+		if (!rels[i].start)
+			continue;
+		for (p = rels[i].start; p + rels[i].entsize
+			<= rels[i].start + rels[i].size; p += rels[i].entsize)
+		{
+			Elf_Rel const *rel;
+			Elf_Sym const *sym;
+
+			rel = (Elf_Rel const *)p;
+			if (!ELF_R_SYM(rel->r_info))
+				continue;
+			sym = &symtab[ELF_R_SYM(rel->r_info)];
+			if (sym->st_shndx != SHN_UNDEF || sym->st_name >= strsz)
+				continue;
+
+			for (j = 0; j < sizeof(Hooks) / sizeof(Hooks[0]); j++)
+				if (!strcmp(&strtab[sym->st_name],
+					Hooks[j].name))
+				{
+					set_slot((void **)(bias + rel->r_offset),
+						Hooks[j].addr, relro,
+						relro_end);
+					break;
+				}
+		} /* for each relocation */
+	} /* for each table */
+
+	return 0;
+} /* attach_dso */
+
+/* Makes all the DSOs loaded call our $Hooks. */
+static void attach_dsos(void)
+{
+	dl_iterate_phdr(attach_dso, NULL);
+} /* attach_dsos */
+/* }}} */
+
+/* Initialization {{{ */
+static void toggle_tracing(int signum)
+{
+	Tracing = !Tracing;
+}
+
+/* Leaves it to the next instrumented function to call dump_profile(),
+ * which is not async-signal-safe. */
+static void request_dump(int signum)
+{
+	__atomic_store_n(&Dump_requested, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reads the $TRACY_* environment, then starts tracing or installs a signal
+ * handler to start it later.  The configuration is only read here, so the
+ * tracing threads don't need to synchronize on it, except for the $Config
+ * $TRACY_CONTROL can replace.  Instrumented code may run before our
+ * constructor, so __cyg_profile_func_enter() makes sure this function has
+ * been called, but only once.  If we're dlopen()ed into a running program,
+ * our constructor calls it, and it makes the program call us, see
+ * attach_dso().
+ */
+static void tracy_init(void)
+{
+	char const *env;
+	struct config_st *config = &Env_config;
+
+	if ((env = getenv("TRACY_INLIBS"))
+		&& (config->dso_filter = mkwords(env)))
+		config->dso_whitelist = 1;
+	else if ((env = getenv("TRACY_EXLIBS"))
+		&& (config->dso_filter = mkwords(env)))
+		config->dso_whitelist = 0;
+	if (config->dso_filter)
+		config->libs = env;
+
+	if ((env = getenv("TRACY_INFUNS")) && env[0])
+	{
+		if ((config->fun_filter = mkglob(env)) != NULL)
+			config->fun_whitelist = 1;
+	} else if ((env = getenv("TRACY_EXFUNS")) && env[0])
+	{
+		if ((config->fun_filter = mkglob(env)) != NULL)
+			config->fun_whitelist = 0;
+	}
+	if (config->fun_filter)
+		config->funs = env;
+
+	if ((env = getenv("TRACY_MAXDEPTH")) && env[0])
+	{
+		config->depth_limit = atoi(env);
+		config->depth_limited = 1;
+	}
+
+	Entries_only = (env = getenv("TRACY_LOG_ENTRIES_ONLY")) && env[0]=='1';
+	Indent = (env = getenv("TRACY_LOG_INDENT")) ? atoi(env) : 0;
+	Log_fname = (env = getenv("TRACY_LOG_FNAME")) ? env[0] == '1' : 1;
+	Log_time = (env = getenv("TRACY_LOG_TIME")) && env[0] == '1';
+	Log_tid  = (env = getenv("TRACY_LOG_TID"))  && env[0] == '1';
+
+	if (!(env = getenv("TRACY_CLOCK")) || !strcmp(env, "monotonic"))
+		Clock = CLOCK_MONOTONIC;
+	else if (!strcmp(env, "realtime"))
+		Clock = CLOCK_REALTIME;
+#ifdef HAVE_TSC
+	else if (!strcmp(env, "tsc"))
+		Clock = CLOCK_TSC;
+#endif
+	else
+	{
+		LOGIT("couldn't understand $TRACY_CLOCK=%s", env);
+		Clock = CLOCK_MONOTONIC;
+	}
+	if ((env = getenv("TRACY_MODE")) && !strcmp(env, "profile"))
+		Mode = MODE_PROFILE;
+	else if (env && !strcmp(env, "flight"))
+		Flight = 1;
+	else if (env && env[0] && strcmp(env, "trace"))
+		LOGIT("couldn't understand $TRACY_MODE=%s", env);
+
+	/* Bound the volume of the trace. */
+	if (Mode == MODE_TRACE)
+	{
+		if ((env = getenv("TRACY_SAMPLE")) && atoi(env) > 1)
+			config->sample_rate = atoi(env);
+		if ((env = getenv("TRACY_SAMPLE_DEPTH")))
+			config->sample_depth = atoi(env);
+		if ((env = getenv("TRACY_FUN_RATE")) && atoi(env) > 0)
+			Fun_rate = atoi(env);
+		if ((env = getenv("TRACY_BUDGET")) && atoi(env) > 0)
+		{	/* Let the threads take 1/64 of it at once. */
+			Budget = atoi(env);
+			Budget_batch = Budget / 64;
+			if (Budget_batch < 1)
+				Budget_batch = 1;
+			else if (Budget_batch > 64)
+				Budget_batch = 64;
+		}
+		if (Fun_rate && (errno = pthread_key_create(&Rate_key, free))
+				!= 0)
+		{
+			LOGIT("pthread_key_create: %m");
+			Fun_rate = 0;
+		}
+		Limited = Fun_rate || Budget;
+
+		if ((env = getenv("TRACY_TRIGGER")) && env[0])
+			Trigger = mkglob(env);
+		if (Trigger && (env = getenv("TRACY_TRIGGER_HISTORY"))
+			&& atoi(env) > 0)
+		{
+			Trigger_history = atoi(env);
+			if ((errno = pthread_key_create(&History_key, free))
+					!= 0)
+			{
+				LOGIT("pthread_key_create: %m");
+				Trigger_history = 0;
+			}
+		}
+
+		/* Filter the call chains. */
+		if ((env = getenv("TRACY_CHAIN_WITH")) && env[0])
+			Chain_with = mkglob(env);
+		if ((env = getenv("TRACY_CHAIN_WITHOUT")) && env[0])
+			Chain_without = mkglob(env);
+		if ((env = getenv("TRACY_CHAIN_MIN")) && atoi(env) > 0)
+			Chain_min = atoi(env);
+		if ((env = getenv("TRACY_CHAIN_MAX")) && atoi(env) > 0)
+			Chain_max = atoi(env);
+		Log_calls = (env = getenv("TRACY_LOG_CALLS")) && env[0] == '1';
+		Chains = Chain_with || Chain_without || Chain_min || Chain_max
+			|| Log_calls;
+		Chain_eager = !Chain_without && !Chain_max && !Log_calls;
+		if (Chains && (errno = pthread_key_create(&Chain_key, free))
+				!= 0)
+		{
+			LOGIT("pthread_key_create: %m");
+			Chains = 0;
+		}
+
+		if ((env = getenv("TRACY_MINDEPTH")) && atoi(env) > 0)
+			config->min_depth = atoi(env);
+		if ((env = getenv("TRACY_PRUNE")) && env[0])
+			Prune = mkglob(env);
+
+		/* Demote the tiny functions called all the time.
+		 * $Auto_exclude is converted to ticks below. */
+		if ((env = getenv("TRACY_AUTO_EXCLUDE")) && atoi(env) > 0)
+		{
+			Auto_exclude = atoi(env);
+			if (!(env = getenv("TRACY_AUTO_EXCLUDE_RATE"))
+					|| (Auto_rate = atoi(env)) <= 0)
+				Auto_rate = 100000;
+			if ((env = getenv("TRACY_AUTO_EXCLUDE_LIST")) && env[0])
+				Auto_list_fname = env;
+			atexit(report_auto_exclude);
+		}
+	}
+
+	if (Log_time || Mode == MODE_PROFILE || Fun_rate || Budget
+			|| Auto_exclude)
+	{	/* The limits are in clock ticks. */
+		calibrate_clock();
+		Second_ticks = 1000000000 / Clock_ns_per_tick;
+		if (Auto_exclude && !(Auto_exclude /= Clock_ns_per_tick))
+			Auto_exclude = 1;
+	}
+	Use_backtrace = (env = getenv("TRACY_BACKTRACE")) && env[0] == '1';
+
+	Ring_size = (env = getenv("TRACY_RING_SIZE")) ? atoi(env) : 0;
+	if (Ring_size < 2)
+		Ring_size = 64 * 1024;
+	while (Ring_size & (Ring_size - 1))
+		/* Round it down to a power of two. */
+		Ring_size &= Ring_size - 1;
+
+	/* Are we executed by a traced program?  Then its output files
+	 * are not ours to overwrite. */
+	Start_time = time(NULL);
+	if (getenv("TRACY_OUTPUT_OWNER"))
+		Descendant = 1;
+
+	/* Write the events into the $TRACY_SHM region instead of anywhere
+	 * else.  Register finish_shm() before resolve_backlog() to have it
+	 * called after the symbol table has been written. */
+	if (Mode == MODE_TRACE && !Flight
+		&& (env = getenv("TRACY_SHM")) && env[0])
+	{
+		char name[PATH_MAX];
+		int nrings;
+
+		output_fname(name, env);
+		if (!(env = getenv("TRACY_SHM_THREADS"))
+				|| (nrings = atoi(env)) <= 0)
+			nrings = 32;
+		if ((errno = pthread_key_create(&Shm_key, release_shm_ring))
+				!= 0)
+			LOGIT("pthread_key_create: %m");
+		else if (open_shm(name, nrings))
+			atexit(finish_shm);
+	} /* TRACY_SHM */
+
+	/* In async mode the addresses the program encounters on function
+	 * call enters are collected by remember_addr() and resolved on exit
+	 * by resolve_backlog(). */
+	if (Mode == MODE_TRACE && !Flight && (env = getenv("TRACY_ASYNC"))
+		&& (env[0] == '1' || !strcmp(env, "binary")))
+	{
+		if (env[0] != '1' && !Shm)
+		{	/* Write the binary trace to $TRACY_OUTPUT. */
+			if (!(Output_fname = getenv("TRACY_OUTPUT"))
+					|| !Output_fname[0])
+				Output_fname = "tracy.bin";
+			Binary = open_output();
+		}
 
-	/* Sanity checking. */
-	if (!strsec || !symsec)
-		return 0;
-	if (symsec->sh_entsize != sizeof(Elf_Sym))
-		return 0;
+		Async = 1;
+		atexit(resolve_backlog);
 
-	/* All is well, fill $dso. */
-	dso->strtab = file + strsec->sh_offset;
-	dso->strend = (void const *)dso->strtab + strsec->sh_size;
-	dso->symtab = file + symsec->sh_offset;
-	dso->symend = (void const *)dso->symtab + symsec->sh_size;
+		Offline = (env = getenv("TRACY_OFFLINE")) && env[0] == '1';
+		if (Offline)
+			write_maps();
+	} /* TRACY_ASYNC */
 
-	return 1;
-} /* getelf */
+	/* Start the writer thread in buffered mode, which the binary output
+	 * is written in as well.  Register stop_writer() after
+	 * resolve_backlog() to have it called earlier. */
+	if (Mode == MODE_TRACE && !Shm && !Flight && (Binary
+		|| ((env = getenv("TRACY_BUFFERED")) && env[0] == '1')))
+	{
+		Ring_block = (env = getenv("TRACY_OVERFLOW"))
+			&& !strcmp(env, "block");
 
-/* Fills $dso with information from $fname. */
-static int getdso(struct dso_st *dso, char const *fname,
-	int *hfilep, void const **filep, off_t *fsizep)
-{
-	int hfile;
-	struct stat sbuf;
-	void const *file;
+		Writer_running = 1;
+		if ((errno = pthread_key_create(&Ring_key, release_ring)) != 0)
+			LOGIT("pthread_key_create: %m");
+		else if ((errno = pthread_create(&Writer, NULL,
+				writer_thread, NULL)) != 0)
+			LOGIT("pthread_create: %m");
+		else
+		{
+			Buffered = 1;
+			atexit(stop_writer);
+		}
 
-	/* mmap() $fname and process its ELF headers.  If it cannot be found
-	 * and $fname is relative assume this is the executable itself and
-	 * open it from /proc.  Seems $fname is argv[0] these cases. */
-	if ((hfile = open(fname, O_RDONLY)) < 0 && (fname[0] == '/'
-			|| (hfile = open("/proc/self/exe", O_RDONLY)) < 0))
-		goto out0;
-	else if (fstat(hfile, &sbuf) < 0)
-		goto out1;
-	else if ((file = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED,
-			hfile, 0)) == MAP_FAILED)
-		goto out1;
-	else if (!getelf(dso, file))
-		goto out2;
+		if (!Buffered && Binary)
+		{	/* Fall back to text. */
+			Binary = 0;
+			close(Output_fd);
+		}
+	} /* TRACY_BUFFERED */
 
-	/* Also return $hfile etc. to allow the caller to munmap() it. */
-	dso->fname = fname;
-	*hfilep    = hfile;
-	*filep     = file;
-	*fsizep    = sbuf.st_size;
+	/* In flight recorder mode the events are recorded in the rings like
+	 * in buffered mode, but only written when something calls
+	 * dump_flight().  Nothing is resolved, the dump has the load map
+	 * like offline traces. */
+	if (Flight)
+	{
+		if (!(Output_fname = getenv("TRACY_OUTPUT"))
+				|| !Output_fname[0])
+			Output_fname = "tracy.bin";
+		if ((errno = pthread_key_create(&Ring_key, release_ring)) != 0)
+		{
+			LOGIT("pthread_key_create: %m");
+			Tracing = 0;
+		} else
+		{
+			Async = Offline = 1;
+			write_maps();
+			start_flight();
+		}
+	} /* TRACY_MODE=flight */
 
-	return 1;
+	/* The profile is printed at exit and when $TRACY_DUMP_SIGNAL
+	 * is caught. */
+	if (Mode == MODE_PROFILE)
+	{
+		if ((env = getenv("TRACY_FOLDED")) && env[0])
+			Folded_fname = env;
+		if ((env = getenv("TRACY_CALLGRAPH")) && env[0])
+			Callgraph_fname = env;
+		if ((env = getenv("TRACY_PMU")) && env[0]
+			&& (Pmu_count = mkpmu(env)) > 0
+			&& (errno = pthread_key_create(&Pmu_key, close_pmu))
+				!= 0)
+		{
+			LOGIT("pthread_key_create: %m");
+			Pmu_count = 0;
+		}
+		Folded_counts = (env = getenv("TRACY_FOLDED_COUNTS"))
+			&& env[0] == '1';
+		atexit(dump_profile);
+	}
 
-	/* Clean up */
-out2:	munmap((void *)file, sbuf.st_size);
-out1:	close(hfile);
-out0:	return 0;
-} /* getdso */
+	if ((Mode == MODE_PROFILE || Flight)
+		&& (env = getenv("TRACY_DUMP_SIGNAL")) && env[0])
+	{
+		int signum;
 
-/* Report decisions {{{ */
-/* These routines belong to an upper layer, but performance justified
- * their presence here. */
-/* Returns the basename of $fname if calls to it are to be reported. */
-static char const *report_dso(char const *fname)
-{
-	static int report_all = 0;
-	static struct word_st const *flist = NULL;
-	static int is_whitelist;
-	char const *base;
+		if (env[0] == 'y' || env[0] == 'Y')
+			signum = SIGUSR1;
+		else if ((signum = atoi(env)) <= 0)
+			LOGIT("couldn't understand "
+				"$TRACY_DUMP_SIGNAL=%s", env);
+		if (signum > 0)
+			signal(signum, Flight ? flight_signal : request_dump);
+	}
 
-	/* Read the environment if we haven't. */
-	if (!report_all && !flist)
+	/* Write the text trace to $TRACY_OUTPUT rather than stderr, like
+	 * $TRACY_CONTROL can. */
+	if (can_redirect() && (env = getenv("TRACY_OUTPUT")) && env[0])
 	{
-		char const *env;
+		char const *error;
 
-		if      ((env=getenv("TRACY_INLIBS")) && (flist=mkwords(env)))
-			is_whitelist = 1;
-		else if ((env=getenv("TRACY_EXLIBS")) && (flist=mkwords(env)))
-			is_whitelist = 0;
+		if (!(error = redirect(env)))
+			config->output = env;
 		else
-			report_all = 1;
+			LOGIT("%s: %s", env, error);
 	}
 
-	/* Match against $flist if we have one. */
-	if (!report_all)
+	/* Let the children of fork() trace on their own, and the programs
+	 * we execute know which output files are ours. */
+	if ((errno = pthread_atfork(fork_prepare, fork_parent, fork_child))
+			!= 0)
+		LOGIT("pthread_atfork: %m");
+	if (Binary || Shm || Folded_fname || Callgraph_fname || Flight
+		|| config->output
+		|| ((env = getenv("TRACY_CONTROL")) && env[0]))
 	{
-		if ((base = match_words(flist, fname)) != NULL)
-			return is_whitelist ? base : NULL;
-		else if (is_whitelist)
-			return NULL;
+		char pid[16];
+
+		sprintf(pid, "%d", getpid());
+		setenv("TRACY_OUTPUT_OWNER", pid, 1);
 	}
 
-	/* Return the basename of $fname. */
-	return (!(base = strrchr(fname, '/'))) ? fname : base + 1;
-} /* report_dso */
+	/* Let the configuration be changed while we're running.  The names
+	 * of the sockets are like those of the output files. */
+	if ((env = getenv("TRACY_CONTROL")) && env[0])
+	{
+		Control_fname = env;
+		start_control();
+		atexit(stop_control);
+	}
 
-/* Returns whether to report a call to $funame.  If $funame is NULL,
- * returns 0 if there's whitelisting. */
-static int report_function(char const *funame)
-{
-	static int report_all = 0;
-	static char const *pattern = NULL;
-	static int is_whitelist;
+	env = getenv("TRACY_SIGNAL");
+	if (env)
+	{
+		int signum;
+
+		if (env[0] == 'y' || env[0] == 'Y')
+			signum = SIGPROF;
+		else if ((signum = atoi(env)) <= 0)
+			LOGIT("couldn't understand $TRACY_SIGNAL=%s", env);
+		signal(signum, toggle_tracing);
+		Tracing = 0;
+	}
 
-	/* Read the environment if we haven't. */
-	if (!report_all && !pattern)
+	/* If we've been dlopen()ed into the program nothing calls us
+	 * until we make it. */
+	if (dlsym(RTLD_DEFAULT, "__cyg_profile_func_enter")
+		!= (void *)our_func_enter)
 	{
-		if      ((pattern = getenv("TRACY_INFUNS")) && pattern[0])
-			is_whitelist = 1;
-		else if ((pattern = getenv("TRACY_EXFUNS")) && pattern[0])
-			is_whitelist = 0;
-		else
-			report_all = 1;
+		Attached = 1;
+		attach_dsos();
 	}
+} /* tracy_init */
 
-	if (report_all)
-		return 1;
-	else if (funame && match_eglob(pattern, funame))
-		return  is_whitelist;
-	else
-		return !is_whitelist;
-} /* report_function */
+static __attribute__((constructor))
+void tracy_ctor(void)
+{
+	pthread_once(&Init_once, tracy_init);
+}
 /* }}} */
 
+/* Launcher {{{ */
+#ifdef CONFIG_INTERP
 /*
- * Sets $funamep to the name of the function $addr is contained within.
- * If $fnamep is not NULL sets it to the name of the DSO where function
- * is defined.  Returns 1 if everything is OK, 0 if the name was not
- * found, or -1 if it is not to be reported.
+ * Compiled with -DCONFIG_INTERP="<the dynamic linker>" and linked with
+ * -Wl,-e,tracy_main, libtracy.so is a program too, which does what `tracy'
+ * does without having to look for the library: it sets $TRACY_* from the
+ * command line and executes the program to trace with itself $LD_PRELOAD:ed,
+ * or with -attach it loads itself into a running process.  It can't be
+ * a PIE, because the dynamic linker doesn't load those as libraries, so it's
+ * a shared object with an .interp and an entry point.  When it's executed
+ * libc is initialized, but our constructor is not called, and there's no
+ * main() to be passed the command line, so it's read from /proc.
  */
-static int addr2name(char const **fnamep, char const **funamep,
-	void const *addr)
+static char const Interp[] __attribute__((section(".interp"), used))
+	= CONFIG_INTERP;
+
+/* The options of `tracy'. */
+static struct launcher_opt_st const Launcher_options[] =
 {
-	static struct dso_st *seen;
-	Dl_info info;
-	char const *fname;
-	struct dso_st *dso;
+	{ "-lib",	"<libraries>",	{ "TRACY_INLIBS", "TRACY_EXLIBS=" } },
+	{ "-nolib",	"<libraries>",	{ "TRACY_INLIBS=", "TRACY_EXLIBS" } },
+	{ "-fun",	"<functions>",	{ "TRACY_INFUNS", "TRACY_EXFUNS=" } },
+	{ "-nofun",	"<functions>",	{ "TRACY_INFUNS=", "TRACY_EXFUNS" } },
+	{ "-depth",	"<depth>",	{ "TRACY_MAXDEPTH" } },
+	{ "-sample",	"<n>",		{ "TRACY_SAMPLE" } },
+	{ "-rate",	"<calls>",	{ "TRACY_FUN_RATE" } },
+	{ "-budget",	"<events>",	{ "TRACY_BUDGET" } },
+	{ "-auto",	"<ns>",		{ "TRACY_AUTO_EXCLUDE" } },
+	{ "-trigger",	"<functions>",	{ "TRACY_TRIGGER" } },
+	{ "-with",	"<functions>",	{ "TRACY_CHAIN_WITH" } },
+	{ "-without",	"<functions>",	{ "TRACY_CHAIN_WITHOUT" } },
+	{ "-minchain",	"<n>",		{ "TRACY_CHAIN_MIN" } },
+	{ "-maxchain",	"<n>",		{ "TRACY_CHAIN_MAX" } },
+	{ "-mindepth",	"<depth>",	{ "TRACY_MINDEPTH" } },
+	{ "-prune",	"<functions>",	{ "TRACY_PRUNE" } },
+	{ "-calls",	NULL,		{ "TRACY_LOG_CALLS=1" } },
+	{ "-wait",	NULL,		{ "TRACY_SIGNAL=y" } },
+	{ "-control",	"<socket>",	{ "TRACY_CONTROL" } },
+	{ "-output",	"<file>",	{ "TRACY_OUTPUT" } },
+	{ "-quick",	NULL,		{ "TRACY_ASYNC=1" } },
+	{ "-buffered",	NULL,		{ "TRACY_BUFFERED=1" } },
+	{ "-backtrace",	NULL,		{ "TRACY_BACKTRACE=1" } },
+	{ "-binary",	"<file>",	{ "TRACY_ASYNC=binary",
+					  "TRACY_OUTPUT" } },
+	{ "-offline",	NULL,		{ "TRACY_OFFLINE=1" } },
+	{ "-shm",	"<region>",	{ "TRACY_SHM" } },
+	{ "-flight",	"<file>",	{ "TRACY_MODE=flight",
+					  "TRACY_DUMP_SIGNAL=y",
+					  "TRACY_OUTPUT" } },
+	{ "-profile",	NULL,		{ "TRACY_MODE=profile",
+					  "TRACY_DUMP_SIGNAL=y" } },
+	{ "-folded",	"<file>",	{ "TRACY_MODE=profile",
+					  "TRACY_DUMP_SIGNAL=y",
+					  "TRACY_FOLDED" } },
+	{ "-callgraph",	"<file>",	{ "TRACY_MODE=profile",
+					  "TRACY_DUMP_SIGNAL=y",
+					  "TRACY_CALLGRAPH" } },
+	{ "-pmu",	"<counters>",	{ "TRACY_MODE=profile",
+					  "TRACY_DUMP_SIGNAL=y",
+					  "TRACY_PMU" } },
+	{ "-time",	NULL,		{ "TRACY_LOG_TIME=1" } },
+	{ "-clock",	"<clock>",	{ "TRACY_CLOCK" } },
+	{ "-pid",	NULL,		{ "TRACY_LOG_TID=1" } },
+	{ "-nofname",	NULL,		{ "TRACY_LOG_FNAME=0" } },
+	{ "-xmas",	NULL,		{ "TRACY_LOG_ENTRIES_ONLY=1",
+					  "TRACY_LOG_INDENT=1" } },
+};
 
-	/* Find the file that defined the function of $addr. */
-	if (fnamep)
-		*fnamep = "[???]";
-	if (!dladdr(addr, &info))
-		/* We're in trouble, don't do anything. */
-		return report_function(NULL) ? 0 : -1;
-	if (!info.dli_fname)
-		/* Should not happen either. */
-		return report_function(NULL) ? 0 : -1;
+#define NLAUNCHER_OPTIONS \
+	(sizeof(Launcher_options) / sizeof(Launcher_options[0]))
 
-	/* Check whether calls to this DSO is to be reported here
-	 * to avoid opening it unnecessarily. */
-	if (!(fname = report_dso(info.dli_fname)))
-		return -1;
-	if (fnamep)
-		*fnamep = fname;
+/* Prints the usage of the launcher, called $me, like `tracy' and exits. */
+static void __attribute__((noreturn)) launcher_usage(char const *me)
+{
+	unsigned i, col;
 
-	if (info.dli_sname)
+	printf("usage: %s [<options>] <prog> [<args>]...\n"
+		"       %s [<options>] -attach <pid>\n"
+		"options:", me, me);
+	col = 8;
+	for (i = 0; i < NLAUNCHER_OPTIONS; i++)
 	{
-		/* dladdr() managed to do the hard work for us. */
-		*funamep = info.dli_sname;
-		return report_function(*funamep) ? 1 : -1;
-	} else if (info.dli_saddr)
-		/* info.dli_addr may be more accurate than $addr. */
-		addr = info.dli_saddr;
+		struct launcher_opt_st const *opt;
+		unsigned len;
 
-	/* It is up to us to find out the function name from info.dli_fname.
-	 * First we need to get contextual information we cache in $seen. */
-	for (dso = seen; ; dso = dso->next)
-	{
-		if (dso == NULL)
+		opt = &Launcher_options[i];
+		len = 3 + strlen(opt->name);
+		if (opt->arg)
+			len += 1 + strlen(opt->arg);
+		if (col + len > 78)
 		{
-			int hfile;
-			off_t fsize;
-			void const *file;
-			struct dso_st newdso;
+			printf("\n\t");
+			col = 8;
+		}
+		col += printf(" [%s%s%s]", opt->name, opt->arg ? " " : "",
+			opt->arg ? opt->arg : "");
+	}
+	printf("\n");
+	exit(0);
+} /* launcher_usage */
 
-			/* Never saw this DSO before, let's meet.
-			 * TODO I think .dli_fname becomes incorrect
-			 * if the program chdir()ed elsewhere. */
-			if (!getdso(&newdso, info.dli_fname,
-					&hfile, &file, &fsize))
-				return report_function(NULL) ? 0 : -1;
-			*funamep = getsym(&newdso, info.dli_fbase, addr);
+/* Returns our command line read from /proc, and the number of arguments
+ * in $*argcp, or NULL. */
+static char **read_cmdline(int *argcp)
+{
+	int fd, argc;
+	char *buf, *p, **argv;
+	size_t size, len;
+	ssize_t n;
 
-			/* Try to remember it. */
-			if ((dso = malloc(sizeof(*dso))) != NULL)
+	if ((fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	buf = NULL;
+	size = len = 0;
+	do
+	{
+		if (len + 1 >= size)
+		{
+			size = size ? 2 * size : 4096;
+			if (!(p = realloc(buf, size)))
 			{
-				memcpy(dso, &newdso, sizeof(*dso));
-				dso->next = seen;
-				seen = dso;
-			} else
-			{	/* Failed, clean up what getdso() did. */
-				LOGIT("malloc(%zu): %m", sizeof(*dso));
-				munmap((void *)file, fsize);
-				close(hfile);
+				close(fd);
+				return NULL;
 			}
+			buf = p;
+		}
+		if ((n = read(fd, &buf[len], size - len - 1)) > 0)
+			len += n;
+	} while (n > 0);
+	close(fd);
+	if (n < 0)
+		return NULL;
+	buf[len] = '\0';
 
-			return report_function(*funamep)
-				? *funamep != NULL : -1;
-		} else if (dso->fname == info.dli_fname)
-		{
-			/* info.dli_fname pointers point to some program
-			 * header and are the same for all invocations. */
-			*funamep = getsym(dso, info.dli_fbase, addr);
-			return report_function(*funamep)
-				? *funamep != NULL : -1;
-		} /* if */
-	} /* for */
-} /* addr2name */
-/* }}} */
+	/* The arguments are separated by '\0's. */
+	argc = 0;
+	for (p = buf; p < &buf[len]; p += strlen(p) + 1)
+		argc++;
+	if (!(argv = malloc(sizeof(*argv) * (argc + 1))))
+		return NULL;
+	argc = 0;
+	for (p = buf; p < &buf[len]; p += strlen(p) + 1)
+		argv[argc++] = p;
+	argv[argc] = NULL;
 
-/* Printing the trace {{{ */
-static char const *procinfo(void)
+	*argcp = argc;
+	return argv;
+} /* read_cmdline */
+
+/* Sets the "NAME=value" $var of a launcher_opt_st, or "NAME" to $arg. */
+static void set_launcher_var(char const *var, char const *arg)
 {
-	static int need_time = -1, need_tid = -1;
-	static char pi[64];
-	struct timeval tv;
+	char name[32];
+	char const *eq;
 
-	if (need_time < 0)
+	if ((eq = strchr(var, '=')) != NULL)
 	{
-		char const *env;
-
-		need_time = (env = getenv("TRACY_LOG_TIME")) && env[0] == '1';
-		need_tid  = (env = getenv("TRACY_LOG_TID"))  && env[0] == '1';
+		snprintf(name, sizeof(name), "%.*s", (int)(eq - var), var);
+		var = name;
+		arg = eq + 1;
 	}
-
-	if (!need_time && !need_tid)
-	{
-		/* NOP */
-	} else if (need_time && !need_tid)
+	if (setenv(var, arg, 1) < 0)
 	{
-		gettimeofday(&tv, NULL);
-		sprintf(pi, "%lu.%06lu ", tv.tv_sec, tv.tv_usec);
-	} else if (!need_time && need_tid)
-	{
-		sprintf(pi, "%u ", gettid());
-	} else
-	{
-		gettimeofday(&tv, NULL);
-		sprintf(pi, "%lu.%06lu[%u] ", tv.tv_sec, tv.tv_usec, gettid());
+		fprintf(stderr, "tracy: setenv: %m\n");
+		exit(1);
 	}
+} /* set_launcher_var */
 
-	return pi;
-}
+#ifdef __x86_64__
+/*
+ * -attach stops the process with ptrace(), calls setenv() in it for each
+ * of our $TRACY_* variables, then dlopen()s us, and lets the process go on
+ * as it was.  The functions are called on its main thread's stack, below
+ * the red zone, returning to address 0, where the process faults and we get
+ * it back.  We find them where libc is mapped in the process, so it must be
+ * the same file as ours.  The system call the thread was stopped in is
+ * restarted, because the registers are restored with it.  The other threads
+ * keep running.
+ */
+/* The memory of the process we're attaching to. */
+static int Mem_fd = -1;
 
-/* Print the symbol address => name resolution table in $TRACY_ASYNC mode. */
-static void resolve_backlog(void)
+/* Returns where the function $fun of ours is in the process $pid, which
+ * must have the same file mapped, or 0 if it doesn't. */
+static unsigned long remote_addr(pid_t pid, void const *fun)
 {
-	void *addr;
+	FILE *st;
+	Dl_info info;
+	struct stat sbuf;
+	char fname[64], line[PATH_MAX + 128];
+	unsigned long start, offset, ino, addr;
+	unsigned major, minor;
 
-	/* A lot of entries will be duplicate but nevermind. */
-	LOGIT("SYMTAB:");
-	lseek(Async_fd, SEEK_SET, 0);
-	while (read(Async_fd, &addr, sizeof(addr)) == sizeof(addr))
-	{
-		char const *fname, *funame;
+	if (!fun || !dladdr(fun, &info) || stat(info.dli_fname, &sbuf) < 0)
+		return 0;
 
-		switch (addr2name(&fname, &funame, addr))
-		{
-		case 1:
-			LOGIT("%p = %s:%s()", addr, fname, funame);
-			break;
-		case 0:
-			LOGIT("%p = %s:[%p]", addr, fname, addr);
+	sprintf(fname, "/proc/%d/maps", pid);
+	if (!(st = fopen(fname, "r")))
+		return 0;
+	addr = 0;
+	while (fgets(line, sizeof(line), st))
+		/* "<start>-<end> <perms> <offset> <major>:<minor> <inode>" */
+		if (sscanf(line, "%lx-%*x %*s %lx %x:%x %lu", &start, &offset,
+				&major, &minor, &ino) == 5
+			&& !offset && ino == sbuf.st_ino
+			&& makedev(major, minor) == sbuf.st_dev)
+		{	/* .dli_fbase is where the file starts. */
+			addr = start + ((char const *)fun
+				- (char const *)info.dli_fbase);
 			break;
 		}
-	}
-	close(Async_fd);
-}
+	fclose(st);
+	return addr;
+} /* remote_addr */
 
-/* Determines which function the control flow entered/left
- * and prints the trace message. */
-static int print_trace(void *addr, char const *dir)
+/* Copies $str onto the stack of the process below $*spp, and moves $*spp
+ * down past it.  Returns where it is or 0. */
+static unsigned long remote_str(unsigned long *spp, char const *str)
 {
-	static unsigned depth_limit;
-	static int depth_limited = -1, be_async = -1, entries_only = -1;
-	static int indent = -1, log_fname = -1;
-	char const *env, *colon, *fname, *funame;
-	int is_entry, success;
+	size_t len;
 
-	/* Read $TRACY_MAXDEPTH if we haven't. */
-	if (depth_limited < 0)
+	len = strlen(str) + 1;
+	*spp = (*spp - len) & ~15ul;
+	if (pwrite(Mem_fd, str, len, *spp) != (ssize_t)len)
 	{
-		if ((env = getenv("TRACY_MAXDEPTH")) && env[0])
-		{
-			depth_limit = atoi(env);
-			depth_limited = 1;
-		} else
-			depth_limited = 0;
+		fprintf(stderr, "tracy: can't write the stack: %m\n");
+		return 0;
 	}
+	return *spp;
+} /* remote_str */
 
-	/* Have we reached the limit? */
-	if (depth_limited && Callstack_depth >= depth_limit)
-		return 1;
+/* Calls $fun in the process $pid with $args and the stack at $sp, and
+ * returns what it returned in $*retp.  $regs are what the process was
+ * stopped with.  Returns whether it succeeded. */
+static int remote_call(pid_t pid, struct user_regs_struct const *regs,
+	unsigned long fun, unsigned long sp, unsigned long const args[3],
+	unsigned long *retp)
+{
+	int status, signum;
+	unsigned long zero;
+	struct user_regs_struct call;
 
-#ifndef __ARMEL__
+	/* Push a return address like a call instruction would. */
+	zero = 0;
+	call = *regs;
+	call.rsp = sp - sizeof(zero);
+	if (pwrite(Mem_fd, &zero, sizeof(zero), call.rsp) != sizeof(zero))
 	{
-		void *addrs[3];
+		fprintf(stderr, "tracy: can't write the stack: %m\n");
+		return 0;
+	}
+	call.rip = fun;
+	call.rdi = args[0];
+	call.rsi = args[1];
+	call.rdx = args[2];
+	call.rax = 0;
 
-		/*
-		 * In the frame:
-		 * [0] this function,
-		 * [1] the instrumentation function,
-		 * [2] the function we're interested in.
-		 *
-		 * On ARM backtrace() is unreliable, so use $addr directly.
-		 * On x86 we can't avoid this call.
-		 */
-		if (backtrace(addrs, 3) < 3)
-			return 1;
-		addr = addrs[2];
+	/* Don't let the kernel restart the system call it was in. */
+	call.orig_rax = -1;
+	if (ptrace(PTRACE_SETREGS, pid, NULL, &call) < 0)
+	{
+		fprintf(stderr, "tracy: ptrace: %m\n");
+		return 0;
 	}
-#endif /* ! __ARMEL__ */
 
-	/* In async mode create a temporary file where we can write symbol
-	 * addresses the program encounters on function calls enters. */
-	if (be_async < 0)
+	/* Pass on the signals it gets in the meantime. */
+	for (signum = 0; ; )
 	{
-		be_async = (env = getenv("TRACY_ASYNC")) && env[0] == '1';
-		if (be_async)
+		if (ptrace(PTRACE_CONT, pid, NULL, signum) < 0
+			|| waitpid(pid, &status, __WALL) < 0)
 		{
-			static char tmpfname[] = "/tmp/tracy.XXXXXX";
-
-			if ((Async_fd = mkstemp(tmpfname)) < 0)
-			{
-				LOGIT("mkstemp: %m");
-				be_async = 0;
-			} else
-			{
-				unlink(tmpfname);
-				atexit(resolve_backlog);
-			}
+			fprintf(stderr, "tracy: ptrace: %m\n");
+			return 0;
+		} else if (!WIFSTOPPED(status))
+		{
+			fprintf(stderr, "tracy: %d has exited\n", pid);
+			return 0;
 		}
-	} /* be_async? */
 
-	/* Log only function entries? */
-	is_entry = dir[0] == 'E';
-	if (entries_only < 0)
-		entries_only = (env = getenv("TRACY_LOG_ENTRIES_ONLY"))
-			&& env[0] == '1';
-	if (entries_only)
-		dir = "";
+		if (status >> 16 == PTRACE_EVENT_STOP)
+			/* A group-stop. */
+			signum = 0;
+		else if ((signum = WSTOPSIG(status)) == SIGSEGV)
+			break;
+	}
+
+	if (ptrace(PTRACE_GETREGS, pid, NULL, &call) < 0)
+	{
+		fprintf(stderr, "tracy: ptrace: %m\n");
+		return 0;
+	} else if (call.rip != 0)
+	{
+		fprintf(stderr, "tracy: %d crashed at %#llx\n", pid, call.rip);
+		return 0;
+	}
 
-	/* Get how much to indent $fname:$funame. */
-	if (indent < 0)
-		indent = (env = getenv("TRACY_LOG_INDENT")) ? atoi(env) : 0;
+	*retp = call.rax;
+	return 1;
+} /* remote_call */
 
-	/* Write the async file if necessary. */
-	if (Async_fd >= 0)
-	{	/* resolve_backlog() will resolve $addr when we exit. */
-		if (!entries_only || is_entry)
-			LOGIT("%s%s[%u]%*s[%p]", procinfo(), dir,
-				Callstack_depth,
-				1 + indent*Callstack_depth, " ", addr);
-		if (is_entry)
-			/* Try not to bloat the file, it'll have
-			 * lots of identical entries anyway. */
-			write(Async_fd, &addr, sizeof(addr));
+/* Loads $self into the running process $pid with our $TRACY_* variables.
+ * Returns the exit code of the launcher. */
+static int attach(pid_t pid, char const *self)
+{
+	extern char **environ;
+	char fname[64], **env;
+	int status, ret;
+	unsigned long setenv_addr, dlopen_addr, dlerror_addr;
+	unsigned long sp, ok, args[3];
+	struct user_regs_struct regs;
+
+	/* Stop it without a signal it would notice. */
+	if (ptrace(PTRACE_SEIZE, pid, NULL, NULL) < 0
+		|| ptrace(PTRACE_INTERRUPT, pid, NULL, NULL) < 0)
+	{
+		fprintf(stderr, "tracy: %d: %m\n", pid);
 		return 1;
 	}
+	ret = 1;
 
-	/* Resolve $addr. */
-	if ((success = addr2name(&fname, &funame, addr)) < 0)
-		/* Omitted from output, don't count it in $Callstack_depth. */
-		return 0;
+	/* We have a dlopen() of our own. */
+	if (!(setenv_addr = remote_addr(pid, (void const *)setenv))
+		|| !(dlopen_addr = remote_addr(pid,
+			dlsym(RTLD_NEXT, "dlopen")))
+		|| !(dlerror_addr = remote_addr(pid, (void const *)dlerror)))
+	{
+		fprintf(stderr, "tracy: %d doesn't have our libc\n", pid);
+		goto out0;
+	}
+	for (;;)
+		if (waitpid(pid, &status, __WALL) < 0)
+		{
+			fprintf(stderr, "tracy: waitpid: %m\n");
+			goto out0;
+		} else if (!WIFSTOPPED(status))
+		{
+			fprintf(stderr, "tracy: %d has exited\n", pid);
+			return 1;
+		} else if (status >> 16 == PTRACE_EVENT_STOP)
+			break;
+		else if (ptrace(PTRACE_CONT, pid, NULL, WSTOPSIG(status)) < 0)
+		{	/* The signal is delivered, the interrupt is pending. */
+			fprintf(stderr, "tracy: ptrace: %m\n");
+			goto out0;
+		}
 
-	/* Don't log LEAVE:s if $entries_only. */
-	if (entries_only && !is_entry)
-		return 1;
+	sprintf(fname, "/proc/%d/mem", pid);
+	if ((Mem_fd = open(fname, O_RDWR | O_CLOEXEC)) < 0)
+	{
+		fprintf(stderr, "tracy: %s: %m\n", fname);
+		goto out0;
+	}
+	if (ptrace(PTRACE_GETREGS, pid, NULL, &regs) < 0)
+	{
+		fprintf(stderr, "tracy: ptrace: %m\n");
+		goto out1;
+	}
 
-	/* Print or omit the "<$fname>:" in front of $funame? */
-	if (log_fname < 0)
-		log_fname = (env = getenv("TRACY_LOG_FNAME")) ? env[0] == '1' : 1;
-	if (log_fname)
-		colon = ":";
-	else
-		fname = colon = "";
+	/* Leave the red zone of the stack alone.  If we're there already
+	 * it's too late to change the configuration. */
+	sp = regs.rsp - 128;
+	if (!(args[0] = remote_str(&sp, self)))
+		goto out2;
+	args[1] = RTLD_LAZY | RTLD_NOLOAD;
+	args[2] = 0;
+	if (!remote_call(pid, &regs, dlopen_addr, sp, args, &ok))
+		goto out2;
+	if (ok)
+	{
+		fprintf(stderr, "tracy: %d is traced already\n", pid);
+		goto out2;
+	}
 
-	/* Log the damn thing. */
-	if (success)
-		LOGIT("%s%s[%u]%*s%s%s%s()", procinfo(),
-			dir, Callstack_depth, 1 + indent*Callstack_depth, " ",
-			fname, colon, funame);
-	else
-		LOGIT("%s%s[%u]%*s%s%s[%p]", procinfo(),
-			dir, Callstack_depth, 1 + indent*Callstack_depth, " ",
-			fname, colon, addr);
+	for (env = environ; *env; env++)
+	{
+		char name[64];
+		char const *eq;
 
-	/* We've logged something. */
-	return 1;
-} /* print_trace */
+		if (strncmp(*env, "TRACY_", 6)
+				|| !(eq = strchr(*env, '='))
+				|| eq - *env >= (int)sizeof(name))
+			continue;
+		snprintf(name, sizeof(name), "%.*s", (int)(eq - *env), *env);
 
-/* The functions below are invoked automatically by code generated
- * by the compiler.  These are the entry points of the library. */
-void __cyg_profile_func_enter(void *self, void *callsite)
-{
-	if (!Tracing)
-		return;
-	if (print_trace(self, "ENTER"))
-		Callstack_depth++;
-}
+		sp = regs.rsp - 128;
+		if (!(args[0] = remote_str(&sp, name))
+				|| !(args[1] = remote_str(&sp, eq + 1)))
+			goto out2;
+		args[2] = 1;
+		if (!remote_call(pid, &regs, setenv_addr, sp, args, &ok))
+			goto out2;
+		if ((int)ok != 0)
+		{
+			fprintf(stderr, "tracy: %d: can't set %s\n", pid, name);
+			goto out2;
+		}
+	}
 
-void __cyg_profile_func_exit(void *self, void *callsite)
+	/* Our constructor does the rest. */
+	sp = regs.rsp - 128;
+	if (!(args[0] = remote_str(&sp, self)))
+		goto out2;
+	args[1] = RTLD_NOW;
+	args[2] = 0;
+	if (!remote_call(pid, &regs, dlopen_addr, sp, args, &ok))
+		goto out2;
+	if (!ok)
+	{	/* Why? */
+		char error[256];
+		ssize_t len;
+
+		if (remote_call(pid, &regs, dlerror_addr, sp, args, &ok) && ok
+			&& (len = pread(Mem_fd, error, sizeof(error) - 1,
+				ok)) > 0)
+		{
+			error[len] = '\0';
+			fprintf(stderr, "tracy: %d: %s\n", pid, error);
+		} else
+			fprintf(stderr, "tracy: %d: dlopen(%s) failed\n",
+				pid, self);
+		goto out2;
+	}
+	ret = 0;
+
+out2:	if (ptrace(PTRACE_SETREGS, pid, NULL, &regs) < 0)
+		fprintf(stderr, "tracy: ptrace: %m\n");
+out1:	close(Mem_fd);
+out0:	ptrace(PTRACE_DETACH, pid, NULL, NULL);
+	return ret;
+} /* attach */
+#else /* ! __x86_64__ */
+static int attach(pid_t pid, char const *self)
 {
-	if (!Tracing)
-		return;
-	Callstack_depth--;
-	if (!print_trace(self, "LEAVE"))
-		Callstack_depth++;
-}
-/* }}} */
+	fprintf(stderr, "tracy: -attach is only supported on x86_64\n");
+	return 1;
+} /* attach */
+#endif /* ! __x86_64__ */
 
-/* Initialization {{{ */
-static void toggle_tracing(int signum)
+/* The entry point of the program, see above.  It doesn't return. */
+void tracy_main(void) __attribute__((noreturn, visibility("hidden")));
+
+#if defined(__i386__) || defined(__x86_64__)
+/* The stack is not aligned like for a function at the entry point. */
+__attribute__((force_align_arg_pointer))
+#endif
+void tracy_main(void)
 {
-	Tracing = !Tracing;
-}
+	int argc, i;
+	unsigned j;
+	pid_t pid;
+	ssize_t len;
+	char const *env;
+	char **argv, *list, self[PATH_MAX];
 
-/* Start tracing or install a signal handler to start it later. */
-static __attribute__((constructor))
-void tracy_init(void)
-{
-   char const *env;
-
-   env = getenv("TRACY_SIGNAL");
-   if (env)
-   {
-	   int signum;
-
-	   if (env[0] == 'y' || env[0] == 'Y')
-		   signum = SIGPROF;
-	   else if ((signum = atoi(env)) <= 0)
-		   LOGIT("couldn't understand $TRACY_SIGNAL=%s", env);
-	   signal(signum, toggle_tracing);
-	   Tracing = 0;
-   }
-}
+	if (!(argv = read_cmdline(&argc)) || !argc)
+	{
+		fprintf(stderr, "tracy: /proc/self/cmdline: %m\n");
+		exit(1);
+	}
+
+	/* Parse the command line and set $TRACY_*. */
+	pid = 0;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++)
+	{
+		struct launcher_opt_st const *opt;
+		char const *arg;
+
+		if (!strcmp(argv[i], "-attach") && i + 1 < argc)
+		{
+			if ((pid = atoi(argv[++i])) <= 0)
+				launcher_usage(argv[0]);
+			continue;
+		}
+
+		for (j = 0; j < NLAUNCHER_OPTIONS; j++)
+			if (!strcmp(argv[i], Launcher_options[j].name))
+				break;
+		if (j >= NLAUNCHER_OPTIONS)
+			launcher_usage(argv[0]);
+		opt = &Launcher_options[j];
+		if (opt->arg && i + 1 >= argc)
+			launcher_usage(argv[0]);
+
+		arg = opt->arg ? argv[++i] : NULL;
+		for (j = 0; j < sizeof(opt->vars) / sizeof(opt->vars[0])
+				&& opt->vars[j]; j++)
+			set_launcher_var(opt->vars[j], arg);
+	} /* for */
+	if (pid ? i < argc : i >= argc)
+		launcher_usage(argv[0]);
+
+	/* We are the library. */
+	if ((len = readlink("/proc/self/exe", self, sizeof(self) - 1)) < 0)
+	{
+		fprintf(stderr, "tracy: /proc/self/exe: %m\n");
+		exit(1);
+	}
+	self[len] = '\0';
+	if (pid)
+		exit(attach(pid, self));
+
+	/* Add $self to $LD_PRELOAD, and in scratchbox to $SBOX_PRELOAD,
+	 * only for target binaries. */
+	if ((env = getenv("LD_PRELOAD")) && env[0])
+	{
+		if (asprintf(&list, "%s:%s", env, self) < 0)
+			list = NULL;
+	} else
+		list = self;
+	if (!list || setenv("LD_PRELOAD", list, 1) < 0)
+	{
+		fprintf(stderr, "tracy: setenv: %m\n");
+		exit(1);
+	}
+	if (!(env = getenv("SBOX_PRELOAD")))
+		env = "";
+	if (asprintf(&list, "%s%c%s", env, strchr(env, ',') ? ':' : ',',
+			self) < 0 || setenv("SBOX_PRELOAD", list, 1) < 0)
+	{
+		fprintf(stderr, "tracy: setenv: %m\n");
+		exit(1);
+	}
+
+	/* Go */
+	execvp(argv[i], &argv[i]);
+	fprintf(stderr, "tracy: %s: %m\n", argv[i]);
+	exit(127);
+} /* tracy_main */
+#endif /* CONFIG_INTERP */
 /* }}} */
 
 /* vim: set foldmethod=marker: */
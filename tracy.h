@@ -0,0 +1,124 @@
+/*
+ * tracy.h -- the binary trace and shared memory formats
+ *
+ * {{{
+ * With $TRACY_ASYNC=binary libtracy writes the trace in a compact format,
+ * which is much smaller and cheaper to produce than the text.  libtracy.c
+ * writes it, ares.c reads it.  The dumps of $TRACY_MODE=flight are in the
+ * same format, without BIN_SYMTAB sections.
+ *
+ * The file starts with a header of 8 bytes: TRACY_MAGIC, the version
+ * of the format and flags (BIN_HAS_TIME if the timestamps are meaningful),
+ * then come sections, each starting with a tag byte:
+ *
+ * -- BIN_EVENTS, <tid>, <nevents>, <length>, followed by <length> bytes of
+ *    <nevents> records of consecutive events of the thread:
+ *    <BIN_ENTER or BIN_LEAVE>, <depth>, <time delta>, <address delta>.
+ *    The time is in nanoseconds since the Epoch and the deltas are relative
+ *    to the previous record in the section (starting from 0).  The deltas
+ *    are signed.
+ * -- BIN_DROPPED, <tid>, <count>: this many events of the thread were lost
+ *    because its ring overflowed.
+ * -- BIN_SYMTAB, <length>, followed by <length> bytes of symbol entries:
+ *    <address>, <resolved>, <fname length>, <fname>, <funame length>,
+ *    <funame>.  <resolved> is a byte, 1 if <funame> is valid.  These are
+ *    written at exit, after all the events.
+ * -- BIN_MAP, <load address>, <start>, <end>, <path length>, <path>,
+ *    <build ID length>, <build ID>: a DSO is mapped from <start> to <end>
+ *    (not included), and its symbol values are relative to the load
+ *    address.  These precede the events of the DSO.  Since version 2.
+ * -- BIN_PROCESS, <pid>: the PID of the traced process.  This is the first
+ *    section.  Since version 3.
+ * -- BIN_END, followed by the 64-bit little-endian offset of the first
+ *    BIN_SYMTAB section.  This is the last thing in the file.
+ *
+ * All numbers are unsigned LEB128 varints unless noted otherwise.
+ * Signed numbers are zigzag-encoded first.  Strings are not terminated.
+ * }}}
+ */
+#ifndef TRACY_H
+#define TRACY_H
+
+#include <stdint.h>
+
+#define TRACY_MAGIC		"\177TRACY"
+#define TRACY_VERSION		3
+#define BIN_HAS_TIME		0x01
+
+#define BIN_EVENTS		1
+#define BIN_DROPPED		2
+#define BIN_SYMTAB		3
+#define BIN_END			4
+#define BIN_MAP			5
+#define BIN_PROCESS		6
+
+#define BIN_ENTER		1
+#define BIN_LEAVE		2
+
+/* Shared memory {{{ */
+/*
+ * With $TRACY_SHM the trace is written into a shared memory object or
+ * a memory-mapped file, which other processes can map and read while
+ * the program is running.  The region starts with a tracy_shm_st, which
+ * tells where the rest is:
+ *
+ * -- .nrings tracy_shm_ring_st:s of .ring_size events each, starting at
+ *    .rings_offset, at every .ring_stride bytes.  Each thread of the
+ *    program appends its events to its own ring: it writes the event at
+ *    .head % .ring_size, then increments .head.  Nobody waits for the
+ *    readers, so they need to keep up: the event at index $i is valid
+ *    only if .head hasn't reached $i + .ring_size by the time it's been
+ *    read.  When a thread exits its ring may be taken by a new one, which
+ *    sets .tid and continues from the same .head with an SHM_OWNER event,
+ *    whose .addr is the new .tid.  The threads of the children the program
+ *    fork()s take rings in the same region.
+ * -- The symbol log of .symlog_size bytes at .symlog_offset, in which
+ *    .symlog_used have been allocated.  This is a sequence of text lines
+ *    like those after "SYMTAB:" or the "MAP:" lines of the text trace,
+ *    telling the function names of the addresses, or where each DSO is
+ *    loaded.  A line is complete if its first byte is not zero.
+ *
+ * The times of the events are read_clock() values.  They can be converted
+ * to nanoseconds since the Epoch as .clock_base_ns + (time - .clock_base)
+ * * .ns_per_tick.  .finished is set when the program exits.  The numbers
+ * are in the byte order of the machine.
+ */
+#define TRACY_SHM_MAGIC		"\177TRACYSHM"
+#define TRACY_SHM_VERSION	2
+#define SHM_HAS_TIME		0x01
+#define SHM_OWNER		3
+
+struct tracy_shm_event_st
+{
+	uint64_t time, addr;
+	uint32_t depth, type;		/* BIN_ENTER, BIN_LEAVE or SHM_OWNER */
+};
+
+struct tracy_shm_ring_st
+{
+	uint32_t owned, tid;
+	uint64_t head;
+	uint64_t padding[6];
+	struct tracy_shm_event_st events[];
+};
+
+struct tracy_shm_st
+{
+	char magic[10];
+	uint16_t version;
+	uint32_t flags, pid, finished;
+	uint32_t nrings, ring_size;
+	uint64_t ring_stride, rings_offset;
+	uint64_t symlog_offset, symlog_size, symlog_used;
+	uint64_t clock_base, clock_base_ns;
+	double ns_per_tick;
+
+	/* The events of the threads which couldn't have a ring. */
+	uint64_t lost;
+};
+/* }}} */
+
+#endif /* ! TRACY_H */
+
+/* vim: set foldmethod=marker: */
+/* End of tracy.h */